@@ -1,5 +1,7 @@
 #include "ast.h"
 
+#include <algorithm>
+
 #include "util/compare.h"
 
 namespace sdfjit::ast {
@@ -20,6 +22,10 @@ bool Node::is_same_as(Ast &ast, Node &other) {
     return util::floats_equal(value, other.value);
   }
 
+  if (op == Op::Uniform) {
+    return uniform_index == other.uniform_index;
+  }
+
   if (children.size() != other.children.size()) {
     return false;
   }
@@ -50,6 +56,8 @@ void Ast::dump(std::ostream &os) {
     os << node.op << '(';
     if (node.op == Op::Float32) {
       os << node.value;
+    } else if (node.op == Op::Uniform) {
+      os << uniform_names.at(node.uniform_index);
     } else {
       // this will put an extra , on the last one but whatever
       for (const auto child_id : node.children) {
@@ -74,6 +82,9 @@ void dump_node_sexpr(const Ast &ast, Node_Id id, std::ostream &os,
   if (ast.nodes[id].op == Op::Float32) {
     emit_indent(indent + 1);
     os << ast.nodes[id].value << std::endl;
+  } else if (ast.nodes[id].op == Op::Uniform) {
+    emit_indent(indent + 1);
+    os << ast.uniform_names.at(ast.nodes[id].uniform_index) << std::endl;
   } else {
     for (auto child_id : ast.nodes[id].children) {
       if (child_id < 0) {
@@ -124,6 +135,24 @@ Node_Id Ast::plane(Node_Id position, Node_Id normal, Node_Id material) {
 
 Node_Id Ast::float32(float value) { return add_node({Op::Float32, {}, value}); }
 
+Node_Id Ast::uniform(std::string_view name) {
+  auto existing = std::find(uniform_names.begin(), uniform_names.end(), name);
+  auto index = size_t(existing - uniform_names.begin());
+  if (existing == uniform_names.end()) {
+    uniform_names.emplace_back(name);
+  }
+  return add_node(Node{Op::Uniform, {IN_CONSTANTS}, 0.0f, index});
+}
+
+size_t Ast::uniform_index(std::string_view name) const {
+  auto existing = std::find(uniform_names.begin(), uniform_names.end(), name);
+  if (existing == uniform_names.end()) {
+    std::cerr << "No uniform called " << name << std::endl;
+    abort();
+  }
+  return size_t(existing - uniform_names.begin());
+}
+
 Node_Id Ast::pos3(float x, float y, float z) {
   return pos3(float32(x), float32(y), float32(z));
 }
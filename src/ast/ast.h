@@ -1,6 +1,8 @@
 #pragma once
 
 #include <iostream>
+#include <string>
+#include <string_view>
 #include <vector>
 
 namespace sdfjit::ast {
@@ -15,6 +17,7 @@ namespace sdfjit::ast {
     macro(Plane) \
     macro(Float32) \
     macro(Pos3) \
+    macro(Uniform) \
     macro(Noop) \
     /* Composition operators */ \
     macro(Add) \
@@ -48,12 +51,15 @@ struct Node {
   // XXX: do we want to stuff these together into a variant?
   std::vector<Node_Id> children; // for non-float32 nodes
   float value{0.};               // for float32 nodes
+  size_t uniform_index{0};       // for uniform nodes
 
   bool is_same_as(Ast &ast, Node &other);
 };
 
 struct Ast {
   std::vector<Node> nodes{};
+  // uniform_index -> the name it was made with
+  std::vector<std::string> uniform_names{};
 
   Node_Id add_node(const Node &node) {
     nodes.push_back(node);
@@ -74,6 +80,12 @@ struct Ast {
   Node_Id plane(Node_Id position, Node_Id normal, float material);
   Node_Id plane(Node_Id position, Node_Id normal, Node_Id material);
   Node_Id float32(float value);
+  // a float that's read from the uniforms passed to the kernel each time it's
+  // called, so it can change without recompiling. Asking for the same name
+  // again gets the same uniform.
+  Node_Id uniform(std::string_view name);
+  // where the uniform called `name` goes in the uniforms buffer
+  size_t uniform_index(std::string_view name) const;
   Node_Id pos3(float x, float y, float z);
   Node_Id pos3(Node_Id x, Node_Id y, Node_Id z);
   /* Composition Operators */
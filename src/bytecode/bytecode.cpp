@@ -4,6 +4,9 @@
 #include <cmath>
 #include <unordered_map>
 
+#include "differentiate.h"
+#include "intervals.h"
+
 namespace sdfjit::bytecode {
 
 std::ostream &operator<<(std::ostream &os, Op op) {
@@ -54,6 +57,30 @@ void Bytecode::replace_all_uses_with(Node_Id from, Node_Id to) {
   }
 }
 
+std::vector<bool> Bytecode::uniform_values() const {
+  std::vector<bool> uniform(nodes.size(), false);
+  for (size_t id = 0; id < nodes.size(); id++) {
+    const auto &node = nodes[id];
+    if (node.op == Op::Load_Uniform) {
+      uniform[id] = true;
+      continue;
+    }
+    if (!node.has_arguments() || node.is_store()) {
+      continue;
+    }
+
+    bool any_uniform = false;
+    bool all_uniform_or_constant = true;
+    for (auto arg : node.arguments) {
+      any_uniform |= uniform[arg];
+      all_uniform_or_constant &=
+          uniform[arg] || nodes[arg].op == Op::Assign_Float;
+    }
+    uniform[id] = any_uniform && all_uniform_or_constant;
+  }
+  return uniform;
+}
+
 void Bytecode::dump(std::ostream &os) {
   for (size_t i = 0; i < nodes.size(); i++) {
     auto &node = nodes[i];
@@ -61,11 +88,15 @@ void Bytecode::dump(std::ostream &os) {
     os << node.op << '(';
     if (node.op == Op::Assign_Float) {
       os << node.value;
-    } else if (node.op == Op::Load_Arg) {
+    } else if (node.op == Op::Load_Arg || node.op == Op::Load_Upper) {
       os << node.arg_index;
     } else {
       if (node.op == Op::Select) {
         os << node.select_type << ", ";
+      } else if (node.op == Op::SinCos || node.op == Op::Extract) {
+        os << node.result_index << ", ";
+      } else if (node.op == Op::Load_Uniform) {
+        os << node.arg_index << ", ";
       }
 
       for (const auto arg_id : node.arguments) {
@@ -79,7 +110,7 @@ void Bytecode::dump(std::ostream &os) {
   }
 }
 
-Bytecode Bytecode::from_ast(sdfjit::ast::Ast &ast) {
+Bytecode Bytecode::from_ast(sdfjit::ast::Ast &ast, Outputs outputs) {
   Bytecode bc{};
 
   // map an ast id to a list of "results" generated by that node's bytecode
@@ -201,6 +232,13 @@ Bytecode Bytecode::from_ast(sdfjit::ast::Ast &ast) {
       break;
     }
 
+    case sdfjit::ast::Op::Uniform: {
+      auto uniforms = ast_results.at(node.children.at(0))[0];
+      auto result = bc.load_uniform(uniforms, node.uniform_index);
+      ast_results[i] = {result};
+      break;
+    }
+
     case sdfjit::ast::Op::Pos3: {
       // we don't actually emit anything, but we do setup ast_results
       // appropriately.
@@ -390,7 +428,23 @@ Bytecode Bytecode::from_ast(sdfjit::ast::Ast &ast) {
   }
 
   auto result = ast_results.at(ast.nodes.size() - 1);
-  bc.store_result(result.at(0), result.at(1));
+  switch (outputs) {
+  case Outputs::Distance_And_Material:
+    bc.store_result(result.at(0), result.at(1));
+    break;
+  case Outputs::Distance:
+    bc.store_distance(result.at(0));
+    break;
+  case Outputs::Material:
+    bc.store_material(result.at(1));
+    break;
+  case Outputs::Normal:
+    bc.store_distance(result.at(0));
+    return differentiate(bc);
+  case Outputs::Distance_Interval:
+    bc.store_distance(result.at(0));
+    return to_intervals(bc);
+  }
 
   return bc;
 }
@@ -401,10 +455,36 @@ Node_Id Bytecode::load_arg(size_t arg_idx) {
   return add_node(Node{Op::Load_Arg, {}, 0.0f, arg_idx});
 }
 
+Node_Id Bytecode::load_upper(size_t arg_idx) {
+  return add_node(Node{Op::Load_Upper, {}, 0.0f, arg_idx});
+}
+
+Node_Id Bytecode::load_uniform(Node_Id uniforms, size_t index) {
+  return add_node(Node{Op::Load_Uniform, {uniforms}, 0.0f, index});
+}
+
 Node_Id Bytecode::store_result(Node_Id distance, Node_Id material) {
   return add_node(Node{Op::Store_Result, {distance, material}});
 }
 
+Node_Id Bytecode::store_distance(Node_Id distance) {
+  return add_node(Node{Op::Store_Distance, {distance}});
+}
+
+Node_Id Bytecode::store_material(Node_Id material) {
+  return add_node(Node{Op::Store_Material, {material}});
+}
+
+Node_Id Bytecode::store_normal(Node_Id distance, Node_Id normal_x,
+                               Node_Id normal_y, Node_Id normal_z) {
+  return add_node(
+      Node{Op::Store_Normal, {distance, normal_x, normal_y, normal_z}});
+}
+
+Node_Id Bytecode::store_interval(Node_Id lo, Node_Id hi) {
+  return add_node(Node{Op::Store_Interval, {lo, hi}});
+}
+
 Node_Id Bytecode::assign_float(float rhs) {
   return add_node(Node{Op::Assign_Float, {}, rhs});
 }
@@ -449,6 +529,18 @@ Node_Id Bytecode::sin(Node_Id val) { return add_node(Node{Op::Sin, {val}}); }
 
 Node_Id Bytecode::cos(Node_Id val) { return add_node(Node{Op::Cos, {val}}); }
 
+Node_Id Bytecode::sin_cos(Node_Id val, size_t result_index) {
+  Node node{Op::SinCos, {val}};
+  node.result_index = result_index;
+  return add_node(node);
+}
+
+Node_Id Bytecode::extract(Node_Id multi_result, size_t result_index) {
+  Node node{Op::Extract, {multi_result}};
+  node.result_index = result_index;
+  return add_node(node);
+}
+
 Node_Id Bytecode::mod(Node_Id lhs, Node_Id rhs) {
   return add_node(Node{Op::Mod, {lhs, rhs}});
 }
@@ -13,7 +13,13 @@ namespace sdfjit::bytecode {
 #define FOREACH_BC_OP(macro) \
     macro(Nop) \
     macro(Load_Arg) \
+    macro(Load_Uniform) \
+    macro(Load_Upper) \
     macro(Store_Result) \
+    macro(Store_Distance) \
+    macro(Store_Material) \
+    macro(Store_Normal) \
+    macro(Store_Interval) \
     macro(Assign_Float) \
     macro(Add) \
     macro(Subtract) \
@@ -26,6 +32,8 @@ namespace sdfjit::bytecode {
     macro(Max) \
     macro(Sin) \
     macro(Cos) \
+    macro(SinCos) \
+    macro(Extract) \
     macro(Mod) \
     macro(Select)
 
@@ -48,21 +56,53 @@ enum class Select_Type {
 #undef DEFINE_ENUM_MEMBER_FOR_SELECT_TYPE
 std::ostream &operator<<(std::ostream &os, Select_Type select_type);
 
+// which of the results a kernel stores. Store_Result stores both, and
+// Store_Distance and Store_Material store just the one (leaving the other
+// output alone, so it can be null). Whatever only fed the result that isn't
+// stored gets optimized out.
+//
+// Store_Normal stores the distance, and the surface normal in place of the
+// material, as three planes of `count` floats (see differentiate, and
+// Executor::call_normals). Store_Interval stores the range the distance is in
+// over a box (see to_intervals).
+enum class Outputs {
+  Distance_And_Material,
+  Distance,
+  Material,
+  Normal,
+  Distance_Interval
+};
+
+// Load_Uniform's argument is the Load_Arg for the uniforms (IN_CONSTANTS), and
+// its arg_index is which one of them it reads. Uniforms are the same for every
+// lane.
+//
+// Load_Upper reads the upper bounds of input arg_index, for interval kernels
+// (the Load_Arg of the same input reads the lower bounds).
+
 // positive = indexes in the bytecode's nodes list.
 // negative = input parameters
 using Node_Id = int32_t;
 
 struct Bytecode;
 
+// SinCos computes both the sin and cos of its argument. The node itself
+// stands for one of them (its result_index), and an Extract of it with the
+// other result_index gets the other one.
 struct Node {
+  static constexpr size_t sin_result = 0;
+  static constexpr size_t cos_result = 1;
+
   Op op;
   std::vector<Node_Id> arguments; // if has_arguments()
   float value{0.0};               // for Assign_Float
-  size_t arg_index{0};            // for Load_Arg
+  size_t arg_index{0};            // for Load_Arg, Load_Upper and Load_Uniform
   Select_Type select_type{0};     // for Select
+  size_t result_index{0};         // for SinCos and Extract
 
   bool has_arguments() const {
-    return op != Op::Assign_Float && op != Op::Load_Arg;
+    return op != Op::Assign_Float && op != Op::Load_Arg &&
+           op != Op::Load_Upper;
   }
 
   bool operator==(const Node &rhs) const {
@@ -71,10 +111,11 @@ struct Node {
     }
     if (has_arguments()) {
       return std::equal(arguments.begin(), arguments.end(),
-                        rhs.arguments.begin(), rhs.arguments.end());
+                        rhs.arguments.begin(), rhs.arguments.end()) &&
+             result_index == rhs.result_index && arg_index == rhs.arg_index;
     } else if (op == Op::Assign_Float) {
       return util::floats_equal(value, rhs.value);
-    } else if (op == Op::Load_Arg) {
+    } else if (op == Op::Load_Arg || op == Op::Load_Upper) {
       return arg_index == rhs.arg_index;
     }
     abort();
@@ -97,6 +138,12 @@ struct Node {
     }
   }
 
+  bool is_store() const {
+    return op == Op::Store_Result || op == Op::Store_Distance ||
+           op == Op::Store_Material || op == Op::Store_Normal ||
+           op == Op::Store_Interval;
+  }
+
   bool uses(Node_Id id) const;
   bool is_constant_expression(const Bytecode &bc) const;
 };
@@ -111,13 +158,29 @@ struct Bytecode {
 
   void replace_all_uses_with(Node_Id from, Node_Id to);
 
+  // which nodes only depend on uniforms and constants (and on at least one
+  // uniform, anything else would have been constant folded). These are the
+  // same for every lane.
+  std::vector<bool> uniform_values() const;
+
   void dump(std::ostream &os);
 
-  static Bytecode from_ast(sdfjit::ast::Ast &ast);
+  static Bytecode
+  from_ast(sdfjit::ast::Ast &ast,
+           Outputs outputs = Outputs::Distance_And_Material);
 
   Node_Id nop();
   Node_Id load_arg(size_t arg_idx);
+  Node_Id load_upper(size_t arg_idx);
+  // read uniform number `index` out of `uniforms`, which is the Load_Arg of
+  // the uniforms buffer
+  Node_Id load_uniform(Node_Id uniforms, size_t index);
   Node_Id store_result(Node_Id distance, Node_Id material);
+  Node_Id store_distance(Node_Id distance);
+  Node_Id store_material(Node_Id material);
+  Node_Id store_normal(Node_Id distance, Node_Id normal_x, Node_Id normal_y,
+                       Node_Id normal_z);
+  Node_Id store_interval(Node_Id lo, Node_Id hi);
   Node_Id assign(Node_Id rhs);
   Node_Id assign_float(float rhs);
   Node_Id add(Node_Id lhs, Node_Id rhs);
@@ -131,6 +194,8 @@ struct Bytecode {
   Node_Id max(Node_Id lhs, Node_Id rhs);
   Node_Id sin(Node_Id val);
   Node_Id cos(Node_Id val);
+  Node_Id sin_cos(Node_Id val, size_t result_index);
+  Node_Id extract(Node_Id multi_result, size_t result_index);
   Node_Id mod(Node_Id lhs, Node_Id rhs);
   Node_Id select(Select_Type op, Node_Id lhs, Node_Id rhs, Node_Id true_case,
                  Node_Id false_case);
@@ -0,0 +1,230 @@
+#include "differentiate.h"
+
+#include <array>
+#include <cstdlib>
+#include <iostream>
+
+#include "bytecode.h"
+
+namespace sdfjit::bytecode {
+
+Bytecode differentiate(const Bytecode &bc) {
+  Bytecode out{};
+
+  // where each node's value ended up in `out`, and its derivative by x, y and
+  // z
+  using Gradient = std::array<Node_Id, 3>;
+  std::vector<Node_Id> values(bc.nodes.size());
+  std::vector<Gradient> gradients(bc.nodes.size());
+
+  auto zero = out.assign_float(0.0f);
+  auto one = out.assign_float(1.0f);
+
+  auto scale = [&out](Node_Id factor, const Gradient &gradient) -> Gradient {
+    return {out.multiply(factor, gradient[0]),
+            out.multiply(factor, gradient[1]),
+            out.multiply(factor, gradient[2])};
+  };
+  // d sin(a) = cos(a) da, d cos(a) = -sin(a) da
+  auto sin_derivative = [&](Node_Id a, const Gradient &gradient) {
+    return scale(out.cos(a), gradient);
+  };
+  auto cos_derivative = [&](Node_Id a, const Gradient &gradient) {
+    return scale(out.negate(out.sin(a)), gradient);
+  };
+
+  for (size_t id = 0; id < bc.nodes.size(); id++) {
+    const auto &node = bc.nodes[id];
+    if (node.op == Op::Nop) {
+      continue;
+    }
+
+    auto arg = [&](size_t i) { return values[node.arguments.at(i)]; };
+    auto grad = [&](size_t i) { return gradients[node.arguments.at(i)]; };
+    auto each_axis = [&](auto &&derivative) {
+      for (size_t axis = 0; axis < 3; axis++) {
+        gradients[id][axis] = derivative(axis);
+      }
+    };
+
+    if (node.op == Op::Store_Distance) {
+      // the normal is the gradient, scaled to unit length. It can be 0 where
+      // the sdf is flat (or where a min or max is tied between two flat
+      // things), so keep the length off of 0, and those come out as a 0
+      // normal rather than a nan. (Not too close to 0 though, or it counts as
+      // the same constant, see util::floats_equal.) An sdf's gradient is
+      // about unit length anywhere it isn't degenerate, so this doesn't
+      // change any of the real normals.
+      auto g = grad(0);
+      auto length = out.max(
+          out.sqrt(out.add(
+              out.multiply(g[0], g[0]),
+              out.add(out.multiply(g[1], g[1]), out.multiply(g[2], g[2])))),
+          out.assign_float(1e-4f));
+      out.store_normal(arg(0), out.divide(g[0], length),
+                       out.divide(g[1], length), out.divide(g[2], length));
+      continue;
+    }
+    if (node.is_store()) {
+      std::cerr << "differentiate: can only differentiate a Store_Distance, "
+                   "not a "
+                << node.op << std::endl;
+      abort();
+    }
+
+    // the value itself is worked out just like before
+    auto value = node;
+    if (value.has_arguments()) {
+      for (auto &argument : value.arguments) {
+        argument = values[argument];
+      }
+    }
+    values[id] = out.add_node(value);
+    gradients[id] = {zero, zero, zero};
+
+    switch (node.op) {
+    case Op::Load_Arg: {
+      if (node.arg_index < 3) {
+        gradients[id][node.arg_index] = one;
+      }
+      break;
+    }
+
+    case Op::Load_Uniform:
+    case Op::Assign_Float: {
+      // the same everywhere
+      break;
+    }
+
+    case Op::Add: {
+      each_axis([&](size_t axis) {
+        return out.add(grad(0)[axis], grad(1)[axis]);
+      });
+      break;
+    }
+
+    case Op::Subtract: {
+      each_axis([&](size_t axis) {
+        return out.subtract(grad(0)[axis], grad(1)[axis]);
+      });
+      break;
+    }
+
+    case Op::Multiply: {
+      // d(ab) = a db + b da
+      each_axis([&](size_t axis) {
+        return out.add(out.multiply(arg(0), grad(1)[axis]),
+                       out.multiply(arg(1), grad(0)[axis]));
+      });
+      break;
+    }
+
+    case Op::Divide: {
+      // d(a/b) = (da - (a/b) db) / b
+      each_axis([&](size_t axis) {
+        auto quotient_change = out.multiply(values[id], grad(1)[axis]);
+        return out.divide(out.subtract(grad(0)[axis], quotient_change), arg(1));
+      });
+      break;
+    }
+
+    case Op::Sqrt: {
+      // d sqrt(a) = da / (2 sqrt(a)). That's infinite at 0, where it's usually
+      // the length of something that's flat there (like the inside of a box's
+      // max(q, 0)), so call it 0 instead of letting it turn into a nan.
+      auto factor = out.select(Select_Type::LT, zero, values[id],
+                               out.divide(out.assign_float(0.5f), values[id]),
+                               zero);
+      gradients[id] = scale(factor, grad(0));
+      break;
+    }
+
+    case Op::Abs: {
+      each_axis([&](size_t axis) {
+        return out.select(Select_Type::LT, arg(0), zero,
+                          out.negate(grad(0)[axis]), grad(0)[axis]);
+      });
+      break;
+    }
+
+    case Op::Negate: {
+      each_axis([&](size_t axis) { return out.negate(grad(0)[axis]); });
+      break;
+    }
+
+    case Op::Min: {
+      // whichever one was picked
+      each_axis([&](size_t axis) {
+        return out.select(Select_Type::LT, arg(0), arg(1), grad(0)[axis],
+                          grad(1)[axis]);
+      });
+      break;
+    }
+
+    case Op::Max: {
+      each_axis([&](size_t axis) {
+        return out.select(Select_Type::LT, arg(1), arg(0), grad(0)[axis],
+                          grad(1)[axis]);
+      });
+      break;
+    }
+
+    case Op::Sin: {
+      gradients[id] = sin_derivative(arg(0), grad(0));
+      break;
+    }
+
+    case Op::Cos: {
+      gradients[id] = cos_derivative(arg(0), grad(0));
+      break;
+    }
+
+    case Op::SinCos: {
+      gradients[id] = node.result_index == Node::sin_result
+                          ? sin_derivative(arg(0), grad(0))
+                          : cos_derivative(arg(0), grad(0));
+      break;
+    }
+
+    case Op::Extract: {
+      // the other result of the SinCos, so the other derivative
+      const auto &sin_cos = bc.nodes[node.arguments.at(0)];
+      auto a = values[sin_cos.arguments.at(0)];
+      auto da = gradients[sin_cos.arguments.at(0)];
+      gradients[id] = node.result_index == Node::sin_result
+                          ? sin_derivative(a, da)
+                          : cos_derivative(a, da);
+      break;
+    }
+
+    case Op::Mod: {
+      // a mod b = a - trunc(a/b) b, and trunc is flat (almost) everywhere, so
+      // d(a mod b) = da - trunc(a/b) db
+      auto quotient = out.divide(out.subtract(arg(0), values[id]), arg(1));
+      each_axis([&](size_t axis) {
+        return out.subtract(grad(0)[axis],
+                            out.multiply(quotient, grad(1)[axis]));
+      });
+      break;
+    }
+
+    case Op::Select: {
+      // the same choice, between the derivatives
+      each_axis([&](size_t axis) {
+        return out.select(node.select_type, arg(0), arg(1), grad(2)[axis],
+                          grad(3)[axis]);
+      });
+      break;
+    }
+
+    default: {
+      std::cerr << "differentiate: no derivative for " << node.op << std::endl;
+      abort();
+    }
+    }
+  }
+
+  return out;
+}
+
+} // namespace sdfjit::bytecode
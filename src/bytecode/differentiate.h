@@ -0,0 +1,19 @@
+#pragma once
+
+namespace sdfjit::bytecode {
+
+struct Bytecode;
+
+// forward mode automatic differentiation: every node gets worked out along
+// with its derivative by x, y and z (the first three Load_Args), so the sdf's
+// gradient falls out of a single evaluation. The gradient of a distance field
+// is its surface normal, which is a lot cheaper (and more precise) than
+// estimating it from six more evaluations.
+//
+// bc has to end in a Store_Distance, which becomes a Store_Normal of the
+// distance and its normalized gradient. Run it before optimizing, since most
+// of the derivatives it makes are constant (or zero), and the optimizer cleans
+// all of those up.
+Bytecode differentiate(const Bytecode &bc);
+
+} // namespace sdfjit::bytecode
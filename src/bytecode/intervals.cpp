@@ -0,0 +1,275 @@
+#include "intervals.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+#include "bytecode.h"
+
+namespace sdfjit::bytecode {
+
+namespace {
+
+struct Interval {
+  Node_Id lo;
+  Node_Id hi;
+};
+
+} // namespace
+
+Bytecode to_intervals(const Bytecode &bc) {
+  Bytecode out{};
+
+  // where each node's range ended up in `out`
+  std::vector<Interval> intervals(bc.nodes.size());
+
+  auto zero = out.assign_float(0.0f);
+  auto one = out.assign_float(1.0f);
+  auto minus_one = out.assign_float(-1.0f);
+  auto infinity = out.assign_float(INFINITY);
+  auto minus_infinity = out.assign_float(-INFINITY);
+  auto half_pi = out.assign_float(float(M_PI / 2));
+  auto three_half_pi = out.assign_float(float(3 * M_PI / 2));
+  auto two_pi = out.assign_float(float(2 * M_PI));
+
+  // if_less when lhs < rhs, otherwise otherwise
+  auto less = [&out](Node_Id lhs, Node_Id rhs, Node_Id if_less,
+                     Node_Id otherwise) {
+    return out.select(Select_Type::LT, lhs, rhs, if_less, otherwise);
+  };
+  auto less_interval = [&less](Node_Id lhs, Node_Id rhs, Interval if_less,
+                               Interval otherwise) {
+    return Interval{less(lhs, rhs, if_less.lo, otherwise.lo),
+                    less(lhs, rhs, if_less.hi, otherwise.hi)};
+  };
+  // anywhere either of them could be
+  auto hull = [&out](Interval a, Interval b) {
+    return Interval{out.min(a.lo, b.lo), out.max(a.hi, b.hi)};
+  };
+  auto multiply = [&out](Interval a, Interval b) {
+    auto lo_lo = out.multiply(a.lo, b.lo);
+    auto lo_hi = out.multiply(a.lo, b.hi);
+    auto hi_lo = out.multiply(a.hi, b.lo);
+    auto hi_hi = out.multiply(a.hi, b.hi);
+    return Interval{out.min(out.min(lo_lo, lo_hi), out.min(hi_lo, hi_hi)),
+                    out.max(out.max(lo_lo, lo_hi), out.max(hi_lo, hi_hi))};
+  };
+  auto sin = [&](Interval a) {
+    auto ends_lo = out.sin(a.lo);
+    auto ends_hi = out.sin(a.hi);
+    auto lo = out.min(ends_lo, ends_hi);
+    auto hi = out.max(ends_lo, ends_hi);
+
+    // it reaches 1 (or -1) if there's a peak (or trough) between the ends.
+    // How far past the start the next one is:
+    auto width = out.subtract(a.hi, a.lo);
+    auto distance_to = [&](Node_Id extreme) {
+      auto distance = out.mod(out.subtract(extreme, a.lo), two_pi);
+      return less(distance, zero, out.add(distance, two_pi), distance);
+    };
+    return Interval{less(width, distance_to(three_half_pi), lo, minus_one),
+                    less(width, distance_to(half_pi), hi, one)};
+  };
+  auto cos = [&](Interval a) {
+    return sin({out.add(a.lo, half_pi), out.add(a.hi, half_pi)});
+  };
+
+  for (size_t id = 0; id < bc.nodes.size(); id++) {
+    const auto &node = bc.nodes[id];
+    if (node.op == Op::Nop) {
+      continue;
+    }
+
+    auto arg = [&](size_t i) { return intervals[node.arguments.at(i)]; };
+
+    switch (node.op) {
+    case Op::Load_Arg: {
+      auto lo = out.load_arg(node.arg_index);
+      if (node.arg_index < 3) {
+        intervals[id] = {lo, out.load_upper(node.arg_index)};
+      } else {
+        // (the uniforms)
+        intervals[id] = {lo, lo};
+      }
+      break;
+    }
+
+    case Op::Load_Uniform: {
+      auto value = out.load_uniform(arg(0).lo, node.arg_index);
+      intervals[id] = {value, value};
+      break;
+    }
+
+    case Op::Assign_Float: {
+      auto value = out.assign_float(node.value);
+      intervals[id] = {value, value};
+      break;
+    }
+
+    case Op::Store_Distance: {
+      out.store_interval(arg(0).lo, arg(0).hi);
+      break;
+    }
+
+    case Op::Add: {
+      intervals[id] = {out.add(arg(0).lo, arg(1).lo),
+                       out.add(arg(0).hi, arg(1).hi)};
+      break;
+    }
+
+    case Op::Subtract: {
+      intervals[id] = {out.subtract(arg(0).lo, arg(1).hi),
+                       out.subtract(arg(0).hi, arg(1).lo)};
+      break;
+    }
+
+    case Op::Multiply: {
+      if (node.arguments.at(0) != node.arguments.at(1)) {
+        intervals[id] = multiply(arg(0), arg(1));
+        break;
+      }
+
+      // squares can't go below 0, which keeps lengths from blowing up
+      auto a = arg(0);
+      auto lo_squared = out.multiply(a.lo, a.lo);
+      auto hi_squared = out.multiply(a.hi, a.hi);
+      intervals[id] = {
+          less(zero, a.lo, lo_squared, less(a.hi, zero, hi_squared, zero)),
+          out.max(lo_squared, hi_squared)};
+      break;
+    }
+
+    case Op::Divide: {
+      // multiply by the range of the reciprocal, unless there's a 0 in there,
+      // in which case it could be anything
+      auto a = arg(0);
+      auto b = arg(1);
+      auto quotient =
+          multiply(a, {out.divide(one, b.hi), out.divide(one, b.lo)});
+      Interval unbounded{minus_infinity, infinity};
+      intervals[id] =
+          less_interval(zero, b.lo, quotient,
+                        less_interval(b.hi, zero, quotient, unbounded));
+      break;
+    }
+
+    case Op::Sqrt: {
+      intervals[id] = {out.sqrt(out.max(arg(0).lo, zero)),
+                       out.sqrt(out.max(arg(0).hi, zero))};
+      break;
+    }
+
+    case Op::Abs: {
+      auto a = arg(0);
+      intervals[id] = {
+          less(zero, a.lo, a.lo, less(a.hi, zero, out.negate(a.hi), zero)),
+          out.max(out.negate(a.lo), a.hi)};
+      break;
+    }
+
+    case Op::Negate: {
+      intervals[id] = {out.negate(arg(0).hi), out.negate(arg(0).lo)};
+      break;
+    }
+
+    case Op::Min: {
+      intervals[id] = {out.min(arg(0).lo, arg(1).lo),
+                       out.min(arg(0).hi, arg(1).hi)};
+      break;
+    }
+
+    case Op::Max: {
+      intervals[id] = {out.max(arg(0).lo, arg(1).lo),
+                       out.max(arg(0).hi, arg(1).hi)};
+      break;
+    }
+
+    case Op::Sin: {
+      intervals[id] = sin(arg(0));
+      break;
+    }
+
+    case Op::Cos: {
+      intervals[id] = cos(arg(0));
+      break;
+    }
+
+    case Op::SinCos: {
+      intervals[id] = node.result_index == Node::sin_result ? sin(arg(0))
+                                                            : cos(arg(0));
+      break;
+    }
+
+    case Op::Extract: {
+      // the other result of the SinCos, of the same argument
+      auto a = intervals[bc.nodes[node.arguments.at(0)].arguments.at(0)];
+      intervals[id] = node.result_index == Node::sin_result ? sin(a) : cos(a);
+      break;
+    }
+
+    case Op::Mod: {
+      // (mod truncates, so the result has a's sign, and is smaller than both
+      // a and m)
+      auto a = arg(0);
+      auto m = arg(1);
+      auto m_size = out.max(out.negate(m.lo), m.hi);
+      Interval anything{out.max(out.min(a.lo, zero), out.negate(m_size)),
+                        out.min(out.max(a.hi, zero), m_size)};
+
+      // but when m is just one value, and all of a is in the same period of
+      // it, the ends go to the ends
+      Interval ends{out.mod(a.lo, m.lo), out.mod(a.hi, m.lo)};
+      auto period_lo = out.subtract(a.lo, ends.lo);
+      auto period_hi = out.subtract(a.hi, ends.hi);
+      auto same_period = [&](Node_Id if_same, Node_Id otherwise) {
+        auto same_m = out.select(Select_Type::EQ, m.lo, m.hi, if_same,
+                                 otherwise);
+        return out.select(Select_Type::EQ, period_lo, period_hi, same_m,
+                          otherwise);
+      };
+      intervals[id] = {same_period(ends.lo, anything.lo),
+                       same_period(ends.hi, anything.hi)};
+      break;
+    }
+
+    case Op::Select: {
+      // when the comparison could go either way, so could the result
+      auto lhs = arg(0);
+      auto rhs = arg(1);
+      auto if_true = arg(2);
+      auto if_false = arg(3);
+      auto either = hull(if_true, if_false);
+      switch (node.select_type) {
+      case Select_Type::EQ:
+        // (only ever definitely false)
+        intervals[id] = less_interval(
+            lhs.hi, rhs.lo, if_false,
+            less_interval(rhs.hi, lhs.lo, if_false, either));
+        break;
+      case Select_Type::LT:
+        intervals[id] =
+            less_interval(lhs.hi, rhs.lo, if_true,
+                          less_interval(lhs.lo, rhs.hi, either, if_false));
+        break;
+      case Select_Type::GT:
+        // (true when lhs isn't greater, see select_type_to_vcmpps_imm)
+        intervals[id] =
+            less_interval(rhs.hi, lhs.lo, if_false,
+                          less_interval(rhs.lo, lhs.hi, either, if_true));
+        break;
+      }
+      break;
+    }
+
+    default: {
+      std::cerr << "to_intervals: no interval version of " << node.op
+                << std::endl;
+      abort();
+    }
+    }
+  }
+
+  return out;
+}
+
+} // namespace sdfjit::bytecode
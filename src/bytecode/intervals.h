@@ -0,0 +1,22 @@
+#pragma once
+
+namespace sdfjit::bytecode {
+
+struct Bytecode;
+
+// interval arithmetic: every node gets worked out as a range [lo, hi] that
+// its value is in for every point in a box, instead of for just one point.
+// Boxes whose distance range doesn't go down to 0 can't have any of the
+// surface in them, which is what culling and skipping empty space need.
+//
+// The x, y and z inputs are the box's extent along each axis, the Load_Args
+// for their lower bounds and Load_Uppers for their upper bounds, and bc's
+// Store_Distance becomes a Store_Interval of the distance's range (see
+// Executor::call_intervals for how they're laid out). The ranges are only as
+// exact as the float ops that work them out, nothing rounds outwards.
+//
+// bc has to end in a Store_Distance. Run this before optimizing, like
+// differentiate.
+Bytecode to_intervals(const Bytecode &bc);
+
+} // namespace sdfjit::bytecode
@@ -4,6 +4,7 @@
 #include "passes/constant_fold.h"
 #include "passes/cse.h"
 #include "passes/simplify_arithmetic.h"
+#include "passes/sincos_pairing.h"
 #include "passes/unused_value_elimination.h"
 
 namespace sdfjit::bytecode {
@@ -13,6 +14,12 @@ void optimize(Bytecode &bc) {
   passes::constant_fold(bc);
   passes::simplify_arithmetic(bc);
   passes::unused_value_elimination(bc);
+  passes::pair_sin_cos(bc);
+}
+
+void optimize_quickly(Bytecode &bc) {
+  passes::constant_fold(bc);
+  passes::unused_value_elimination(bc);
 }
 
 } // namespace sdfjit::bytecode
@@ -5,5 +5,8 @@ namespace sdfjit::bytecode {
 struct Bytecode;
 
 void optimize(Bytecode &bc);
+// just folds constants and drops whatever's unused, for bytecode that's about
+// to be interpreted, where getting started matters more than how fast it runs
+void optimize_quickly(Bytecode &bc);
 
 } // namespace sdfjit::bytecode
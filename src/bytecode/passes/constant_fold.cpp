@@ -127,6 +127,30 @@ void constant_fold(Bytecode &bc) {
         break;
       }
 
+      case Op::SinCos: {
+        if (can_optimize_arguments_node(node)) {
+          // split it back up into a plain sin and cos, which we know how to
+          // fold (the Extracts all come after us, so they'll get folded too)
+          auto op_for = [](size_t result_index) {
+            return result_index == Node::sin_result ? Op::Sin : Op::Cos;
+          };
+          for (size_t j = i + 1; j < bc.nodes.size(); j++) {
+            auto &other = bc.nodes[j];
+            if (other.op == Op::Extract && other.uses(i)) {
+              other.op = op_for(other.result_index);
+              other.arguments = node.arguments;
+            }
+          }
+
+          auto x = bc.nodes[node.arguments[0]].value;
+          node.op = Op::Assign_Float;
+          node.value =
+              node.result_index == Node::sin_result ? sinf(x) : cosf(x);
+          node.arguments.clear();
+        }
+        break;
+      }
+
       case Op::Mod: {
         if (can_optimize_arguments_node(node)) {
           node.arguments.clear();
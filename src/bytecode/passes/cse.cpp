@@ -1,21 +1,101 @@
 #include "cse.h"
 
+#include <cmath>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
 #include "bytecode/bytecode.h"
+#include "util/compare.h"
 
 namespace sdfjit::bytecode::passes {
 
+namespace {
+
+// what makes two (non-constant) nodes work out the same value
+struct Value {
+  Op op;
+  std::vector<Node_Id> arguments;
+  size_t arg_index;
+  size_t result_index;
+  Select_Type select_type;
+
+  bool operator==(const Value &rhs) const {
+    return op == rhs.op && arguments == rhs.arguments &&
+           arg_index == rhs.arg_index && result_index == rhs.result_index &&
+           select_type == rhs.select_type;
+  }
+};
+
+struct Value_Hash {
+  size_t operator()(const Value &value) const {
+    auto hash = size_t(value.op);
+    for (auto arg : value.arguments) {
+      hash = hash * 31 + size_t(arg);
+    }
+    hash = hash * 31 + value.arg_index;
+    hash = hash * 31 + value.result_index;
+    return hash * 31 + size_t(value.select_type);
+  }
+};
+
+} // namespace
+
 void common_subexpression_elimination(Bytecode &bc) {
+  // value numbering: go through the nodes in order, looking each one up in the
+  // values we've already seen. Arguments always come before their users, so by
+  // the time we get to a node, its arguments have already been swapped for
+  // the first node with the same value.
+  std::vector<Node_Id> replacements(bc.nodes.size());
+  std::unordered_map<Value, Node_Id, Value_Hash> values{};
+  // constants only have to be within floats_equal of each other, which can't
+  // be hashed, so they're kept in order and we look around the value instead
+  std::map<float, Node_Id> constants{};
+
   for (size_t i = 0; i < bc.nodes.size(); i++) {
-    for (size_t j = i + 1; j < bc.nodes.size(); j++) {
-      if (bc.nodes[i] != bc.nodes[j]) {
+    auto &node = bc.nodes[i];
+    replacements[i] = Node_Id(i);
+    if (node.op == Op::Nop) {
+      continue;
+    }
+
+    auto same = Node_Id(i);
+    if (node.op == Op::Assign_Float) {
+      if (std::isnan(node.value)) {
         continue;
       }
+      auto first = constants.lower_bound(node.value - util::float_tolerance);
+      auto last = constants.upper_bound(node.value + util::float_tolerance);
+      for (auto it = first; it != last; ++it) {
+        if (util::floats_equal(it->first, node.value) && it->second < same) {
+          same = it->second;
+        }
+      }
+      if (same == Node_Id(i)) {
+        constants.emplace(node.value, same);
+      }
+    } else {
+      if (node.has_arguments()) {
+        for (auto &arg : node.arguments) {
+          if (arg >= 0) {
+            arg = replacements[arg];
+          }
+        }
+      }
+      auto [existing, inserted] = values.try_emplace(
+          Value{node.op, node.arguments, node.arg_index, node.result_index,
+                node.select_type},
+          same);
+      if (!inserted) {
+        same = existing->second;
+      }
+    }
 
-      bc.replace_all_uses_with(j, i);
-      bc.nodes[j].convert_to_nop();
+    if (same != Node_Id(i)) {
+      replacements[i] = same;
+      node.convert_to_nop();
     }
   }
-  return;
 }
 
 } // namespace sdfjit::bytecode::passes
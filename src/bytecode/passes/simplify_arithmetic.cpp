@@ -1,5 +1,7 @@
 #include "simplify_arithmetic.h"
 
+#include <vector>
+
 #include "bytecode/bytecode.h"
 #include "util/compare.h"
 
@@ -12,9 +14,10 @@ void simplify_arithmetic(Bytecode &bc) {
    * x
    */
 
+  // (0 - x isn't x, so subtracts only count on the right)
   auto operand_is_add_or_subtract_by_zero = [&bc](Node &node,
                                                   size_t arg_idx) -> bool {
-    return (node.op == Op::Add || node.op == Op::Subtract) &&
+    return (node.op == Op::Add || (node.op == Op::Subtract && arg_idx == 1)) &&
            bc.nodes[node.arguments[arg_idx]].op == Op::Assign_Float &&
            util::floats_equal(bc.nodes[node.arguments[arg_idx]].value, 0.0f);
   };
@@ -31,8 +34,21 @@ void simplify_arithmetic(Bytecode &bc) {
            util::floats_equal(bc.nodes[node.arguments[arg_idx]].value, 0.0f);
   };
 
+  // what each node got replaced with (itself if it wasn't). Rather than going
+  // through every later node each time we drop one, each node's arguments get
+  // updated when we get to it, which works since they always come first.
+  std::vector<Node_Id> replacements(bc.nodes.size());
+
   for (size_t i = 0; i < bc.nodes.size(); i++) {
     auto &node = bc.nodes[i];
+    replacements[i] = Node_Id(i);
+    if (node.has_arguments()) {
+      for (auto &arg : node.arguments) {
+        if (arg >= 0) {
+          arg = replacements[arg];
+        }
+      }
+    }
 
     // update adds by zero
     {
@@ -47,7 +63,7 @@ void simplify_arithmetic(Bytecode &bc) {
         }
 
         node.convert_to_nop();
-        bc.replace_all_uses_with(i, value_node);
+        replacements[i] = value_node;
         continue;
       }
     }
@@ -65,7 +81,7 @@ void simplify_arithmetic(Bytecode &bc) {
         }
 
         node.convert_to_nop();
-        bc.replace_all_uses_with(i, value_node);
+        replacements[i] = value_node;
         continue;
       }
     }
@@ -0,0 +1,38 @@
+#include "sincos_pairing.h"
+
+#include "bytecode/bytecode.h"
+
+namespace sdfjit::bytecode::passes {
+
+void pair_sin_cos(Bytecode &bc) {
+  for (size_t i = 0; i < bc.nodes.size(); i++) {
+    auto &first = bc.nodes[i];
+    if (first.op != Op::Sin && first.op != Op::Cos) {
+      continue;
+    }
+
+    auto partner = first.op == Op::Sin ? Op::Cos : Op::Sin;
+    for (size_t j = i + 1; j < bc.nodes.size(); j++) {
+      auto &second = bc.nodes[j];
+      if (second.op != partner || second.arguments != first.arguments) {
+        continue;
+      }
+
+      // the first one has to keep meaning what it did, since anything between
+      // the two might be using it
+      auto first_result =
+          first.op == Op::Sin ? Node::sin_result : Node::cos_result;
+      auto second_result =
+          first.op == Op::Sin ? Node::cos_result : Node::sin_result;
+
+      first.op = Op::SinCos;
+      first.result_index = first_result;
+      second.op = Op::Extract;
+      second.arguments = {Node_Id(i)};
+      second.result_index = second_result;
+      break;
+    }
+  }
+}
+
+} // namespace sdfjit::bytecode::passes
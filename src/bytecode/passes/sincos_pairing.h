@@ -0,0 +1,13 @@
+#pragma once
+
+namespace sdfjit::bytecode {
+struct Bytecode;
+}
+
+namespace sdfjit::bytecode::passes {
+
+// Sin and Cos of the same value share almost all of their work, so turn each
+// such pair into one SinCos (plus an Extract for the second result)
+void pair_sin_cos(Bytecode &bc);
+
+} // namespace sdfjit::bytecode::passes
@@ -1,26 +1,39 @@
 #include "unused_value_elimination.h"
 
-#include <algorithm>
+#include <vector>
 
 #include "bytecode/bytecode.h"
 
 namespace sdfjit::bytecode::passes {
 
 void unused_value_elimination(Bytecode &bc) {
-  auto is_unused = [&bc](Node_Id id) -> bool {
-    return std::none_of(
-        bc.nodes.begin(), bc.nodes.end(),
-        [id](const Node &other) -> bool { return other.uses(id); });
-  };
+  std::vector<size_t> use_counts(bc.nodes.size());
+  for (const auto &node : bc.nodes) {
+    if (node.has_arguments()) {
+      for (auto arg : node.arguments) {
+        if (arg >= 0) {
+          use_counts[arg]++;
+        }
+      }
+    }
+  }
 
+  // going backwards, everything that uses a node has been looked at (and
+  // maybe removed) before we get to it
   for (size_t i = bc.nodes.size(); --i;) {
-    if (bc.nodes[i].op == sdfjit::bytecode::Op::Store_Result) {
+    auto &node = bc.nodes[i];
+    if (node.is_store() || use_counts[i] > 0) {
       continue;
     }
 
-    if (is_unused(i)) {
-      bc.nodes[i].convert_to_nop();
+    if (node.has_arguments()) {
+      for (auto arg : node.arguments) {
+        if (arg >= 0) {
+          use_counts[arg]--;
+        }
+      }
     }
+    node.convert_to_nop();
   }
 }
 
@@ -0,0 +1,403 @@
+#include "interpreter.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <immintrin.h>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "machinecode/target.h"
+#include "util/macros.h"
+
+namespace sdfjit::interpreter {
+
+using bytecode::Op;
+using bytecode::Select_Type;
+using machinecode::Sin_Cos_Coefficients;
+
+Interpreter Interpreter::from_bytecode(const bytecode::Bytecode &bc,
+                                       machinecode::Precision precision) {
+  Interpreter interpreter{bc, precision};
+
+  const auto node_count = bc.nodes.size();
+  auto slot = [&](bytecode::Node_Id id) { return uint32_t(id * tile_lanes); };
+  auto extra_slot = [&](bytecode::Node_Id id) {
+    return uint32_t((node_count + id) * tile_lanes);
+  };
+
+  auto uniform_values = bc.uniform_values();
+  for (size_t id = 0; id < node_count; id++) {
+    const auto &node = bc.nodes[id];
+    if (node.op == Op::Load_Upper || node.op == Op::Store_Interval) {
+      std::cerr << "The interpreter can't do intervals (" << node.op << ")"
+                << std::endl;
+      abort();
+    }
+    if (node.op == Op::Nop ||
+        (node.op == Op::Load_Arg && node.arg_index > 2)) {
+      continue;
+    }
+    if (uniform_values[id] || node.op == Op::Assign_Float) {
+      interpreter.per_call_nodes.push_back(id);
+      continue;
+    }
+
+    Instruction instruction{node.op};
+    instruction.select_type = node.select_type;
+    instruction.is_sin = node.result_index == bytecode::Node::sin_result;
+    instruction.arg_index = uint32_t(node.arg_index);
+    instruction.result = slot(id);
+    instruction.extra = extra_slot(id);
+    if (node.has_arguments()) {
+      for (size_t i = 0; i < node.arguments.size(); i++) {
+        instruction.arguments[i] = slot(node.arguments[i]);
+      }
+    }
+    // Extract just reads the other half of its SinCos
+    if (node.op == Op::Extract) {
+      instruction.arguments[0] = extra_slot(node.arguments[0]);
+    }
+    interpreter.program.push_back(instruction);
+  }
+
+  return interpreter;
+}
+
+bool Interpreter::is_supported() {
+  return machinecode::Target{machinecode::Isa::AVX2}.is_supported();
+}
+
+namespace {
+
+// the kernels compare with vcmpps, and these are the same predicates they use
+// (see machinecode::select_type_to_vcmpps_imm)
+bool compare(Select_Type select_type, float lhs, float rhs) {
+  switch (select_type) {
+  case Select_Type::EQ:
+    // lhs == rhs (false if either is NaN, like EQ_OQ), spelt so that
+    // -Wfloat-equal doesn't mind
+    return lhs <= rhs && lhs >= rhs;
+  case Select_Type::LT:
+    return lhs < rhs;
+  case Select_Type::GT:
+    return !(lhs > rhs);
+  }
+  abort();
+}
+
+// sin and cos the same way the kernels do them (see
+// Machine_Code::sin_quadrants): x gets reduced to r = x - k * pi/2 once, and
+// then sin(x + quadrant * pi/2) is one of +-sin(r) or +-cos(r) depending on
+// k + quadrant
+struct Reduced_Angle {
+  // k, rounded, plus 1.5 * 2^23 (which leaves it in the low mantissa bits)
+  __m256 k_bits;
+  __m256 sin_r;
+  __m256 cos_r;
+};
+
+TARGET_ISA("avx2,fma")
+__m256 polynomial_lanes(const std::vector<float> &c, __m256 r2) {
+  auto result = _mm256_set1_ps(c.back());
+  for (size_t i = c.size() - 1; i-- > 0;) {
+    result = _mm256_fmadd_ps(result, r2, _mm256_set1_ps(c[i]));
+  }
+  return result;
+}
+
+TARGET_ISA("avx2,fma")
+Reduced_Angle reduce_angle(__m256 x, const Sin_Cos_Coefficients &c) {
+  auto magic = _mm256_set1_ps(12582912.0f);
+  auto k_bits = _mm256_fmadd_ps(x, _mm256_set1_ps(float(2 / M_PI)), magic);
+  auto k = _mm256_sub_ps(k_bits, magic);
+
+  auto r = x;
+  for (float part : c.pi_over_two) {
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(part), r);
+  }
+  auto r2 = _mm256_mul_ps(r, r);
+
+  return {k_bits, _mm256_mul_ps(r, polynomial_lanes(c.sin, r2)),
+          polynomial_lanes(c.cos, r2)};
+}
+
+TARGET_ISA("avx2,fma")
+__m256 sin_quadrant_lanes(const Reduced_Angle &angle, uint32_t quadrant) {
+  auto q_bits = _mm256_castps_si256(angle.k_bits);
+  if (quadrant != 0) {
+    q_bits = _mm256_castps_si256(
+        _mm256_add_ps(angle.k_bits, _mm256_set1_ps(float(quadrant))));
+  }
+
+  // odd quadrants want cos(r) (blendv only looks at the sign bit, so bit 0 of
+  // k just has to get there)
+  auto odd = _mm256_castsi256_ps(_mm256_slli_epi32(q_bits, 31));
+  auto result = _mm256_blendv_ps(angle.sin_r, angle.cos_r, odd);
+
+  // and quadrants 2 and 3 are negated
+  auto sign = _mm256_and_si256(_mm256_slli_epi32(q_bits, 30),
+                               _mm256_set1_epi32(int(0x80000000)));
+  return _mm256_xor_ps(result, _mm256_castsi256_ps(sign));
+}
+
+// (for the per call values, so they match the per point ones)
+TARGET_ISA("avx2,fma")
+float sin_quadrant(float x, uint32_t quadrant, const Sin_Cos_Coefficients &c) {
+  auto angle = reduce_angle(_mm256_set1_ps(x), c);
+  return _mm256_cvtss_f32(sin_quadrant_lanes(angle, quadrant));
+}
+
+// works out every node that's the same for all the points: constants, and
+// anything computed from uniforms. `extras` gets the other result of each
+// SinCos.
+void evaluate_per_call(const Interpreter &interpreter, const float *uniforms,
+                       std::vector<float> &values, std::vector<float> &extras) {
+  const auto &coefficients =
+      machinecode::sin_cos_coefficients(interpreter.precision);
+  for (auto id : interpreter.per_call_nodes) {
+    const auto &node = interpreter.bc.nodes[id];
+    if (node.op == Op::Assign_Float) {
+      values[id] = node.value;
+      continue;
+    }
+
+    auto arg = [&](size_t i) { return values[node.arguments.at(i)]; };
+    switch (node.op) {
+    case Op::Load_Uniform:
+      values[id] = uniforms[node.arg_index];
+      break;
+    case Op::Add:
+      values[id] = arg(0) + arg(1);
+      break;
+    case Op::Subtract:
+      values[id] = arg(0) - arg(1);
+      break;
+    case Op::Multiply:
+      values[id] = arg(0) * arg(1);
+      break;
+    case Op::Divide:
+      values[id] = arg(0) / arg(1);
+      break;
+    case Op::Sqrt:
+      values[id] = std::sqrt(arg(0));
+      break;
+    case Op::Abs:
+      values[id] = std::fabs(arg(0));
+      break;
+    case Op::Negate:
+      values[id] = -arg(0);
+      break;
+    case Op::Min:
+      values[id] = arg(0) < arg(1) ? arg(0) : arg(1);
+      break;
+    case Op::Max:
+      values[id] = arg(0) > arg(1) ? arg(0) : arg(1);
+      break;
+    case Op::Sin:
+      values[id] = sin_quadrant(arg(0), 0, coefficients);
+      break;
+    case Op::Cos:
+      values[id] = sin_quadrant(arg(0), 1, coefficients);
+      break;
+    case Op::SinCos: {
+      auto sin = sin_quadrant(arg(0), 0, coefficients);
+      auto cos = sin_quadrant(arg(0), 1, coefficients);
+      bool is_sin = node.result_index == bytecode::Node::sin_result;
+      values[id] = is_sin ? sin : cos;
+      extras[id] = is_sin ? cos : sin;
+      break;
+    }
+    case Op::Extract:
+      values[id] = extras[node.arguments.at(0)];
+      break;
+    case Op::Mod:
+      values[id] = arg(0) - std::trunc(arg(0) / arg(1)) * arg(1);
+      break;
+    case Op::Select:
+      values[id] = compare(node.select_type, arg(0), arg(1)) ? arg(2) : arg(3);
+      break;
+    default:
+      std::cerr << "Can't interpret " << node.op << " for uniforms"
+                << std::endl;
+      abort();
+    }
+  }
+}
+
+TARGET_ISA("avx2,fma")
+__m256 compare_lanes(Select_Type select_type, __m256 lhs, __m256 rhs) {
+  switch (select_type) {
+  case Select_Type::EQ:
+    return _mm256_cmp_ps(lhs, rhs, _CMP_EQ_OQ);
+  case Select_Type::LT:
+    return _mm256_cmp_ps(lhs, rhs, _CMP_LT_OS);
+  case Select_Type::GT:
+    return _mm256_cmp_ps(lhs, rhs, _CMP_NGT_US);
+  }
+  abort();
+}
+
+TARGET_ISA("avx2,fma")
+void interpret_tiles(const Interpreter &interpreter, const float *xs,
+                     const float *ys, const float *zs, float *distances,
+                     float *materials, size_t count, float *scratch) {
+  constexpr auto tile = Interpreter::tile_lanes;
+  const float *args[] = {xs, ys, zs};
+  const auto &coefficients =
+      machinecode::sin_cos_coefficients(interpreter.precision);
+
+  for (size_t offset = 0; offset < count; offset += tile) {
+    for (const auto &instruction : interpreter.program) {
+      // each instruction does the whole tile before moving on, so there's
+      // only one dispatch for every few vectors (and they don't depend on each
+      // other, so they can all be in flight at once)
+#define EACH_VECTOR(...)                                                       \
+  for (size_t v = 0; v < tile; v += Interpreter::vector_lanes) {              \
+    __VA_ARGS__;                                                               \
+  }
+#define ARG(i) _mm256_load_ps(&scratch[instruction.arguments[i] + v])
+#define RESULT(value) _mm256_store_ps(&scratch[instruction.result + v], value)
+
+      switch (instruction.op) {
+      case Op::Load_Arg:
+        EACH_VECTOR(
+            RESULT(_mm256_load_ps(&args[instruction.arg_index][offset + v])));
+        break;
+      case Op::Store_Result:
+        EACH_VECTOR(_mm256_store_ps(&distances[offset + v], ARG(0));
+                    _mm256_store_ps(&materials[offset + v], ARG(1)));
+        break;
+      case Op::Store_Distance:
+        EACH_VECTOR(_mm256_store_ps(&distances[offset + v], ARG(0)));
+        break;
+      case Op::Store_Material:
+        EACH_VECTOR(_mm256_store_ps(&materials[offset + v], ARG(0)));
+        break;
+      case Op::Store_Normal:
+        // (the normals go in three planes of `count`, see
+        // Executor::call_normals)
+        EACH_VECTOR(_mm256_store_ps(&distances[offset + v], ARG(0));
+                    _mm256_store_ps(&materials[offset + v], ARG(1));
+                    _mm256_store_ps(&materials[count + offset + v], ARG(2));
+                    _mm256_store_ps(&materials[2 * count + offset + v],
+                                    ARG(3)));
+        break;
+      case Op::Add:
+        EACH_VECTOR(RESULT(_mm256_add_ps(ARG(0), ARG(1))));
+        break;
+      case Op::Subtract:
+        EACH_VECTOR(RESULT(_mm256_sub_ps(ARG(0), ARG(1))));
+        break;
+      case Op::Multiply:
+        EACH_VECTOR(RESULT(_mm256_mul_ps(ARG(0), ARG(1))));
+        break;
+      case Op::Divide:
+        EACH_VECTOR(RESULT(_mm256_div_ps(ARG(0), ARG(1))));
+        break;
+      case Op::Sqrt:
+        EACH_VECTOR(RESULT(_mm256_sqrt_ps(ARG(0))));
+        break;
+      case Op::Abs:
+        EACH_VECTOR(RESULT(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), ARG(0))));
+        break;
+      case Op::Negate:
+        EACH_VECTOR(RESULT(_mm256_xor_ps(_mm256_set1_ps(-0.0f), ARG(0))));
+        break;
+      case Op::Min:
+        EACH_VECTOR(RESULT(_mm256_min_ps(ARG(0), ARG(1))));
+        break;
+      case Op::Max:
+        EACH_VECTOR(RESULT(_mm256_max_ps(ARG(0), ARG(1))));
+        break;
+      case Op::Sin:
+        EACH_VECTOR(auto angle = reduce_angle(ARG(0), coefficients);
+                    RESULT(sin_quadrant_lanes(angle, 0)));
+        break;
+      case Op::Cos:
+        EACH_VECTOR(auto angle = reduce_angle(ARG(0), coefficients);
+                    RESULT(sin_quadrant_lanes(angle, 1)));
+        break;
+      case Op::SinCos:
+        EACH_VECTOR(
+            auto angle = reduce_angle(ARG(0), coefficients);
+            RESULT(sin_quadrant_lanes(angle, instruction.is_sin ? 0 : 1));
+            _mm256_store_ps(&scratch[instruction.extra + v],
+                            sin_quadrant_lanes(angle,
+                                               instruction.is_sin ? 1 : 0)));
+        break;
+      case Op::Extract:
+        EACH_VECTOR(RESULT(ARG(0)));
+        break;
+      case Op::Mod:
+        EACH_VECTOR(auto d = _mm256_round_ps(_mm256_div_ps(ARG(0), ARG(1)),
+                                             _MM_FROUND_TO_ZERO |
+                                                 _MM_FROUND_NO_EXC);
+                    RESULT(_mm256_fnmadd_ps(d, ARG(1), ARG(0))));
+        break;
+      case Op::Select:
+        EACH_VECTOR(
+            auto mask = compare_lanes(instruction.select_type, ARG(0), ARG(1));
+            RESULT(_mm256_blendv_ps(ARG(3), ARG(2), mask)));
+        break;
+      default:
+        std::cerr << "Can't interpret " << instruction.op << std::endl;
+        abort();
+      }
+#undef RESULT
+#undef ARG
+#undef EACH_VECTOR
+    }
+  }
+}
+
+} // namespace
+
+void Interpreter::call(void *xs, void *ys, void *zs, void *distances,
+                       void *materials, size_t count,
+                       const float *uniforms) const {
+  if (count == 0) {
+    return;
+  }
+
+  // what every call works in, kept around so that small calls don't spend
+  // most of their time allocating it. Interpreters get shared between the
+  // threads tracing a frame, so each thread has its own.
+  struct Scratch {
+    std::unique_ptr<float[], decltype(&free)> tiles{nullptr, &free};
+    size_t tiles_size{0};
+    std::vector<float> per_call_values{};
+    std::vector<float> per_call_extras{};
+  };
+  thread_local Scratch scratch{};
+
+  // a tile's worth of every node's value, and then of the other result of
+  // every SinCos (see Instruction)
+  auto size = 2 * bc.nodes.size() * tile_lanes;
+  if (scratch.tiles_size < size) {
+    scratch.tiles.reset(
+        static_cast<float *>(aligned_alloc(32, size * sizeof(float))));
+    scratch.tiles_size = size;
+  }
+  auto *tiles = scratch.tiles.get();
+
+  // the per call values are the same for every tile, so they can just sit in
+  // their slots for the whole call
+  auto &per_call_values = scratch.per_call_values;
+  auto &per_call_extras = scratch.per_call_extras;
+  per_call_values.resize(bc.nodes.size());
+  per_call_extras.resize(bc.nodes.size());
+  evaluate_per_call(*this, uniforms, per_call_values, per_call_extras);
+  for (auto id : per_call_nodes) {
+    for (size_t lane = 0; lane < tile_lanes; lane++) {
+      tiles[id * tile_lanes + lane] = per_call_values[id];
+      tiles[(bc.nodes.size() + id) * tile_lanes + lane] = per_call_extras[id];
+    }
+  }
+
+  interpret_tiles(*this, static_cast<float *>(xs), static_cast<float *>(ys),
+                  static_cast<float *>(zs), static_cast<float *>(distances),
+                  static_cast<float *>(materials), count, tiles);
+}
+
+} // namespace sdfjit::interpreter
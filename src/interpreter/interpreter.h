@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "bytecode/bytecode.h"
+#include "machinecode/target.h"
+
+namespace sdfjit::interpreter {
+
+// evaluates optimized bytecode directly, instead of compiling it first. Per
+// point it's a good deal slower than a kernel, but there's nothing to wait for
+// before the first one, so it wins for one-off queries, tiny batches, and
+// scenes that are different every frame. It needs AVX2 (see is_supported).
+//
+// Points go through a tile of 32 at a time: each node gets worked out for the
+// whole tile (as four independent vectors) before moving on to the next one,
+// which spreads the cost of dispatching on the node over a decent amount of
+// work. Anything that's the same for every point (constants, and whatever only
+// depends on uniforms) is worked out once per call instead. Sin and cos are
+// done the same way the kernels do them, at whichever Precision the interpreter
+// was made for, so switching between the two doesn't change the picture.
+struct Interpreter {
+  static constexpr size_t vector_lanes = 8;
+  static constexpr size_t tile_lanes = 4 * vector_lanes;
+
+  // a per point node, boiled down to just what's needed to run it. Values live
+  // in a scratch buffer, one tile's worth per node (and then one per node again
+  // for the other result of each SinCos), and everything refers to them by
+  // where they are in there.
+  struct Instruction {
+    bytecode::Op op;
+    bytecode::Select_Type select_type{0}; // for Select
+    bool is_sin{false};                   // for SinCos
+    uint32_t arg_index{0};                // for Load_Arg
+    uint32_t result{0};
+    uint32_t extra{0}; // for SinCos
+    uint32_t arguments[4]{};
+  };
+
+  bytecode::Bytecode bc{};
+  machinecode::Precision precision{machinecode::Precision::Medium};
+  // everything that's the same for every point, in order. These are worked
+  // out once per call, before any of the tiles.
+  std::vector<bytecode::Node_Id> per_call_nodes{};
+  // and everything else, which runs once per tile
+  std::vector<Instruction> program{};
+
+  static Interpreter from_bytecode(const bytecode::Bytecode &bc,
+                                   machinecode::Precision precision);
+
+  // whether the cpu we're running on can use this
+  static bool is_supported();
+
+  // the same interface as Executor, so either can be used to trace with
+  size_t lanes() const { return tile_lanes; }
+  void call(void *xs, void *ys, void *zs, void *distances, void *materials,
+            size_t count) const {
+    call(xs, ys, zs, distances, materials, count, nullptr);
+  }
+  void call(void *xs, void *ys, void *zs, void *distances, void *materials,
+            size_t count, const float *uniforms) const;
+  // (see Executor::call_normals for where the normals go)
+  void call_normals(void *xs, void *ys, void *zs, void *distances,
+                    void *normals, size_t count, const float *uniforms) const {
+    call(xs, ys, zs, distances, normals, count, uniforms);
+  }
+};
+
+} // namespace sdfjit::interpreter
@@ -0,0 +1,263 @@
+#include "aot.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <elf.h>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#include "assembler.h"
+
+namespace sdfjit::machinecode {
+
+namespace {
+
+// the code and constant pool as separate sections, and the references from
+// one to the other
+struct Exported_Kernel {
+  std::vector<uint8_t> code{};
+  std::vector<uint8_t> constants{};
+  std::vector<Assembler::Constant_Fixup> fixups{};
+  // (offset, size) of each instruction in the code
+  std::vector<std::pair<size_t, size_t>> instructions{};
+
+  // what goes in the rel32 to point at `fixup`'s constant, on top of the
+  // address of the constant pool and minus the address of the rel32 (which is
+  // what R_X86_64_PC32 does)
+  static int64_t addend(const Assembler::Constant_Fixup &fixup) {
+    return int64_t(fixup.constant_offset) - int64_t(fixup.end - fixup.offset);
+  }
+};
+
+Exported_Kernel assemble_for_export(Machine_Code &mc) {
+  Assembler assembler{mc};
+  assembler.assemble();
+
+  Exported_Kernel kernel{};
+  kernel.instructions = assembler.instruction_offsets_and_sizes;
+  // the padding before the pool stays behind
+  size_t code_size = 0;
+  if (!kernel.instructions.empty()) {
+    code_size =
+        kernel.instructions.back().first + kernel.instructions.back().second;
+  }
+  kernel.code.assign(assembler.buffer.begin(),
+                     assembler.buffer.begin() + code_size);
+  kernel.constants.assign(assembler.buffer.begin() + assembler.constants_offset,
+                          assembler.buffer.end());
+  kernel.fixups = assembler.constant_fixups;
+
+  // the linker fills these in, so don't leave the in-process addresses lying
+  // around
+  for (const auto &fixup : kernel.fixups) {
+    memset(&kernel.code[fixup.offset], 0, sizeof(uint32_t));
+  }
+  return kernel;
+}
+
+size_t append_aligned(std::vector<uint8_t> &out, const uint8_t *data,
+                      size_t size, size_t alignment) {
+  while (out.size() % alignment != 0) {
+    out.push_back(0);
+  }
+  auto offset = out.size();
+  out.insert(out.end(), data, data + size);
+  return offset;
+}
+
+// adds `name` to a string table, and returns where it is
+uint32_t add_string(std::vector<uint8_t> &table, const std::string &name) {
+  auto offset = uint32_t(table.size());
+  table.insert(table.end(), name.begin(), name.end());
+  table.push_back(0);
+  return offset;
+}
+
+std::string describe(const Instruction &instruction) {
+  std::ostringstream os{};
+  os << instruction;
+  auto description = os.str();
+  while (!description.empty() &&
+         (description.back() == ' ' || description.back() == ',')) {
+    description.pop_back();
+  }
+  return description;
+}
+
+} // namespace
+
+void write_object(Machine_Code &mc, const std::string &symbol,
+                  std::ostream &os) {
+  auto kernel = assemble_for_export(mc);
+
+  // clang-format off
+  enum Section : uint16_t {
+    Null, Text, Rodata, Rela_Text, Symtab, Strtab, Shstrtab, Note_Gnu_Stack,
+    Section_Count
+  };
+  // clang-format on
+  // the local symbols have to come first, so the section symbol that the
+  // relocations are against is 1, and the kernel is 2
+  static constexpr uint32_t rodata_symbol = 1;
+  static constexpr uint32_t first_global_symbol = 2;
+
+  std::vector<uint8_t> section_names{0};
+  std::vector<uint8_t> strings{0};
+  Elf64_Shdr headers[Section_Count]{};
+  headers[Text].sh_name = add_string(section_names, ".text");
+  headers[Rodata].sh_name = add_string(section_names, ".rodata");
+  headers[Rela_Text].sh_name = add_string(section_names, ".rela.text");
+  headers[Symtab].sh_name = add_string(section_names, ".symtab");
+  headers[Strtab].sh_name = add_string(section_names, ".strtab");
+  headers[Shstrtab].sh_name = add_string(section_names, ".shstrtab");
+  headers[Note_Gnu_Stack].sh_name =
+      add_string(section_names, ".note.GNU-stack");
+
+  std::vector<Elf64_Rela> relocations{};
+  for (const auto &fixup : kernel.fixups) {
+    Elf64_Rela rela{};
+    rela.r_offset = fixup.offset;
+    rela.r_info = ELF64_R_INFO(rodata_symbol, R_X86_64_PC32);
+    rela.r_addend = Exported_Kernel::addend(fixup);
+    relocations.push_back(rela);
+  }
+
+  Elf64_Sym symbols[3]{};
+  symbols[rodata_symbol].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+  symbols[rodata_symbol].st_shndx = Rodata;
+  symbols[first_global_symbol].st_name = add_string(strings, symbol);
+  symbols[first_global_symbol].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+  symbols[first_global_symbol].st_shndx = Text;
+  symbols[first_global_symbol].st_size = kernel.code.size();
+
+  // the file header goes in last, once we know where the section headers are
+  std::vector<uint8_t> file(sizeof(Elf64_Ehdr), 0);
+  auto add_section = [&](Section section, uint32_t type, uint64_t flags,
+                         const void *data, size_t size, size_t alignment) {
+    auto &header = headers[section];
+    header.sh_type = type;
+    header.sh_flags = flags;
+    header.sh_offset = append_aligned(
+        file, static_cast<const uint8_t *>(data), size, alignment);
+    header.sh_size = size;
+    header.sh_addralign = alignment;
+  };
+  add_section(Text, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR,
+              kernel.code.data(), kernel.code.size(), 64);
+  add_section(Rodata, SHT_PROGBITS, SHF_ALLOC, kernel.constants.data(),
+              kernel.constants.size(), 64);
+  add_section(Rela_Text, SHT_RELA, SHF_INFO_LINK, relocations.data(),
+              relocations.size() * sizeof(Elf64_Rela), 8);
+  headers[Rela_Text].sh_link = Symtab;
+  headers[Rela_Text].sh_info = Text;
+  headers[Rela_Text].sh_entsize = sizeof(Elf64_Rela);
+  add_section(Symtab, SHT_SYMTAB, 0, symbols, sizeof(symbols), 8);
+  headers[Symtab].sh_link = Strtab;
+  headers[Symtab].sh_info = first_global_symbol;
+  headers[Symtab].sh_entsize = sizeof(Elf64_Sym);
+  add_section(Strtab, SHT_STRTAB, 0, strings.data(), strings.size(), 1);
+  add_section(Shstrtab, SHT_STRTAB, 0, section_names.data(),
+              section_names.size(), 1);
+  // without this, linking the kernel in would make the stack executable
+  add_section(Note_Gnu_Stack, SHT_PROGBITS, 0, nullptr, 0, 1);
+
+  auto section_headers_offset = append_aligned(
+      file, reinterpret_cast<const uint8_t *>(headers), sizeof(headers), 8);
+
+  Elf64_Ehdr header{};
+  memcpy(header.e_ident, ELFMAG, SELFMAG);
+  header.e_ident[EI_CLASS] = ELFCLASS64;
+  header.e_ident[EI_DATA] = ELFDATA2LSB;
+  header.e_ident[EI_VERSION] = EV_CURRENT;
+  header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  header.e_type = ET_REL;
+  header.e_machine = EM_X86_64;
+  header.e_version = EV_CURRENT;
+  header.e_shoff = section_headers_offset;
+  header.e_ehsize = sizeof(Elf64_Ehdr);
+  header.e_shentsize = sizeof(Elf64_Shdr);
+  header.e_shnum = Section_Count;
+  header.e_shstrndx = Shstrtab;
+  memcpy(file.data(), &header, sizeof(header));
+
+  os.write(reinterpret_cast<const char *>(file.data()),
+           std::streamsize(file.size()));
+}
+
+void write_assembly(Machine_Code &mc, const std::string &symbol,
+                    std::ostream &os) {
+  auto kernel = assemble_for_export(mc);
+  auto constants_label = ".L" + symbol + "_constants";
+
+  auto emit_bytes = [&](const std::vector<uint8_t> &bytes, size_t begin,
+                        size_t end) {
+    os << ".byte ";
+    for (size_t i = begin; i < end; i++) {
+      os << (i == begin ? "" : ",") << "0x" << std::hex << std::setw(2)
+         << std::setfill('0') << uint32_t(bytes[i]) << std::dec;
+    }
+  };
+
+  os << "/* generated by sdfjit for " << mc.target.isa << ":\n"
+     << " * void " << symbol
+     << "(void *xs, void *ys, void *zs, const void *uniforms,\n"
+     << " *     void *distances, void *materials, size_t count);\n"
+     << " * count has to be a multiple of " << mc.target.batch_size()
+     << ", and can't be 0 (see Executor::call) */\n\n";
+
+  os << "\t.text\n"
+     << "\t.globl " << symbol << "\n"
+     << "\t.type " << symbol << ", @function\n"
+     << "\t.balign 64\n"
+     << symbol << ":\n";
+
+  size_t next_fixup = 0;
+  for (size_t i = 0; i < kernel.instructions.size(); i++) {
+    auto [offset, size] = kernel.instructions[i];
+    if (size == 0) {
+      continue;
+    }
+
+    // references into the pool are written out as expressions, so that the
+    // assembler makes relocations for them
+    os << "\t";
+    auto end = offset + size;
+    auto separator = "";
+    while (next_fixup < kernel.fixups.size() &&
+           kernel.fixups[next_fixup].offset < end) {
+      const auto &fixup = kernel.fixups[next_fixup++];
+      if (fixup.offset > offset) {
+        os << separator;
+        emit_bytes(kernel.code, offset, fixup.offset);
+        separator = "; ";
+      }
+      auto addend = Exported_Kernel::addend(fixup);
+      os << separator << ".long " << constants_label
+         << (addend < 0 ? " - " : " + ") << std::abs(addend) << " - .";
+      separator = "; ";
+      offset = fixup.offset + sizeof(uint32_t);
+    }
+    if (offset < end) {
+      os << separator;
+      emit_bytes(kernel.code, offset, end);
+    }
+    os << " /* " << describe(mc.instructions[i]) << " */\n";
+  }
+  os << "\t.size " << symbol << ", . - " << symbol << "\n\n";
+
+  os << "\t.section .rodata\n"
+     << "\t.balign 64\n"
+     << constants_label << ":\n";
+  for (size_t offset = 0; offset < kernel.constants.size(); offset += 16) {
+    os << "\t";
+    emit_bytes(kernel.constants, offset,
+               std::min(offset + 16, kernel.constants.size()));
+    os << "\n";
+  }
+
+  // without this, linking the kernel in would make the stack executable
+  os << "\n\t.section .note.GNU-stack,\"\",@progbits\n";
+}
+
+} // namespace sdfjit::machinecode
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+
+#include "machinecode/machinecode.h"
+
+namespace sdfjit::machinecode {
+
+// writing finished kernels out to be linked into another program, so that a
+// scene that never changes doesn't have to be compiled at startup (and so the
+// usual tools, like perf annotate, work on it).
+//
+// Either way, `symbol` ends up as a global function with
+// Executor::Function_Type's signature. The code goes in .text, and the
+// constant pool goes in .rodata, with the code's references into it left for
+// the linker to fill in. Callers need to stick to what Executor::call does
+// for them: count is a non-zero multiple of the target's batch size.
+//
+// `mc` has to be finished, i.e. it's had add_prologue_and_epilogue() and
+// optimize(). It's only non-const because Assembler wants it that way.
+
+// a relocatable ELF object, as if `as` had made it
+void write_object(Machine_Code &mc, const std::string &symbol,
+                  std::ostream &os);
+
+// GNU assembler source for the same thing. The instructions go in as bytes
+// (since not every assembler knows all of them, or encodes them the way we
+// do), each with what it is in a comment next to it.
+void write_assembly(Machine_Code &mc, const std::string &symbol,
+                    std::ostream &os);
+
+} // namespace sdfjit::machinecode
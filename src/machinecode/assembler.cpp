@@ -5,10 +5,67 @@
 
 namespace sdfjit::machinecode {
 
+size_t Assembler::max_size() const {
+  // the constant pool might need up to 63 bytes of padding to line it up
+  return mc.instructions.size() * max_instruction_size + 63 +
+         mc.constants.size();
+}
+
 void Assembler::assemble() {
+  buffer.resize(max_size());
+  buffer.resize(assemble_into(buffer.data()));
+}
+
+size_t Assembler::assemble_into(uint8_t *memory) {
+  output = memory;
+  cursor = memory;
+  if (record_offsets) {
+    instruction_offsets_and_sizes.reserve(mc.instructions.size());
+  }
+
   for (const auto &instruction : mc.instructions) {
     assemble_instruction(instruction);
   }
+
+  resolve_label_fixups();
+  append_constant_pool();
+
+  auto size = offset();
+  cursor = nullptr;
+  return size;
+}
+
+void Assembler::append_constant_pool() {
+  // the widest thing in the pool is a zmm, so line it up for that. The padding
+  // is int3s, since nothing should be running it.
+  while (offset() % 64 != 0) {
+    emit_byte(0xcc);
+  }
+  constants_offset = offset();
+  memcpy(cursor, mc.constants.memory.data(), mc.constants.size());
+  cursor += mc.constants.size();
+
+  for (const auto &fixup : constant_fixups) {
+    auto rel = int64_t(constants_offset + fixup.constant_offset) -
+               int64_t(fixup.end);
+    auto bits = uint32_t(rel);
+    memcpy(output + fixup.offset, &bits, sizeof(bits));
+  }
+}
+
+void Assembler::resolve_label_fixups() {
+  for (const auto &[offset, label] : label_fixups) {
+    if (!label_offsets.count(label)) {
+      std::cerr << "Jump to undefined label " << label << std::endl;
+      abort();
+    }
+
+    // rel32 is relative to the end of the jump, which is right after it
+    auto rel = int64_t(label_offsets.at(label)) - int64_t(offset + 4);
+    auto bits = uint32_t(rel);
+    memcpy(output + offset, &bits, sizeof(bits));
+  }
+  label_fixups.clear();
 }
 
 void Assembler::assemble_instruction(const Instruction &instruction) {
@@ -18,274 +75,497 @@ void Assembler::assemble_instruction(const Instruction &instruction) {
     break;                                                                     \
   };
 
-  size_t begin = buffer.size();
-  switch (instruction.op) { FOREACH_MACHINE_OP(ASSEMBLE_OP); }
-  size_t end = buffer.size();
+  size_t begin = offset();
+  const auto &encoding = encodings[size_t(instruction.op)];
+  if (encoding.kind != Encoding::Kind::Special) {
+    vector_op(encoding, instruction);
+  } else {
+    switch (instruction.op) { FOREACH_MACHINE_OP(ASSEMBLE_OP); }
+  }
+  size_t end = offset();
 
   mark_instruction(begin, end - begin);
 }
 
-void Assembler::vminps(const Instruction &instruction) {
-  binary_op<0x5d>(instruction.registers.at(0), instruction.registers.at(1),
-                  instruction.registers.at(2));
+void Assembler::evex_op(Opcode_Map map, Simd_Prefix pp, uint8_t opcode,
+                        uint8_t reg, uint8_t vvvv, const Register &rm,
+                        size_t disp_scale, uint8_t opmask,
+                        size_t immediate_size) {
+  // the high register bits are all stored inverted. For a register in r/m, X
+  // holds bit 4 of the register number. For a memory reference it's the high
+  // bit of the (unused) index register.
+  uint8_t rm_num;
+  uint8_t x_bit;
+  if (rm.is_machine()) {
+    rm_num = register_number(rm.machine_reg());
+    x_bit = (rm_num >> 4) & 1;
+  } else {
+    rm_num = register_number(rm.memory_ref().machine_reg());
+    x_bit = 0;
+  }
+
+  // P0: R X B R' 0 m m m
+  uint32_t p0 = (~(reg >> 3) & 1) << 7 | (~x_bit & 1) << 6 |
+                (~(rm_num >> 3) & 1) << 5 | (~(reg >> 4) & 1) << 4 |
+                uint8_t(map);
+  // P1: W v v v v 1 p p
+  uint32_t p1 = (~vvvv & 0xf) << 3 | 0x4 | uint8_t(pp);
+  // P2: z L' L b V' a a a  (L'L = 0b10 is 512 bits)
+  uint32_t p2 = 0x2 << 5 | (~(vvvv >> 4) & 1) << 3 | (opmask & 0x7);
+  emit_dword(0x62 | p0 << 8 | p1 << 16 | p2 << 24);
+  emit_byte(opcode);
+
+  emit_modrm(reg, rm, disp_scale, immediate_size);
 }
 
-void Assembler::vmaxps(const Instruction &instruction) {
-  binary_op<0x5f>(instruction.registers.at(0), instruction.registers.at(1),
-                  instruction.registers.at(2));
+void Assembler::vex_op(Opcode_Map map, Simd_Prefix pp, uint8_t opcode,
+                       uint8_t reg, uint8_t vvvv, const Register &rm,
+                       size_t immediate_size) {
+  uint8_t rm_num;
+  if (rm.is_machine()) {
+    rm_num = register_number(rm.machine_reg());
+  } else {
+    rm_num = register_number(rm.memory_ref().machine_reg());
+  }
+
+  // the R, X, B and vvvv fields are all stored inverted. We never have an
+  // index register, so X is always clear.
+  if (map == Opcode_Map::Map_0F && (rm_num >> 3) == 0) {
+    // R v v v v L p p  (L = 1 is 256 bits)
+    uint32_t p0 = (~(reg >> 3) & 1) << 7 | (~vvvv & 0xf) << 3 | 0x4 |
+                  uint8_t(pp);
+    emit_word(0xc5 | p0 << 8);
+    emit_byte(opcode);
+  } else {
+    // R X B m m m m m
+    // W v v v v L p p
+    uint32_t p0 = (~(reg >> 3) & 1) << 7 | 1 << 6 |
+                  (~(rm_num >> 3) & 1) << 5 | uint8_t(map);
+    uint32_t p1 = (~vvvv & 0xf) << 3 | 0x4 | uint8_t(pp);
+    emit_dword(0xc4 | p0 << 8 | p1 << 16 | uint32_t(opcode) << 24);
+  }
+
+  emit_modrm(reg, rm, 1, immediate_size);
 }
 
-void Assembler::vmovaps(const Instruction &instruction) {
-  auto &lhs = instruction.registers.at(0);
-  auto &rhs = instruction.registers.at(1);
+void Assembler::emit_modrm(uint8_t reg, const Register &rm,
+                           size_t disp_scale, size_t immediate_size) {
+  if (rm.is_machine()) {
+    emit_byte(0xc0 | (reg & 7) << 3 | (register_number(rm.machine_reg()) & 7));
+    return;
+  }
 
-  Machine_Register reg;
-  Memory_Reference mem;
-
-  enum class Move_Direction { Load, Store };
-  Move_Direction direction;
-
-  if (lhs.is_machine() && rhs.is_memory()) {
-    // vmovaps reg, [memory_location]
-    direction = Move_Direction::Load;
-    reg = lhs.machine_reg();
-    mem = rhs.memory_ref();
-  } else if (lhs.is_memory() && rhs.is_machine()) {
-    // vmovaps [memory_location], reg
-    direction = Move_Direction::Store;
-    reg = rhs.machine_reg();
-    mem = lhs.memory_ref();
-  } else if (lhs.is_machine() && rhs.is_machine()) {
-    // vmovaps reg, reg
-    // we handle this all directly in here, since it's simple
-    emit_byte(0xc5);
-    emit_byte(0xfc);
-    emit_byte(0x28);
-    emit_byte(0xc0 | (register_number(lhs.machine_reg()) << 3) |
-              register_number(rhs.machine_reg()));
+  auto mem = rm.memory_ref();
+  if (mem.machine_reg() == Machine_Register::rip) {
+    // mod = 00 and r/m = 101 is [rip + disp32]. The displacement is from the
+    // end of the instruction to the constant, and the constant pool doesn't
+    // have a place yet, so append_constant_pool fills it in later.
+    emit_byte((reg & 7) << 3 | 0x5);
+    constant_fixups.push_back(
+        {this->offset(), this->offset() + sizeof(uint32_t) + immediate_size,
+         mem.offset});
+    emit_dword(0);
     return;
+  }
+
+  auto base = register_number(mem.machine_reg());
+  auto offset = int64_t(mem.offset);
+
+  // EVEX 8-bit displacements are implicitly multiplied by the size of the
+  // memory operand, so we can only use them for offsets that are a multiple
+  // of it. Everything else has a disp_scale of 1.
+  uint8_t mod;
+  if (offset == 0 && (base & 7) != 5) {
+    mod = 0x00;
+  } else if (offset % int64_t(disp_scale) == 0 &&
+             offset / int64_t(disp_scale) >= -0x80 &&
+             offset / int64_t(disp_scale) < 0x80) {
+    mod = 0x40;
+  } else if (offset >= INT32_MIN && offset <= INT32_MAX) {
+    mod = 0x80;
   } else {
-    // we don't handle these right now
-    std::cerr << "Unhandled kind of access pair in vmovaps" << std::endl;
+    std::cerr << "unhandled offset size: " << offset << " in operand"
+              << std::endl;
     abort();
   }
 
-  auto mem_reg_num = register_number(mem.machine_reg());
+  emit_byte(mod | (reg & 7) << 3 | (base & 7));
+  // rsp and r12 as a base require a SIB byte
+  if ((base & 7) == 4) {
+    emit_byte(0x24);
+  }
 
-  // we need to use the B field to extend if our memory base reg number doesn't
-  // fit in 3 bits, meaning we need to use a 3-byte VEX prefix. otherwise, we
-  // can use a 2-byte VEX prefix, which is obviously a bit more compact.
-  if (mem_reg_num > 7) {
-    auto mem_reg_bit = ~(mem_reg_num >> 3) & 1;
+  if (mod == 0x40) {
+    emit_byte(uint8_t(offset / int64_t(disp_scale)));
+  } else if (mod == 0x80) {
+    emit_dword(uint32_t(offset));
+  }
+}
 
-    emit_byte(0xc4);
-    emit_byte(0xc0 | (mem_reg_bit << 5) | 1);
-    emit_byte(0x7c); // XXX: do we have any need to compute this here?
+void Assembler::sse_op(Simd_Prefix pp, Opcode_Map map, uint8_t opcode,
+                       uint8_t reg, const Register &rm,
+                       size_t immediate_size) {
+  switch (pp) {
+  case Simd_Prefix::None:
+    break;
+  case Simd_Prefix::P66:
+    emit_byte(0x66);
+    break;
+  case Simd_Prefix::PF3:
+    emit_byte(0xf3);
+    break;
+  case Simd_Prefix::PF2:
+    emit_byte(0xf2);
+    break;
+  }
+
+  uint8_t rm_num;
+  if (rm.is_machine()) {
+    rm_num = register_number(rm.machine_reg());
   } else {
-    emit_byte(0xc5);
-    emit_byte(0xfc);
+    rm_num = register_number(rm.memory_ref().machine_reg());
   }
 
-  switch (direction) {
-  case Move_Direction::Load: {
-    emit_byte(0x28);
-    break;
+  // REX, only if we need the high bit of either register
+  uint8_t rex = 0x40 | ((reg >> 3) & 1) << 2 | ((rm_num >> 3) & 1);
+  if (rex != 0x40) {
+    emit_byte(rex);
   }
-  case Move_Direction::Store: {
-    emit_byte(0x29);
+
+  emit_byte(0x0f);
+  switch (map) {
+  case Opcode_Map::Map_0F:
+    break;
+  case Opcode_Map::Map_0F38:
+    emit_byte(0x38);
+    break;
+  case Opcode_Map::Map_0F3A:
+    emit_byte(0x3a);
     break;
   }
-  }
+  emit_byte(opcode);
 
-  // the encoding is the same for loads and stores
-  // (arg1 = register, arg2 = memory)
-  //
-  if (mem.offset == 0) {
-    // offsets of zero don't need an immediate
+  emit_modrm(reg, rm, 1, immediate_size);
+}
 
-    // mod r/m:
-    emit_byte((register_number(reg) << 3) | (mem_reg_num & 7));
-    // SIB, only for some registers:
-    // XXX: technically more than rsp are required, but we don't use them.
-    //      Maybe eventually we want to support them
-    if (mem.machine_reg() == Machine_Register::rsp) {
-      emit_byte((register_number(mem.machine_reg()) << 3) | (mem_reg_num & 7));
-    }
-  } else if (mem.offset < 0x80) {
-    // offsets of less than 0x80 can use a 1-byte immediate
-
-    // mod r/m:
-    emit_byte(0x40 | (register_number(reg) << 3) | (mem_reg_num & 7));
-
-    // SIB, only for some registers:
-    // XXX: technically more than rsp are required, but we don't use them.
-    //      Maybe eventually we want to support them
-    if (mem.machine_reg() == Machine_Register::rsp) {
-      emit_byte((register_number(mem.machine_reg()) << 3) |
-                register_number(mem.machine_reg()));
+void Assembler::sse_binary_op(Simd_Prefix pp, Opcode_Map map, uint8_t opcode,
+                              bool commutative, const Register &r1,
+                              const Register &r2, const Register &r3,
+                              size_t immediate_size) {
+  const Register *src1 = &r2;
+  const Register *src2 = &r3;
+
+  // copying src1 in would clobber src2, so do it the other way around if we
+  // can.
+  if (r1 == r3 && !(r1 == r2)) {
+    if (!commutative) {
+      std::cerr << "Can't encode non-commutative SSE op with dst == src2"
+                << std::endl;
+      abort();
     }
+    std::swap(src1, src2);
+  }
 
-    // imm:
-    emit_byte(mem.offset);
-  } else if (mem.offset < 0xffffffff) {
-    // offsets in this range use a dword immediate
-
-    // mod r/m:
-    emit_byte(0x80 | (register_number(reg) << 3) | (mem_reg_num & 7));
+  auto dst = register_number(r1.machine_reg());
+  if (!(r1 == *src1)) {
+    // movaps dst, src1
+    sse_op(Simd_Prefix::None, Opcode_Map::Map_0F, 0x28, dst, *src1);
+  }
+  sse_op(pp, map, opcode, dst, *src2, immediate_size);
+}
 
-    // SIB, only for some registers:
-    // XXX: technically more than rsp are required, but we don't use them.
-    //      Maybe eventually we want to support them
-    if (mem.machine_reg() == Machine_Register::rsp) {
-      emit_byte((register_number(mem.machine_reg()) << 3) |
-                register_number(mem.machine_reg()));
+void Assembler::vector_op(const Encoding &encoding,
+                          const Instruction &instruction) {
+  const auto &dst = instruction.registers[0];
+  const auto &src = instruction.registers[1];
+  bool unary = encoding.kind == Encoding::Kind::Unary;
+  auto rn = register_number(dst.machine_reg());
+
+  switch (register_family(dst.machine_reg())) {
+  case Register_Family::ZMM:
+    if (unary) {
+      evex_op(encoding.evex_map, encoding.evex_pp, encoding.evex_opcode, rn, 0,
+              src, 64);
+    } else {
+      evex_op(encoding.evex_map, encoding.evex_pp, encoding.evex_opcode, rn,
+              register_number(src.machine_reg()), instruction.registers[2],
+              64);
     }
-
-    // imm:
-    emit_dword(mem.offset);
-  } else {
-    std::cout << "unhandled offset size: " << mem.offset
-              << " in instruction: " << instruction << std::endl;
+    break;
+  case Register_Family::YMM:
+    if (unary) {
+      vex_op(encoding.map, encoding.pp, encoding.opcode, rn, 0, src);
+    } else {
+      vex_op(encoding.map, encoding.pp, encoding.opcode, rn,
+             register_number(src.machine_reg()), instruction.registers[2]);
+    }
+    break;
+  case Register_Family::XMM:
+    if (unary) {
+      sse_op(encoding.pp, encoding.map, encoding.opcode, rn, src);
+    } else {
+      sse_binary_op(encoding.pp, encoding.map, encoding.opcode,
+                    encoding.commutative, dst, src, instruction.registers[2]);
+    }
+    break;
+  default:
+    std::cerr << "No encoding for " << instruction << std::endl;
     abort();
   }
 }
 
-void Assembler::vbroadcastss(const Instruction &instruction) {
-  auto dst = instruction.registers.at(0).machine_reg();
-  auto src = instruction.registers.at(1).memory_ref();
-
-  emit_byte(0xc4);
-  emit_byte(0xe2);
-  emit_byte(0x7d);
-  emit_byte(0x18);
+#define ASSERT_HAS_ENCODING(name)                                              \
+  static_assert(encodings[size_t(Op::name)].kind != Encoding::Kind::Special,   \
+                "missing an encoding for " #name);
+FOREACH_TABLE_ENCODED_OP(ASSERT_HAS_ENCODING)
+#undef ASSERT_HAS_ENCODING
 
-  // XXX: we only handle broadcasts of constants here, which are all stored
-  //      offset from rcx, so assert that we're only using rcx
-  if (src.machine_reg() != Machine_Register::rcx) {
-    abort();
+#define DEFINE_TABLE_OP_EMITTER(name)                                          \
+  void Assembler::name(const Instruction &instruction) {                      \
+    vector_op(encodings[size_t(Op::name)], instruction);                       \
   }
+FOREACH_TABLE_ENCODED_OP(DEFINE_TABLE_OP_EMITTER)
+#undef DEFINE_TABLE_OP_EMITTER
 
-  if (src.offset == 0) {
-    // zeros can be done with
-    emit_byte((register_number(dst) << 3) | register_number(src.machine_reg()));
-  } else if (src.offset < 0x80) {
-    emit_byte(0x40 | (register_number(dst) << 3) |
-              register_number(src.machine_reg()));
-    emit_byte(src.offset);
-  } else {
-    std::cerr << "Unexpected offset for vbroadcastss: " << src.offset
+void Assembler::vmovaps(const Instruction &instruction) {
+  auto &lhs = instruction.registers.at(0);
+  auto &rhs = instruction.registers.at(1);
+
+  // one side has to be a register, and that decides which encoding we want.
+  // The load form takes care of register to register moves too.
+  bool is_load = lhs.is_machine();
+  auto &reg = is_load ? lhs : rhs;
+  auto &other = is_load ? rhs : lhs;
+  uint8_t opcode = is_load ? 0x28 : 0x29;
+
+  if (!reg.is_machine()) {
+    // we don't handle these right now
+    std::cerr << "Unhandled kind of access pair in vmovaps: " << instruction
               << std::endl;
     abort();
   }
-}
 
-void Assembler::vsqrtps(const Instruction &instruction) {
-  unary_op<0x51>(instruction.registers.at(0), instruction.registers.at(1));
+  auto rn = register_number(reg.machine_reg());
+  switch (register_family(reg.machine_reg())) {
+  case Register_Family::XMM:
+    // movaps xmm, xmm/[memory_location] or movaps [memory_location], xmm
+    sse_op(Simd_Prefix::None, Opcode_Map::Map_0F, opcode, rn, other);
+    break;
+  case Register_Family::YMM:
+    vex_op(Opcode_Map::Map_0F, Simd_Prefix::None, opcode, rn, 0, other);
+    break;
+  case Register_Family::ZMM:
+    evex_op(Opcode_Map::Map_0F, Simd_Prefix::None, opcode, rn, 0, other, 64);
+    break;
+  default:
+    std::cerr << "Unhandled register in vmovaps: " << instruction << std::endl;
+    abort();
+  }
 }
 
-void Assembler::vrsqrtps(const Instruction &instruction) {
-  unary_op<0x52>(instruction.registers.at(0), instruction.registers.at(1));
-}
+void Assembler::vbroadcastss(const Instruction &instruction) {
+  auto dst = instruction.registers.at(0).machine_reg();
 
-void Assembler::vaddps(const Instruction &instruction) {
-  binary_op<0x58>(instruction.registers.at(0), instruction.registers.at(1),
-                  instruction.registers.at(2));
-}
+  if (register_family(dst) == Register_Family::ZMM) {
+    // the memory operand is a single float, so disp8 is scaled by 4
+    evex_op(Opcode_Map::Map_0F38, Simd_Prefix::P66, 0x18, register_number(dst),
+            0, instruction.registers.at(1), sizeof(float));
+    return;
+  } else if (register_family(dst) == Register_Family::XMM) {
+    // SSE doesn't have a broadcast, so load the scalar and then shuffle it out
+    // to the other lanes:
+    // movss dst, [src]
+    // shufps dst, dst, 0
+    sse_op(Simd_Prefix::PF3, Opcode_Map::Map_0F, 0x10, register_number(dst),
+           instruction.registers.at(1));
+    sse_op(Simd_Prefix::None, Opcode_Map::Map_0F, 0xc6, register_number(dst),
+           instruction.registers.at(0), 1);
+    emit_byte(0x00);
+    return;
+  }
 
-void Assembler::vsubps(const Instruction &instruction) {
-  binary_op<0x5c>(instruction.registers.at(0), instruction.registers.at(1),
-                  instruction.registers.at(2));
+  vex_op(Opcode_Map::Map_0F38, Simd_Prefix::P66, 0x18, register_number(dst), 0,
+         instruction.registers.at(1));
 }
 
-void Assembler::vmulps(const Instruction &instruction) {
+void Assembler::vector_shift_op(uint8_t extension,
+                                const Instruction &instruction) {
+  auto dst = register_number(instruction.registers.at(0).machine_reg());
+  auto src = register_number(instruction.registers.at(1).machine_reg());
+  auto imm = uint32_t(instruction.registers.at(2).imm());
 
-  binary_op<0x59>(instruction.registers.at(0), instruction.registers.at(1),
-                  instruction.registers.at(2));
-}
+  if (imm > 0xff) {
+    std::cerr << "Immediate to shift is too large: " << instruction
+              << std::endl;
+    abort();
+  }
 
-void Assembler::vdivps(const Instruction &instruction) {
-  binary_op<0x5e>(instruction.registers.at(0), instruction.registers.at(1),
-                  instruction.registers.at(2));
-}
+  if (register_family(instruction.registers.at(0).machine_reg()) ==
+      Register_Family::ZMM) {
+    // the destination goes in vvvv, and ModRM.reg is an opcode extension
+    evex_op(Opcode_Map::Map_0F, Simd_Prefix::P66, 0x72, extension, dst,
+            instruction.registers.at(1), 64, 0, 1);
+    emit_byte(imm);
+    return;
+  } else if (register_family(instruction.registers.at(0).machine_reg()) ==
+             Register_Family::XMM) {
+    // this one is two-operand in SSE, so shift the destination in place
+    if (dst != src) {
+      sse_op(Simd_Prefix::None, Opcode_Map::Map_0F, 0x28, dst,
+             instruction.registers.at(1));
+    }
+    sse_op(Simd_Prefix::P66, Opcode_Map::Map_0F, 0x72, extension,
+           instruction.registers.at(0), 1);
+    emit_byte(imm);
+    return;
+  }
 
-void Assembler::vandps(const Instruction &instruction) {
-  binary_op<0x54>(instruction.registers.at(0), instruction.registers.at(1),
-                  instruction.registers.at(2));
+  vex_op(Opcode_Map::Map_0F, Simd_Prefix::P66, 0x72, extension, dst,
+         instruction.registers.at(1), 1);
+  emit_byte(imm);
 }
 
-void Assembler::vandnps(const Instruction &instruction) {
-  binary_op<0x55>(instruction.registers.at(0), instruction.registers.at(1),
-                  instruction.registers.at(2));
+void Assembler::vpslld(const Instruction &instruction) {
+  vector_shift_op(6, instruction);
 }
 
-void Assembler::vorps(const Instruction &instruction) {
-  binary_op<0x56>(instruction.registers.at(0), instruction.registers.at(1),
-                  instruction.registers.at(2));
+void Assembler::vpsrld(const Instruction &instruction) {
+  vector_shift_op(2, instruction);
 }
 
-void Assembler::vxorps(const Instruction &instruction) {
-  binary_op<0x57>(instruction.registers.at(0), instruction.registers.at(1),
-                  instruction.registers.at(2));
+void Assembler::vpsrad(const Instruction &instruction) {
+  vector_shift_op(4, instruction);
 }
 
-void Assembler::vpslld(const Instruction &instruction) {
+void Assembler::vroundps(const Instruction &instruction) {
   auto dst = register_number(instruction.registers.at(0).machine_reg());
-  auto src = register_number(instruction.registers.at(1).machine_reg());
   auto imm = uint32_t(instruction.registers.at(2).imm());
 
   if (imm > 0xff) {
-    std::cerr << "Immediate to vpslld is too large: " << imm << std::endl;
+    std::cerr << "Immediate to vroundps is too large: " << imm << std::endl;
     abort();
   }
 
-  emit_byte(0xc5);
-  emit_byte(0x80 | ((~dst & 0xf) << 3) | 0x5);
-  emit_byte(0x72);
-  emit_byte(0xf0 | src);
+  if (register_family(instruction.registers.at(0).machine_reg()) ==
+      Register_Family::ZMM) {
+    // vrndscaleps with a scale of zero (the high nibble of the immediate) is
+    // the AVX-512 replacement for vroundps, and the rounding control bits are
+    // the same
+    evex_op(Opcode_Map::Map_0F3A, Simd_Prefix::P66, 0x08, dst, 0,
+            instruction.registers.at(1), 64, 0, 1);
+    emit_byte(imm & 0x0f);
+    return;
+  } else if (register_family(instruction.registers.at(0).machine_reg()) ==
+             Register_Family::XMM) {
+    // roundps
+    sse_op(Simd_Prefix::P66, Opcode_Map::Map_0F3A, 0x08, dst,
+           instruction.registers.at(1), 1);
+    emit_byte(imm);
+    return;
+  }
+
+  vex_op(Opcode_Map::Map_0F3A, Simd_Prefix::P66, 0x08, dst, 0,
+         instruction.registers.at(1), 1);
   emit_byte(imm);
 }
 
-void Assembler::vpsrld(const Instruction &instruction) {
+void Assembler::vcmpps(const Instruction &instruction) {
+  // vcmpps looks like any other binary instruction, but also takes an byte
+  // immediate to tell it which comparison type to do
+  if (register_family(instruction.registers.at(0).machine_reg()) ==
+      Register_Family::OPMASK) {
+    // the AVX-512 version writes one bit per lane into an opmask register
+    evex_op(Opcode_Map::Map_0F, Simd_Prefix::None, 0xc2,
+            register_number(instruction.registers.at(0).machine_reg()),
+            register_number(instruction.registers.at(1).machine_reg()),
+            instruction.registers.at(2), 64, 0, 1);
+    emit_byte(uint32_t(instruction.registers.at(3).imm()));
+    return;
+  } else if (register_family(instruction.registers.at(0).machine_reg()) ==
+             Register_Family::XMM) {
+    sse_binary_op(Simd_Prefix::None, Opcode_Map::Map_0F, 0xc2, false,
+                  instruction.registers.at(0), instruction.registers.at(1),
+                  instruction.registers.at(2), 1);
+    emit_byte(uint32_t(instruction.registers.at(3).imm()));
+    return;
+  }
+  vex_op(Opcode_Map::Map_0F, Simd_Prefix::None, 0xc2,
+         register_number(instruction.registers.at(0).machine_reg()),
+         register_number(instruction.registers.at(1).machine_reg()),
+         instruction.registers.at(2), 1);
+  emit_byte(uint32_t(instruction.registers.at(3).imm()));
+}
+
+void Assembler::vblendmps(const Instruction &instruction) {
+  // vblendmps dst {mask}, false_case, true_case
   auto dst = register_number(instruction.registers.at(0).machine_reg());
-  auto src = register_number(instruction.registers.at(1).machine_reg());
-  auto imm = uint32_t(instruction.registers.at(2).imm());
+  auto mask = register_number(instruction.registers.at(1).machine_reg());
+  auto false_case = register_number(instruction.registers.at(2).machine_reg());
 
-  if (imm > 0xff) {
-    std::cerr << "Immediate to vpsrld is too large: " << imm << std::endl;
+  evex_op(Opcode_Map::Map_0F38, Simd_Prefix::P66, 0x65, dst, false_case,
+          instruction.registers.at(3), 64, mask);
+}
+
+void Assembler::vblendvps(const Instruction &instruction) {
+  // vblendvps dst, false_case, true_case, mask. The mask register goes in the
+  // top four bits of a trailing immediate.
+  auto dst = instruction.registers.at(0).machine_reg();
+  auto mask = register_number(instruction.registers.at(1).machine_reg());
+  auto false_case = register_number(instruction.registers.at(2).machine_reg());
+
+  if (register_family(dst) != Register_Family::YMM) {
+    std::cerr << "No vblendvps encoding for " << instruction << std::endl;
     abort();
   }
 
-  emit_byte(0xc5);
-  emit_byte(0x80 | ((~dst & 0xf) << 3) | 0x5);
-  emit_byte(0x72);
-  emit_byte(0xd0 | src);
-  emit_byte(imm);
+  vex_op(Opcode_Map::Map_0F3A, Simd_Prefix::P66, 0x4a, register_number(dst),
+         false_case, instruction.registers.at(3), 1);
+  emit_byte(mask << 4);
 }
 
-void Assembler::vroundps(const Instruction &instruction) {
-  auto dst = register_number(instruction.registers.at(0).machine_reg());
-  auto src = register_number(instruction.registers.at(1).machine_reg());
-  auto imm = uint32_t(instruction.registers.at(2).imm());
+void Assembler::fma_op(uint8_t opcode, const Instruction &instruction) {
+  auto &dst = instruction.registers.at(0);
+  auto &addend = instruction.registers.at(1);
+  auto &lhs = instruction.registers.at(2);
+  auto &rhs = instruction.registers.at(3);
+
+  // the instruction accumulates into dst, so the addend has to be there first.
+  // The register allocator usually makes this a no-op.
+  if (!(dst == addend)) {
+    if (dst == lhs || dst == rhs) {
+      std::cerr << "Can't encode fma with dst == a multiplicand: "
+                << instruction << std::endl;
+      abort();
+    }
+    vmovaps(Instruction{Op::vmovaps, {dst, addend}});
+  }
 
-  if (imm > 0xff) {
-    std::cerr << "Immediate to vroundps is too large: " << imm << std::endl;
+  auto rn_dst = register_number(dst.machine_reg());
+  auto rn_lhs = register_number(lhs.machine_reg());
+  switch (register_family(dst.machine_reg())) {
+  case Register_Family::ZMM:
+    evex_op(Opcode_Map::Map_0F38, Simd_Prefix::P66, opcode, rn_dst, rn_lhs, rhs,
+            64);
+    break;
+  case Register_Family::YMM:
+    vex_op(Opcode_Map::Map_0F38, Simd_Prefix::P66, opcode, rn_dst, rn_lhs, rhs);
+    break;
+  default:
+    std::cerr << "No fma encoding for " << instruction << std::endl;
     abort();
   }
+}
 
-  emit_byte(0xc4);
-  emit_byte(0xe3);
-  emit_byte(0x7d); // not sure if we need to set flags in here...
-  emit_byte(0x08);
-  emit_byte(0xc0 | (dst << 3) | src);
-  emit_byte(imm);
+void Assembler::vfmadd231ps(const Instruction &instruction) {
+  fma_op(0xb8, instruction);
 }
 
-void Assembler::vcmpps(const Instruction &instruction) {
-  // vcmpps looks like any other binary instruction, but also takes an byte
-  // immediate to tell it which comparison type to do
-  binary_op<0xc2>(instruction.registers.at(0), instruction.registers.at(1),
-                  instruction.registers.at(2));
-  emit_byte(uint32_t(instruction.registers.at(3).imm()));
+void Assembler::vfmsub231ps(const Instruction &instruction) {
+  fma_op(0xba, instruction);
+}
+
+void Assembler::vfnmadd231ps(const Instruction &instruction) {
+  fma_op(0xbc, instruction);
 }
 
 void Assembler::pop(const Instruction &instruction) {
@@ -310,66 +590,66 @@ void Assembler::ret(const Instruction &instruction) {
   emit_byte(0xc3);
 }
 
-void Assembler::add(const Instruction &instruction) {
+void Assembler::gpr_imm_op(uint8_t extension,
+                           const Instruction &instruction) {
   auto dst = instruction.registers.at(0);
   auto src = instruction.registers.at(1);
 
-  if (dst.is_machine() && src.is_immediate()) {
-    if (dst.machine_reg() != Machine_Register::rsp) {
-      // we only need this for rsp and I'd rather just fast-fail if we don't
-      // have that and deal with figuring out whether it encodes the same until
-      // then.
-      abort();
-    }
+  if (!dst.is_machine() || !src.is_immediate() ||
+      register_family(dst.machine_reg()) != Register_Family::GPR) {
+    // we don't support other kinds right now because i am lazy
+    std::cerr << "unsupported operands: " << instruction << std::endl;
+    abort();
+  }
 
-    emit_byte(0x48);
-    auto imm = uint32_t(src.imm());
-    if (imm <= 0x7f) {
-      emit_byte(0x83);
-      emit_byte(0xc0 | register_number(dst.machine_reg()));
-      emit_byte(imm);
-    } else if (imm <= 0xffffffff) {
-      emit_byte(0x81);
-      emit_byte(0xc0 | register_number(dst.machine_reg()));
-      emit_dword(imm);
-    } else {
-      abort();
-    }
+  auto rn = register_number(dst.machine_reg());
+  auto imm = uint64_t(src.imm());
+
+  // REX.W, plus REX.B for r8+
+  emit_byte(0x48 | ((rn >> 3) & 1));
+  if (imm <= 0x7f) {
+    emit_byte(0x83);
+    emit_byte(0xc0 | extension << 3 | (rn & 7));
+    emit_byte(imm);
+  } else if (imm <= 0x7fffffff) {
+    emit_byte(0x81);
+    emit_byte(0xc0 | extension << 3 | (rn & 7));
+    emit_dword(imm);
   } else {
-    // we don't support other kinds right now because i am lazy
     abort();
   }
 }
 
-void Assembler::sub(const Instruction &instruction) {
+void Assembler::add(const Instruction &instruction) {
   auto dst = instruction.registers.at(0);
   auto src = instruction.registers.at(1);
+  if (dst.is_machine() && src.is_machine()) {
+    // add reg, reg
+    auto dst_num = register_number(dst.machine_reg());
+    auto src_num = register_number(src.machine_reg());
+    emit_byte(0x48 | ((src_num >> 3) & 1) << 2 | ((dst_num >> 3) & 1));
+    emit_byte(0x01);
+    emit_byte(0xc0 | (src_num & 7) << 3 | (dst_num & 7));
+    return;
+  }
+  gpr_imm_op(0, instruction);
+}
 
-  if (dst.is_machine() && src.is_immediate()) {
-    if (dst.machine_reg() != Machine_Register::rsp) {
-      // we only need this for rsp and I'd rather just fast-fail if we don't
-      // have that and deal with figuring out whether it encodes the same until
-      // then.
-      abort();
-    }
+void Assembler::sub(const Instruction &instruction) {
+  gpr_imm_op(5, instruction);
+}
 
-    emit_byte(0x48);
-    auto imm = uint32_t(src.imm());
-    if (imm <= 0x7f) {
-      emit_byte(0x83);
-      emit_byte(0xe8 | register_number(dst.machine_reg()));
-      emit_byte(imm);
-    } else if (uint32_t(imm) <= 0xffffffff) {
-      emit_byte(0x81);
-      emit_byte(0xe8 | register_number(dst.machine_reg()));
-      emit_dword(imm);
-    } else {
-      abort();
-    }
-  } else {
-    // we don't support other kinds right now because i am lazy
-    abort();
-  }
+void Assembler::label(const Instruction &instruction) {
+  label_offsets[uint64_t(instruction.registers.at(0).imm())] = offset();
+}
+
+void Assembler::jg(const Instruction &instruction) {
+  // jg rel32, we patch in the offset once we know where everything is
+  emit_byte(0x0f);
+  emit_byte(0x8f);
+  label_fixups.push_back(
+      {offset(), uint64_t(instruction.registers.at(0).imm())});
+  emit_dword(0);
 }
 
 void Assembler::and64(const Instruction &instruction) {
@@ -384,7 +664,9 @@ void Assembler::and64(const Instruction &instruction) {
   auto reg = lhs.machine_reg();
   auto imm = uint64_t(rhs.imm());
 
-  if (reg != Machine_Register::rsp || imm != 0xffffffffffffffe0) {
+  // we only use this to align the stack, so only handle small negative
+  // immediates that fit in a sign-extended byte
+  if (reg != Machine_Register::rsp || imm < 0xffffffffffffff80) {
     std::cerr << "unsupported operands to and64, aborting" << std::endl;
     abort();
   }
@@ -392,7 +674,7 @@ void Assembler::and64(const Instruction &instruction) {
   emit_byte(0x48);
   emit_byte(0x83);
   emit_byte(0xe4);
-  emit_byte(0xe0);
+  emit_byte(imm & 0xff);
 }
 
 void Assembler::mov(const Instruction &instruction) {
@@ -400,10 +682,18 @@ void Assembler::mov(const Instruction &instruction) {
   auto src = instruction.registers.at(1);
 
   if (src.is_machine() && dst.is_machine()) {
-    emit_byte(0x48);
+    auto dst_num = register_number(dst.machine_reg());
+    auto src_num = register_number(src.machine_reg());
+    emit_byte(0x48 | ((src_num >> 3) & 1) << 2 | ((dst_num >> 3) & 1));
     emit_byte(0x89);
-    emit_byte(0xc0 | (register_number(src.machine_reg()) << 3) |
-              register_number(dst.machine_reg()));
+    emit_byte(0xc0 | (src_num & 7) << 3 | (dst_num & 7));
+  } else if (dst.is_machine() && src.is_memory()) {
+    // mov reg, [memory_location]
+    auto rn = register_number(dst.machine_reg());
+    auto base = register_number(src.memory_ref().machine_reg());
+    emit_byte(0x48 | ((rn >> 3) & 1) << 2 | ((base >> 3) & 1));
+    emit_byte(0x8b);
+    emit_modrm(rn, src, 1);
   } else {
     // we don't handle this right now
     abort();
@@ -1,93 +1,246 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <unordered_map>
 #include <vector>
 
 #include "machinecode.h"
 
 namespace sdfjit::machinecode {
 
+// the opcode map and mandatory prefix fields, encoded the way the VEX and EVEX
+// prefixes want them
+enum class Opcode_Map : uint8_t { Map_0F = 1, Map_0F38 = 2, Map_0F3A = 3 };
+enum class Simd_Prefix : uint8_t { None = 0, P66 = 1, PF3 = 2, PF2 = 3 };
+
+// how to encode the ops that are just an opcode applied to a destination
+// register and one or two sources, the last of which can be in memory.
+// Anything that needs more than that (an immediate, an opmask, or more than one
+// instruction on some targets) is Special, and has its own emitter.
+struct Encoding {
+  enum class Kind : uint8_t { Special, Unary, Binary };
+
+  Kind kind{Kind::Special};
+  Opcode_Map map{Opcode_Map::Map_0F};
+  Simd_Prefix pp{Simd_Prefix::None};
+  uint8_t opcode{0};
+  // AVX-512 sometimes needs a different instruction to do the same thing
+  Opcode_Map evex_map{Opcode_Map::Map_0F};
+  Simd_Prefix evex_pp{Simd_Prefix::None};
+  uint8_t evex_opcode{0};
+  // whether the SSE version is allowed to swap the sources around
+  bool commutative{false};
+
+  static constexpr Encoding unary(uint8_t byte) {
+    return {Kind::Unary, Opcode_Map::Map_0F, Simd_Prefix::None, byte,
+            Opcode_Map::Map_0F, Simd_Prefix::None, byte, false};
+  }
+  static constexpr Encoding binary(uint8_t byte, bool swappable = false) {
+    return {Kind::Binary, Opcode_Map::Map_0F, Simd_Prefix::None, byte,
+            Opcode_Map::Map_0F, Simd_Prefix::None, byte, swappable};
+  }
+  constexpr Encoding with_evex(Opcode_Map new_map, Simd_Prefix new_pp,
+                               uint8_t byte) const {
+    auto result = *this;
+    result.evex_map = new_map;
+    result.evex_pp = new_pp;
+    result.evex_opcode = byte;
+    return result;
+  }
+};
+
+// clang-format off
+#define FOREACH_TABLE_ENCODED_OP(macro) \
+    macro(vsqrtps) \
+    macro(vrsqrtps) \
+    macro(vaddps) \
+    macro(vsubps) \
+    macro(vmulps) \
+    macro(vdivps) \
+    macro(vminps) \
+    macro(vmaxps) \
+    macro(vandps) \
+    macro(vandnps) \
+    macro(vorps) \
+    macro(vxorps)
+// clang-format on
+
+constexpr Encoding encoding_for(Op op) {
+  switch (op) {
+  case Op::vsqrtps:
+    return Encoding::unary(0x51);
+  // there's no EVEX vrsqrtps. vrsqrt14ps is the AVX-512 replacement (and is
+  // a bit more precise)
+  case Op::vrsqrtps:
+    return Encoding::unary(0x52).with_evex(Opcode_Map::Map_0F38,
+                                           Simd_Prefix::P66, 0x4e);
+  case Op::vaddps:
+    return Encoding::binary(0x58, true);
+  case Op::vsubps:
+    return Encoding::binary(0x5c);
+  case Op::vmulps:
+    return Encoding::binary(0x59, true);
+  case Op::vdivps:
+    return Encoding::binary(0x5e);
+  case Op::vminps:
+    return Encoding::binary(0x5d);
+  case Op::vmaxps:
+    return Encoding::binary(0x5f);
+  // AVX512F only has the integer versions of the bitwise ops (the ps ones are
+  // AVX512DQ), but they do the exact same thing to the bits
+  case Op::vandps:
+    return Encoding::binary(0x54, true).with_evex(Opcode_Map::Map_0F,
+                                                  Simd_Prefix::P66, 0xdb);
+  case Op::vandnps:
+    return Encoding::binary(0x55).with_evex(Opcode_Map::Map_0F,
+                                            Simd_Prefix::P66, 0xdf);
+  case Op::vorps:
+    return Encoding::binary(0x56, true).with_evex(Opcode_Map::Map_0F,
+                                                  Simd_Prefix::P66, 0xeb);
+  case Op::vxorps:
+    return Encoding::binary(0x57, true).with_evex(Opcode_Map::Map_0F,
+                                                  Simd_Prefix::P66, 0xef);
+  default:
+    return {};
+  }
+}
+
+// indexed by Op, so that assembling one of the common ops is a table lookup
+// rather than a trip through a switch and a member function
+#define ENCODING_FOR_OP(name, ...) encoding_for(Op::name),
+inline constexpr Encoding encodings[] = {FOREACH_MACHINE_OP(ENCODING_FOR_OP)};
+#undef ENCODING_FOR_OP
+
 struct Assembler {
+  // the most bytes a single Instruction can turn into. x86 instructions are at
+  // most 15 bytes, and the worst we do is two of those (the SSE versions of
+  // three operand ops copy the first source over first).
+  static constexpr size_t max_instruction_size = 2 * 15;
+
   Machine_Code &mc;
+  // what assemble() puts the code in
   std::vector<uint8_t> buffer{};
+  // where the code is going, which is either the buffer, or whatever was
+  // passed to assemble_into()
+  uint8_t *output{nullptr};
   // offsets & lengths into the buffer for instructions
   // this is mostly useful for dumping out assembled bytes
   std::vector<std::pair<size_t, size_t>> instruction_offsets_and_sizes{};
-
+  // nobody looks at those outside of dumping, so they can be turned off
+  bool record_offsets{true};
+  // label number -> offset into the output
+  std::unordered_map<uint64_t, size_t> label_offsets{};
+  // (offset of a rel32, label number it points to), patched up at the end of
+  // assemble() so we can jump forwards too
+  std::vector<std::pair<size_t, uint64_t>> label_fixups{};
+  // a rel32 pointing into the constant pool, which goes right after the code
+  // (so it's only got a place once we're done with the code). These stay
+  // around after assembling, for anything that puts the pool somewhere else
+  // (see aot.h).
+  struct Constant_Fixup {
+    // where the rel32 is
+    size_t offset;
+    // the end of the instruction it's in, which is what it's relative to
+    size_t end;
+    // what it's pointing at
+    size_t constant_offset;
+  };
+  std::vector<Constant_Fixup> constant_fixups{};
+  // where the constant pool starts in the output
+  size_t constants_offset{0};
+  // where the next byte goes, see emit_byte
+  uint8_t *cursor{nullptr};
+
+  // the most bytes the code and constant pool could possibly take up
+  size_t max_size() const;
+  // assemble into the buffer
   void assemble();
+  // assemble straight into `memory`, which needs room for max_size() bytes.
+  // Returns how many of those were used.
+  size_t assemble_into(uint8_t *memory);
   void assemble_instruction(const Instruction &instruction);
+  void resolve_label_fixups();
+  void append_constant_pool();
 
   void mark_instruction(size_t offset, size_t length) {
-    instruction_offsets_and_sizes.push_back({offset, length});
+    if (record_offsets) {
+      instruction_offsets_and_sizes.push_back({offset, length});
+    }
   }
 
-  void emit_byte(uint8_t val) { buffer.push_back(val); }
-  void emit_word(uint16_t val) {
-    emit_byte(val & 0xff);
-    emit_byte(val >> 8);
+  // the output always has room for the worst case (see max_size), so we can
+  // write straight into it without checking if there's room.
+  // Every byte we write could alias the cursor as far as the compiler knows,
+  // so it has to store it back out after each one. Emitting the wider values
+  // in one go saves a lot of that (x86 is little endian, so the bytes end up
+  // in the right order).
+  size_t offset() const { return size_t(cursor - output); }
+  void emit_byte(uint8_t val) { *cursor++ = val; }
+  void emit_word(uint16_t val) { emit_value(val); }
+  void emit_dword(uint32_t val) { emit_value(val); }
+  void emit_qword(uint64_t val) { emit_value(val); }
+  template <typename T> void emit_value(T val) {
+    memcpy(cursor, &val, sizeof(val));
+    cursor += sizeof(val);
   }
-  void emit_dword(uint32_t val) {
-    emit_word(val & 0xffff);
-    emit_word(val >> 16);
+
+  // EVEX-encoded (AVX-512) instructions. `reg` goes in ModRM.reg, `vvvv` is
+  // the extra source operand (0 if unused), and `rm` may be either a machine
+  // register or a memory reference. `disp_scale` is the N that compressed
+  // 8-bit displacements get multiplied by for this instruction's memory
+  // operand. `immediate_size` is how many bytes of immediate the caller puts
+  // after the instruction, which rip-relative operands need to know about.
+  void evex_op(Opcode_Map map, Simd_Prefix pp, uint8_t opcode, uint8_t reg,
+               uint8_t vvvv, const Register &rm, size_t disp_scale,
+               uint8_t opmask = 0, size_t immediate_size = 0);
+  // VEX-encoded instructions on ymm registers. Operands are the same as for
+  // evex_op. We use the short 2-byte prefix whenever the instruction can be
+  // encoded with it (0F map, and no high register in r/m).
+  void vex_op(Opcode_Map map, Simd_Prefix pp, uint8_t opcode, uint8_t reg,
+              uint8_t vvvv, const Register &rm, size_t immediate_size = 0);
+  // ModRM (plus SIB and displacement, if needed) for a register or memory
+  // operand. 8-bit displacements are divided by `disp_scale`, which is only
+  // ever not 1 for EVEX. Memory operands based on rip point into the constant
+  // pool.
+  void emit_modrm(uint8_t reg, const Register &rm, size_t disp_scale,
+                  size_t immediate_size = 0);
+
+  // legacy (non-VEX) SSE encoded instructions, for the SSE4.1 target. These
+  // only have two operands, so `reg` is both the destination and a source.
+  void sse_op(Simd_Prefix pp, Opcode_Map map, uint8_t opcode, uint8_t reg,
+              const Register &rm, size_t immediate_size = 0);
+  // the SSE version of our three operand ops: copy the first source into the
+  // destination, and then do the op in place with the second source.
+  void sse_binary_op(Simd_Prefix pp, Opcode_Map map, uint8_t opcode,
+                     bool commutative, const Register &r1, const Register &r2,
+                     const Register &r3, size_t immediate_size = 0);
+
+  // full-width vector ops on zmm registers, using the same opcode as the VEX
+  // version. Memory operands are always a full vector.
+  void evex_unary_op(Opcode_Map map, Simd_Prefix pp, uint8_t opcode,
+                     const Register &r1, const Register &r2) {
+    evex_op(map, pp, opcode, register_number(r1.machine_reg()), 0, r2, 64);
   }
-  void emit_qword(uint64_t val) {
-    emit_dword(val & 0xffffffff);
-    emit_dword(val >> 32);
+  void evex_binary_op(Opcode_Map map, Simd_Prefix pp, uint8_t opcode,
+                      const Register &r1, const Register &r2,
+                      const Register &r3) {
+    evex_op(map, pp, opcode, register_number(r1.machine_reg()),
+            register_number(r2.machine_reg()), r3, 64);
   }
 
-  template <uint8_t opcode>
-  void unary_op(const Register &r1, const Register &r2) {
-    emit_byte(0xc5);
-    emit_byte(0xfc);
-    emit_byte(opcode);
-
-    auto rn1 = register_number(r1.machine_reg());
-    if (r2.is_machine()) {
-      auto rn2 = register_number(r2.machine_reg());
-      emit_byte(0xc0 | (rn1 << 3) | rn2);
-    } else {
-      auto rr2 = r2.memory_ref();
-      if (rr2.machine_reg() != Machine_Register::rsp) {
-        std::cerr << "Error: cannot handle non-rsp registers in unary_op"
-                  << std::endl;
-        abort();
-      }
-
-      auto rn2 = register_number(rr2.machine_reg());
-
-      emit_byte(0x80 | (rn1 << 3) | rn2);
-      emit_byte((rn2 << 3) | rn2);
-      emit_dword(rr2.offset);
-    }
-  }
+  // everything with a table entry, see Encoding
+  void vector_op(const Encoding &encoding, const Instruction &instruction);
 
-  template <uint8_t opcode>
-  void binary_op(const Register &r1, const Register &r2, const Register &r3) {
-    auto rn1 = register_number(r1.machine_reg());
-    auto rn2 = register_number(r2.machine_reg());
-    emit_byte(0xc5);
-    emit_byte(0x80 | ((~rn2 & 0xf) << 3) | 0x4);
-    emit_byte(opcode);
-
-    if (r3.is_machine()) {
-      auto rn3 = register_number(r3.machine_reg());
-      emit_byte(0xc0 | (rn1 << 3) | rn3);
-    } else {
-      auto rr3 = r3.memory_ref();
-      if (rr3.machine_reg() != Machine_Register::rsp) {
-        std::cerr << "Error: cannot handle non-rsp registers in binary_op"
-                  << std::endl;
-        abort();
-      }
-
-      auto rn3 = register_number(rr3.machine_reg());
-
-      emit_byte(0x80 | (rn1 << 3) | rn3);
-      emit_byte((rn3 << 3) | rn3);
-      emit_dword(rr3.offset);
-    }
-  }
+  // add/sub with a sign-extended immediate, `extension` is the ModRM.reg bits
+  void gpr_imm_op(uint8_t extension, const Instruction &instruction);
+
+  // vps{ll,rl,ra}d by an immediate, `extension` is the ModRM.reg bits
+  void vector_shift_op(uint8_t extension, const Instruction &instruction);
+
+  // vfm{add,sub,nadd}231ps, see FOREACH_FMA_MACHINE_OP
+  void fma_op(uint8_t opcode, const Instruction &instruction);
 
 #define DECLARE_OP_EMITTER(name, ...) void name(const Instruction &instruction);
   FOREACH_MACHINE_OP(DECLARE_OP_EMITTER);
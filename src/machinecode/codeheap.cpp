@@ -0,0 +1,221 @@
+#include "codeheap.h"
+
+#include <algorithm>
+#include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace sdfjit::machinecode {
+
+static constexpr size_t PAGE_SIZE = 0x1000;
+
+static size_t round_up(size_t size, size_t to) {
+  return (size + to - 1) & ~(to - 1);
+}
+
+static Code_Heap::Region map_region(size_t size) {
+  // the memfd is what lets us map the same memory twice. Nothing else ever
+  // sees it, and it goes away once both mappings do.
+  Code_Heap::Region region{};
+  region.size = size;
+  region.fd = memfd_create("sdfjit-code", MFD_CLOEXEC);
+  if (region.fd < 0 || ftruncate(region.fd, off_t(size)) != 0) {
+    std::cerr << "Couldn't create memory for the code heap" << std::endl;
+    abort();
+  }
+
+  auto map = [&](int prot) -> uint8_t * {
+    auto *ptr = mmap(nullptr, size, prot, MAP_SHARED, region.fd, 0);
+    if (ptr == MAP_FAILED) {
+      std::cerr << "Couldn't map the code heap" << std::endl;
+      abort();
+    }
+    return static_cast<uint8_t *>(ptr);
+  };
+  region.writable = map(PROT_READ | PROT_WRITE);
+  region.executable = map(PROT_READ | PROT_EXEC);
+
+  region.free_ranges[0] = size;
+  return region;
+}
+
+static void unmap_region(Code_Heap::Region &region) {
+  munmap(region.writable, region.size);
+  munmap(region.executable, region.size);
+  close(region.fd);
+}
+
+// next fit: take the first free range at or after next_fit that's big enough,
+// wrapping around to the start if there isn't one
+static bool allocate_from(Code_Heap::Region &region, size_t size,
+                          size_t &offset) {
+  auto &ranges = region.free_ranges;
+  auto take = [&](std::map<size_t, size_t>::iterator range, size_t start) {
+    auto range_start = range->first;
+    auto range_end = range->first + range->second;
+    ranges.erase(range);
+    if (start > range_start) {
+      ranges[range_start] = start - range_start;
+    }
+    if (start + size < range_end) {
+      ranges[start + size] = range_end - (start + size);
+    }
+    region.next_fit = start + size;
+    offset = start;
+    return true;
+  };
+
+  // if next_fit is in the middle of a free range, we can use the rest of it
+  auto first = ranges.upper_bound(region.next_fit);
+  if (first != ranges.begin()) {
+    auto containing = std::prev(first);
+    auto end = containing->first + containing->second;
+    if (region.next_fit < end && end - region.next_fit >= size) {
+      return take(containing, region.next_fit);
+    }
+  }
+
+  for (auto it = first; it != ranges.end(); it++) {
+    if (it->second >= size) {
+      return take(it, it->first);
+    }
+  }
+  for (auto it = ranges.begin(); it != first; it++) {
+    if (it->second >= size) {
+      return take(it, it->first);
+    }
+  }
+  return false;
+}
+
+Code_Heap &Code_Heap::global() {
+  // never destroyed, so that kernels that are still around at exit (in
+  // statics, say) don't free into a heap that's already gone
+  static Code_Heap *heap = new Code_Heap{};
+  return *heap;
+}
+
+Code_Block Code_Heap::allocate(size_t size) {
+  size = round_up(std::max(size, size_t(1)), alignment);
+
+  std::lock_guard<std::mutex> guard{lock};
+  size_t offset;
+  for (auto &region : regions) {
+    if (allocate_from(region, size, offset)) {
+      return Code_Block{region.writable + offset, region.executable + offset,
+                        size};
+    }
+  }
+
+  // kernels bigger than a region get one to themselves
+  regions.push_back(
+      map_region(round_up(std::max(size, region_size), PAGE_SIZE)));
+  auto &region = regions.back();
+  allocate_from(region, size, offset);
+  return Code_Block{region.writable + offset, region.executable + offset,
+                    size};
+}
+
+// put a range back, and merge it with its neighbours
+static void free_range(Code_Heap::Region &region, size_t offset, size_t size) {
+  auto next = region.free_ranges.lower_bound(offset);
+  if (next != region.free_ranges.end() && offset + size == next->first) {
+    size += next->second;
+    next = region.free_ranges.erase(next);
+  }
+  if (next != region.free_ranges.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      region.free_ranges.erase(prev);
+    }
+  }
+  region.free_ranges[offset] = size;
+}
+
+size_t Code_Heap::region_index(const Code_Block &block) {
+  for (size_t i = 0; i < regions.size(); i++) {
+    if (regions[i].contains(block.executable)) {
+      return i;
+    }
+  }
+
+  std::cerr << "Code isn't in the code heap" << std::endl;
+  abort();
+}
+
+void Code_Heap::free(const Code_Block &block) {
+  std::lock_guard<std::mutex> guard{lock};
+  auto i = region_index(block);
+  auto &region = regions[i];
+  free_range(region, size_t(block.executable - region.executable), block.size);
+
+  // hang on to one region so that the next kernel doesn't need a syscall,
+  // but give back any others once they're empty
+  if (region.is_empty() && regions.size() > 1) {
+    unmap_region(region);
+    regions.erase(regions.begin() + i);
+  }
+}
+
+void Code_Heap::shrink(Code_Block &block, size_t size) {
+  size = round_up(std::max(size, size_t(1)), alignment);
+  if (size >= block.size) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard{lock};
+  auto &region = regions[region_index(block)];
+  auto offset = size_t(block.executable - region.executable);
+  free_range(region, offset + size, block.size - size);
+  // nothing has run from the end yet, so it's fine to hand it right back out
+  if (region.next_fit == offset + block.size) {
+    region.next_fit = offset + size;
+  }
+  block.size = size;
+}
+
+size_t Code_Heap::mapped_bytes() {
+  std::lock_guard<std::mutex> guard{lock};
+  size_t total = 0;
+  for (const auto &region : regions) {
+    total += region.size;
+  }
+  return total;
+}
+
+size_t Code_Heap::used_bytes() {
+  std::lock_guard<std::mutex> guard{lock};
+  size_t total = 0;
+  for (const auto &region : regions) {
+    total += region.size;
+    for (const auto &[offset, size] : region.free_ranges) {
+      (void)offset;
+      total -= size;
+    }
+  }
+  return total;
+}
+
+Code_Block &Code_Block::operator=(Code_Block &&other) noexcept {
+  if (this != &other) {
+    release();
+    writable = other.writable;
+    executable = other.executable;
+    size = other.size;
+    other.writable = other.executable = nullptr;
+    other.size = 0;
+  }
+  return *this;
+}
+
+void Code_Block::release() {
+  if (executable) {
+    Code_Heap::global().free(*this);
+    writable = executable = nullptr;
+    size = 0;
+  }
+}
+
+} // namespace sdfjit::machinecode
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace sdfjit::machinecode {
+
+// a piece of the code heap, which goes back to the heap when this goes away.
+// The same memory is mapped twice: once writable (for copying the kernel in),
+// and once executable (for running it), so nothing is ever both.
+struct Code_Block {
+  uint8_t *writable{nullptr};
+  uint8_t *executable{nullptr};
+  size_t size{0};
+
+  Code_Block() = default;
+  Code_Block(uint8_t *writable_view, uint8_t *executable_view, size_t length)
+      : writable(writable_view), executable(executable_view), size(length) {}
+  Code_Block(const Code_Block &) = delete;
+  Code_Block &operator=(const Code_Block &) = delete;
+  Code_Block(Code_Block &&other) noexcept { *this = std::move(other); }
+  Code_Block &operator=(Code_Block &&other) noexcept;
+  ~Code_Block() { release(); }
+
+  void release();
+};
+
+// all of the kernels live in here, packed into a few big regions, so that
+// making one is a memcpy instead of a handful of syscalls, and throwing one
+// away actually gives the memory back to be reused.
+struct Code_Heap {
+  // everything is aligned to this, since the constant pool at the end of a
+  // kernel wants to be aligned for a zmm
+  static constexpr size_t alignment = 64;
+  static constexpr size_t region_size = 16 * 1024 * 1024;
+
+  struct Region {
+    int fd{-1};
+    uint8_t *writable{nullptr};
+    uint8_t *executable{nullptr};
+    size_t size{0};
+    // offset -> size, for every free range. Neighbouring ranges always get
+    // merged, so a completely free region has exactly one of these.
+    std::map<size_t, size_t> free_ranges{};
+    // where the last allocation ended. We start looking for space from here
+    // rather than from the start, so a freed kernel's address doesn't get
+    // handed out again until we've gone all the way around the region. That
+    // keeps perf maps (which only know about addresses) mostly unambiguous.
+    size_t next_fit{0};
+
+    bool contains(const uint8_t *executable_address) const {
+      return executable <= executable_address &&
+             executable_address < executable + size;
+    }
+    bool is_empty() const {
+      return free_ranges.size() == 1 && free_ranges.begin()->second == size;
+    }
+  };
+
+  std::mutex lock{};
+  std::vector<Region> regions{};
+
+  static Code_Heap &global();
+
+  Code_Block allocate(size_t size);
+  void free(const Code_Block &block);
+  // give the end of a block back, for when we had to allocate for the worst
+  // case before we knew how much we'd need
+  void shrink(Code_Block &block, size_t size);
+
+  // which region a block is in, the lock needs to be held
+  size_t region_index(const Code_Block &block);
+
+  // how much of the heap is mapped, and how much of that is in use
+  size_t mapped_bytes();
+  size_t used_bytes();
+};
+
+} // namespace sdfjit::machinecode
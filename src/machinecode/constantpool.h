@@ -15,6 +15,8 @@ struct Constant_Pool {
 
   // caches:
   std::unordered_map<uint32_t, size_t> dword_cache{};
+  // (vector size << 32 | dword) -> offset
+  std::unordered_map<uint64_t, size_t> vector_cache{};
 
   // note that these are both unstable after a modifying operation
   uint8_t *data() { return memory.data(); }
@@ -50,6 +52,31 @@ struct Constant_Pool {
     }
     return offset;
   }
+
+  // dword repeated across a whole vector, for instructions that read a full
+  // vector operand straight out of the pool. These are aligned, since the SSE
+  // versions of most instructions insist on that for memory operands.
+  size_t add_vector(uint32_t dword, size_t vector_size) {
+    auto key = uint64_t(vector_size) << 32 | dword;
+    auto cached = vector_cache.find(key);
+    if (cached != vector_cache.end()) {
+      return cached->second;
+    }
+
+    while (memory.size() % vector_size != 0) {
+      memory.push_back(pad_value);
+    }
+    auto offset = size();
+    vector_cache[key] = offset;
+    // the first lane works just as well for broadcasts
+    dword_cache.insert({dword, offset});
+    for (size_t lane = 0; lane < vector_size / sizeof(uint32_t); lane++) {
+      for (size_t i = 0; i < sizeof(uint32_t); i++) {
+        add(uint8_t((dword >> (8 * i)) & 0xff));
+      }
+    }
+    return offset;
+  }
 };
 
 std::ostream &operator<<(std::ostream &os, Constant_Pool &pool);
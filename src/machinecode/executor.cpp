@@ -1,7 +1,6 @@
 #include "executor.h"
 
 #include <cstring>
-#include <sys/mman.h>
 
 #include "assembler.h"
 #include "machinecode.h"
@@ -9,41 +8,35 @@
 namespace sdfjit::machinecode {
 
 void Executor::create() {
-  static constexpr size_t PAGE_SIZE = 0x1000;
-
-  auto round_to_next_page_size = [](size_t size) -> size_t {
-    return (size & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
-  };
-  auto create_region = [&round_to_next_page_size](size_t size) -> void * {
-    // regions are initially RW, and we'll remap them to RX once we're done
-    // filling them
-    return mmap(NULL, round_to_next_page_size(size), PROT_READ | PROT_WRITE,
-                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-  };
-  auto finalize_region = [&round_to_next_page_size](void *region, size_t size,
-                                                    int prot) {
-    mprotect(region, round_to_next_page_size(size), prot);
-  };
-
+  // assemble straight into the heap's writable view of the kernel, so there's
+  // nothing to copy. We don't know how big it's going to be until it's done,
+  // so take enough for the worst case and give back what we didn't use.
   Assembler assembler{mc};
-  assembler.assemble();
-
-  code_length = assembler.buffer.size();
-  code = create_region(code_length);
-  memcpy(code, assembler.buffer.data(), code_length);
-  finalize_region(code, code_length, PROT_READ | PROT_EXEC);
+  assembler.record_offsets = false;
+  code_block = Code_Heap::global().allocate(assembler.max_size());
+  code_length = assembler.assemble_into(code_block.writable);
+  Code_Heap::global().shrink(code_block, code_length);
+  code = code_block.executable;
+}
 
-  constants_length = mc.constants.size();
-  constants = create_region(constants_length);
-  memcpy(constants, mc.constants.data(), constants_length);
-  finalize_region(constants, constants_length, PROT_READ);
+void Executor::create(const uint8_t *assembled, size_t length) {
+  code_length = length;
+  code_block = Code_Heap::global().allocate(code_length);
+  memcpy(code_block.writable, assembled, code_length);
+  code = code_block.executable;
 }
 
 void Executor::call(void *xs, void *ys, void *zs, void *distances,
-                    void *materials) const {
+                    void *materials, size_t count,
+                    const float *uniforms) const {
+  // the kernel always does at least one vector before checking the count
+  if (count == 0) {
+    return;
+  }
+
   Executor::Function_Type *func =
       reinterpret_cast<Executor::Function_Type *>(code);
-  func(xs, ys, zs, constants, distances, materials);
+  func(xs, ys, zs, uniforms, distances, materials, count);
 }
 
 } // namespace sdfjit::machinecode
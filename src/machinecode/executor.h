@@ -1,8 +1,8 @@
 #pragma once
 
 #include <cstddef>
-#include <sys/mman.h>
 
+#include "machinecode/codeheap.h"
 #include "machinecode/machinecode.h"
 
 namespace sdfjit::machinecode {
@@ -10,41 +10,62 @@ namespace sdfjit::machinecode {
 struct Machine_Code;
 struct Executor {
   Machine_Code mc;
+  // where the kernel (followed by its constant pool) lives in the code heap.
+  // Giving this back is all there is to throwing the kernel away.
+  Code_Block code_block{};
+  // the kernel, followed by its constant pool
   void *code{nullptr};
   size_t code_length{0};
-  void *constants{nullptr};
-  size_t constants_length{0};
-
-  using Function_Type = void(void *xs, void *ys, void *zs, void *constants,
-                             void *distances, void *materials);
-
-  ~Executor() {
-    const auto unmap = [](void *ptr, size_t length) {
-    // in release builds we just unmap.
-    // However, it it useful to not have allocations ever be reused, so we can
-    // always differentiate which jit page we're talking about, for example when
-    // profiling. When this is the case we just mprotect them to nothing and
-    // MADV_DONTNEED them. This still takes up a page table entry, but that's
-    // fine.
-#ifdef RELEASE
-      munmap(ptr, length);
-#else
-      mprotect(ptr, length, 0);
-      madvise(ptr, length, MADV_DONTNEED);
-#endif
-    };
-
-    if (code) {
-      unmap(code, code_length);
-    }
-    if (constants) {
-      unmap(constants, constants_length);
-    }
-  }
 
+  // `uniforms` is an array of floats, indexed by ast::Node::uniform_index,
+  // which every lane reads the same values from. It's only read if the scene
+  // has uniforms.
+  using Function_Type = void(void *xs, void *ys, void *zs,
+                             const void *uniforms, void *distances,
+                             void *materials, size_t count);
+
+  // how many floats the kernel handles at a time. Calls need a multiple of
+  // this.
+  size_t lanes() const { return mc.target.batch_size(); }
+
+  // assemble mc into the code heap
   void create();
-  void call(void *xs, void *ys, void *zs, void *distances,
-            void *materials) const;
+  // use a kernel that's already been assembled (constant pool and all)
+  // instead, mc only needs its target filled in for this
+  void create(const uint8_t *assembled, size_t length);
+  // evaluate `count` points, count must be a multiple of lanes(). xs, ys and
+  // zs are only ever read.
+  void call(void *xs, void *ys, void *zs, void *distances, void *materials,
+            size_t count) const {
+    call(xs, ys, zs, distances, materials, count, nullptr);
+  }
+  // the same, for scenes with uniforms
+  void call(void *xs, void *ys, void *zs, void *distances, void *materials,
+            size_t count, const float *uniforms) const;
+
+  // for kernels made from bytecode::differentiate (Outputs::Normal): fills in
+  // distances, and the unit length surface normal at each of the `count`
+  // points. `normals` takes the materials argument's place, and holds 3 *
+  // count floats: all of the normals' x components, then all of the y's, then
+  // all of the z's. The inputs are left alone, like for every other kernel.
+  void call_normals(void *xs, void *ys, void *zs, void *distances,
+                    void *normals, size_t count, const float *uniforms) const {
+    call(xs, ys, zs, distances, normals, count, uniforms);
+  }
+
+  // for kernels made from bytecode::to_intervals (Outputs::Distance_Interval):
+  // works out the range of distances over `count` boxes, where box i covers
+  // [x_lo, x_hi] x [y_lo, y_hi] x [z_lo, z_hi]. count must be a multiple of
+  // lanes().
+  //
+  // Each of the buffers holds intervals in blocks of lanes(): the lower bounds
+  // of lanes() boxes, then their upper bounds, and then the next block. So the
+  // lower x of box i is xs[i / lanes() * 2 * lanes() + i % lanes()], and its
+  // upper x is lanes() floats after that. The distances come out the same way.
+  void call_intervals(void *xs, void *ys, void *zs, void *distances,
+                      size_t count, const float *uniforms) const {
+    call(xs, ys, zs, distances, nullptr, count, uniforms);
+  }
 };
 
 } // namespace sdfjit::machinecode
@@ -0,0 +1,42 @@
+#include "executorcache.h"
+
+namespace sdfjit::machinecode {
+
+Executor_Cache &Executor_Cache::global() {
+  static Executor_Cache cache{};
+  return cache;
+}
+
+std::shared_ptr<const Executor> Executor_Cache::find(const Key &key) {
+  std::lock_guard<std::mutex> guard{lock};
+  auto found = index.find(key);
+  if (found == index.end()) {
+    misses++;
+    return nullptr;
+  }
+
+  hits++;
+  entries.splice(entries.begin(), entries, found->second);
+  return found->second->second;
+}
+
+void Executor_Cache::insert(const Key &key,
+                            std::shared_ptr<const Executor> exec) {
+  std::lock_guard<std::mutex> guard{lock};
+  auto found = index.find(key);
+  if (found != index.end()) {
+    // somebody else compiled it at the same time, theirs is just as good
+    found->second->second = std::move(exec);
+    entries.splice(entries.begin(), entries, found->second);
+    return;
+  }
+
+  entries.emplace_front(key, std::move(exec));
+  index[key] = entries.begin();
+  while (entries.size() > capacity) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+  }
+}
+
+} // namespace sdfjit::machinecode
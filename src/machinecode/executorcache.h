@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "machinecode/executor.h"
+
+namespace sdfjit::machinecode {
+
+// the kernels we've made recently, so that compiling a scene we've already
+// seen (a static scene, or an animation that loops) just hands back the same
+// kernel. Keyed the same way as the Kernel_Cache, and once it's full the one
+// that was used longest ago gets dropped (it lives on for as long as
+// something is still using it).
+struct Executor_Cache {
+  using Key = std::vector<uint8_t>;
+
+  size_t capacity{64};
+  size_t hits{0};
+  size_t misses{0};
+
+  std::mutex lock{};
+  // most recently used first
+  std::list<std::pair<Key, std::shared_ptr<const Executor>>> entries{};
+  std::map<Key, decltype(entries)::iterator> index{};
+
+  static Executor_Cache &global();
+
+  // the kernel for `key`, or nullptr (which counts as a miss) if we don't
+  // have it
+  std::shared_ptr<const Executor> find(const Key &key);
+  void insert(const Key &key, std::shared_ptr<const Executor> exec);
+};
+
+} // namespace sdfjit::machinecode
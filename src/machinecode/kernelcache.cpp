@@ -0,0 +1,218 @@
+#include "kernelcache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <elf.h>
+#include <link.h>
+#endif
+
+namespace sdfjit::machinecode {
+
+// at the start of every cache file, followed by the key size and code size
+static constexpr uint64_t file_magic = 0x6c6e726b6a666473; // "sdfjkrnl"
+
+template <typename T>
+static void append_value(std::vector<uint8_t> &out, const T &val) {
+  uint8_t bytes[sizeof(T)];
+  memcpy(bytes, &val, sizeof(T));
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+// the GNU build id of whatever this got linked into (a hash the linker takes
+// of the whole thing), so any change to the compiler changes every key. Empty
+// if there isn't one.
+static const std::vector<uint8_t> &build_id() {
+  static const std::vector<uint8_t> id = [] {
+    struct Search {
+      uintptr_t address;
+      std::vector<uint8_t> id;
+    } found{reinterpret_cast<uintptr_t>(&build_id), {}};
+
+#ifdef __linux__
+    dl_iterate_phdr(
+        [](dl_phdr_info *info, size_t, void *data) {
+          auto &search = *static_cast<Search *>(data);
+          auto contains_us = false;
+          for (size_t i = 0; i < info->dlpi_phnum; i++) {
+            const auto &phdr = info->dlpi_phdr[i];
+            auto start = info->dlpi_addr + phdr.p_vaddr;
+            if (phdr.p_type == PT_LOAD && search.address >= start &&
+                search.address < start + phdr.p_memsz) {
+              contains_us = true;
+            }
+          }
+          if (!contains_us) {
+            return 0;
+          }
+
+          for (size_t i = 0; i < info->dlpi_phnum; i++) {
+            const auto &phdr = info->dlpi_phdr[i];
+            if (phdr.p_type != PT_NOTE) {
+              continue;
+            }
+            // each note is a header, then its name and its contents, both
+            // padded out to 4 bytes
+            auto *note = reinterpret_cast<const uint8_t *>(info->dlpi_addr +
+                                                           phdr.p_vaddr);
+            auto *end = note + phdr.p_memsz;
+            while (note + sizeof(ElfW(Nhdr)) <= end) {
+              ElfW(Nhdr) header;
+              memcpy(&header, note, sizeof(header));
+              auto *name = note + sizeof(header);
+              auto *desc = name + ((header.n_namesz + 3) & ~3u);
+              if (header.n_type == NT_GNU_BUILD_ID && header.n_namesz == 4 &&
+                  memcmp(name, "GNU", 4) == 0) {
+                search.id.assign(desc, desc + header.n_descsz);
+                return 1;
+              }
+              note = desc + ((header.n_descsz + 3) & ~3u);
+            }
+          }
+          return 1;
+        },
+        &found);
+#endif
+
+    return found.id;
+  }();
+  return id;
+}
+
+Kernel_Cache &Kernel_Cache::global() {
+  static Kernel_Cache cache = [] {
+    Kernel_Cache result{};
+    if (const char *directory = getenv("SDFJIT_KERNEL_CACHE")) {
+      if (build_id().empty()) {
+        std::cerr << "Not caching kernels: without a build id, kernels from "
+                     "different builds can't be told apart"
+                  << std::endl;
+        return result;
+      }
+      result.directory = directory;
+      mkdir(directory, 0777);
+    }
+    return result;
+  }();
+  return cache;
+}
+
+std::vector<uint8_t> Kernel_Cache::key_for(const ast::Ast &ast,
+                                           bytecode::Outputs outputs,
+                                           const Target &target) {
+  std::vector<uint8_t> key{};
+  append_value(key, uint32_t(build_id().size()));
+  key.insert(key.end(), build_id().begin(), build_id().end());
+
+  append_value(key, uint32_t(target.isa));
+  append_value(key, uint32_t(target.interleave));
+  append_value(key, uint32_t(target.precision));
+  append_value(key, uint8_t(target.fast_math));
+
+  append_value(key, uint8_t(outputs));
+
+  // only the fields that mean something for each op go in, so two nodes that
+  // are the same always flatten out the same
+  append_value(key, uint32_t(ast.nodes.size()));
+  for (const auto &node : ast.nodes) {
+    append_value(key, uint8_t(node.op));
+    append_value(key, uint32_t(node.children.size()));
+    for (auto child : node.children) {
+      append_value(key, child);
+    }
+    if (node.op == ast::Op::Float32) {
+      append_value(key, node.value);
+    } else if (node.op == ast::Op::Uniform) {
+      append_value(key, uint32_t(node.uniform_index));
+    }
+  }
+
+  return key;
+}
+
+std::string Kernel_Cache::path_for(const std::vector<uint8_t> &key) const {
+  // 64 bit FNV-1a
+  uint64_t hash = 0xcbf29ce484222325;
+  for (auto byte : key) {
+    hash ^= byte;
+    hash *= 0x100000001b3;
+  }
+
+  std::ostringstream path{};
+  path << directory << '/' << std::hex << std::setw(16) << std::setfill('0')
+       << hash << ".kernel";
+  return path.str();
+}
+
+bool Kernel_Cache::load(const std::vector<uint8_t> &key, Executor &exec) const {
+  if (!enabled()) {
+    return false;
+  }
+
+  std::ifstream in(path_for(key), std::ios_base::in | std::ios_base::binary);
+  if (!in) {
+    return false;
+  }
+
+  uint64_t header[3];
+  if (!in.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+      header[0] != file_magic || header[1] != key.size()) {
+    return false;
+  }
+
+  std::vector<uint8_t> stored_key(key.size());
+  if (!in.read(reinterpret_cast<char *>(stored_key.data()),
+               std::streamsize(stored_key.size())) ||
+      stored_key != key) {
+    return false;
+  }
+
+  std::vector<uint8_t> code(header[2]);
+  if (!in.read(reinterpret_cast<char *>(code.data()),
+               std::streamsize(code.size()))) {
+    return false;
+  }
+
+  exec.create(code.data(), code.size());
+  return true;
+}
+
+void Kernel_Cache::store(const std::vector<uint8_t> &key,
+                         const Executor &exec) const {
+  if (!enabled()) {
+    return;
+  }
+
+  // other processes might be loading (or storing) the same kernel, so write it
+  // somewhere else first and then move it into place all at once
+  auto path = path_for(key);
+  auto temporary_path = path + ".tmp" + std::to_string(getpid());
+  {
+    std::ofstream out(temporary_path,
+                      std::ios_base::out | std::ios_base::binary);
+    uint64_t header[3] = {file_magic, key.size(), exec.code_length};
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(key.data()),
+              std::streamsize(key.size()));
+    out.write(static_cast<const char *>(exec.code),
+              std::streamsize(exec.code_length));
+    if (!out) {
+      std::cerr << "Couldn't write " << temporary_path
+                << " for the kernel cache" << std::endl;
+      out.close();
+      unlink(temporary_path.c_str());
+      return;
+    }
+  }
+
+  std::rename(temporary_path.c_str(), path.c_str());
+}
+
+} // namespace sdfjit::machinecode
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ast/ast.h"
+#include "bytecode/bytecode.h"
+#include "machinecode/executor.h"
+#include "machinecode/target.h"
+
+namespace sdfjit::machinecode {
+
+// assembled kernels (the code and its constant pool), kept on disk so that the
+// next process to compile the same bytecode for the same target can load it
+// instead. It's off unless SDFJIT_KERNEL_CACHE is set to a directory to keep
+// them in (and the binary has a build id, see key_for).
+struct Kernel_Cache {
+  std::string directory{};
+
+  static Kernel_Cache &global();
+
+  bool enabled() const { return !directory.empty(); }
+
+  // everything that decides what the kernel looks like, flattened out: the
+  // build of the compiler that made it (so nobody loads kernels an older
+  // compiler made), the target, and the scene. That's the scene as an ast
+  // rather than as bytecode, so a hit skips turning it into bytecode and
+  // optimizing that too, which is most of the compile. Files are named after a
+  // hash of this, and keep the whole thing around so a collision can't load
+  // the wrong kernel.
+  static std::vector<uint8_t> key_for(const ast::Ast &ast,
+                                      bytecode::Outputs outputs,
+                                      const Target &target);
+
+  // create()s `exec` from the cached kernel for `key`, if there is one
+  bool load(const std::vector<uint8_t> &key, Executor &exec) const;
+  // save the kernel `exec` was created with under `key`
+  void store(const std::vector<uint8_t> &key, const Executor &exec) const;
+
+  std::string path_for(const std::vector<uint8_t> &key) const;
+};
+
+} // namespace sdfjit::machinecode
@@ -9,15 +9,6 @@
 
 namespace sdfjit::machinecode {
 
-uint64_t register_number(Machine_Register reg) {
-#define MACHINE_REGISTER_NUMBER(register_name, register_number)                \
-  case Machine_Register::register_name:                                        \
-    return register_number;
-
-  switch (reg) { FOREACH_MACHINE_REGISTER(MACHINE_REGISTER_NUMBER); }
-  abort();
-}
-
 std::vector<Register> Instruction::set_registers() const {
 #define GET_SET_REGISTER_IDXES(op_name, num_args, set_reg_idxes, ...)          \
   case Op::op_name: {                                                          \
@@ -91,18 +82,62 @@ bool Instruction::can_use_memory_ref() const {
 #undef USES_MEMORY
 }
 
-Machine_Code Machine_Code::from_bytecode(const sdfjit::bytecode::Bytecode &bc) {
+bool Instruction::is_fma() const {
+#define IS_FMA(op_name, ...)                                                   \
+  case Op::op_name:                                                            \
+    return true;
+
+  switch (op) {
+    FOREACH_FMA_MACHINE_OP(IS_FMA);
+  default:
+    return false;
+  }
+#undef IS_FMA
+}
+
+Machine_Code Machine_Code::from_bytecode(const sdfjit::bytecode::Bytecode &bc,
+                                         const Target &target) {
   Machine_Code mc{};
+  mc.target = target;
 
   // mapping of bytecode nodes to the machine-code register that
   // contains it's results
   // XXX: maybe this is a bit inflexible? maybe we want a list of result
   // locations, or even just a list of result registers in some agreed-upon
   // order. For now we're doing single-out instructions so this is fine.
-  std::unordered_map<sdfjit::bytecode::Node_Id, Register> bc_to_reg{};
-
-  for (size_t id = 0; id < bc.nodes.size(); id++) {
+  using Node_Registers =
+      std::unordered_map<sdfjit::bytecode::Node_Id, Register>;
+  std::vector<Node_Registers> batch_regs(target.interleave);
+  // the other result of each SinCos, for the Extract that wants it
+  std::vector<Node_Registers> batch_extra_regs(target.interleave);
+
+  // interval kernels' buffers have the lower bounds for a whole trip around
+  // the loop, and then the upper bounds (see Executor::call_intervals)
+  bool intervals = std::any_of(
+      bc.nodes.begin(), bc.nodes.end(),
+      [](const sdfjit::bytecode::Node &node) {
+        return node.op == sdfjit::bytecode::Op::Load_Upper ||
+               node.op == sdfjit::bytecode::Op::Store_Interval;
+      });
+  auto upper_offset = target.batch_size() * sizeof(float);
+  // normal kernels write the normal out to three planes of the normals buffer
+  // (the materials argument, see Executor::call_normals). The x plane is
+  // where the materials pointer points, and the other two are `count` floats
+  // apart, so they each get a pointer of their own.
+  bool normals = std::any_of(bc.nodes.begin(), bc.nodes.end(),
+                             [](const sdfjit::bytecode::Node &node) {
+                               return node.op ==
+                                      sdfjit::bytecode::Op::Store_Normal;
+                             });
+  const auto normals_x = get_argument_register(5).memory_ref().machine_reg();
+  const auto normals_y = Machine_Register::r10;
+  const auto normals_z = Machine_Register::r11;
+
+  auto lower_node = [&](size_t id, size_t batch, Node_Registers &bc_to_reg,
+                        Node_Registers &extra_regs) {
     const auto &node = bc.nodes[id];
+    // where this batch's vector is in each of the buffers
+    auto batch_offset = batch * target.vector_size();
 
     switch (node.op) {
     case sdfjit::bytecode::Op::Nop: {
@@ -110,23 +145,83 @@ Machine_Code Machine_Code::from_bytecode(const sdfjit::bytecode::Bytecode &bc) {
     }
 
     case sdfjit::bytecode::Op::Load_Arg: {
-      auto result = mc.vmovaps(get_argument_register(node.arg_index));
+      if (node.arg_index == uniforms_arg_index) {
+        // this one is just a pointer, which Load_Uniform reads through
+        bc_to_reg[id] = get_argument_register(node.arg_index);
+        break;
+      }
+      auto arg = get_argument_register(node.arg_index);
+      arg.memory_ref().offset += batch_offset;
+      auto result = mc.vmovaps(arg);
       bc_to_reg[id] = result;
       break;
     }
 
+    case sdfjit::bytecode::Op::Load_Upper: {
+      auto arg = get_argument_register(node.arg_index);
+      arg.memory_ref().offset += upper_offset + batch_offset;
+      bc_to_reg[id] = mc.vmovaps(arg);
+      break;
+    }
+
+    case sdfjit::bytecode::Op::Load_Uniform: {
+      // (this only happens before the loop, see below)
+      auto uniform = bc_to_reg.at(node.arguments.at(0));
+      uniform.memory_ref().offset += node.arg_index * sizeof(float);
+      bc_to_reg[id] = mc.vbroadcastss(uniform);
+      break;
+    }
+
     case sdfjit::bytecode::Op::Store_Result: {
       // XXX: this is written super poorly. Need to clean it up
       auto distance = Register::Memory(
-          get_argument_register(4).memory_ref().machine_reg(), 0);
+          get_argument_register(4).memory_ref().machine_reg(), batch_offset);
       auto material = Register::Memory(
-          get_argument_register(5).memory_ref().machine_reg(), 0);
+          get_argument_register(5).memory_ref().machine_reg(), batch_offset);
       mc.vmovaps(distance, bc_to_reg.at(node.arguments.at(0)));
       mc.vmovaps(material, bc_to_reg.at(node.arguments.at(1)));
       break;
     }
 
+    case sdfjit::bytecode::Op::Store_Distance: {
+      auto distance = Register::Memory(
+          get_argument_register(4).memory_ref().machine_reg(), batch_offset);
+      mc.vmovaps(distance, bc_to_reg.at(node.arguments.at(0)));
+      break;
+    }
+
+    case sdfjit::bytecode::Op::Store_Material: {
+      auto material = Register::Memory(
+          get_argument_register(5).memory_ref().machine_reg(), batch_offset);
+      mc.vmovaps(material, bc_to_reg.at(node.arguments.at(0)));
+      break;
+    }
+
+    case sdfjit::bytecode::Op::Store_Normal: {
+      auto distances = get_argument_register(4).memory_ref().machine_reg();
+      Machine_Register outputs[] = {distances, normals_x, normals_y, normals_z};
+      for (size_t i = 0; i < 4; i++) {
+        mc.vmovaps(Register::Memory(outputs[i], batch_offset),
+                   bc_to_reg.at(node.arguments.at(i)));
+      }
+      break;
+    }
+
+    case sdfjit::bytecode::Op::Store_Interval: {
+      auto distances = get_argument_register(4).memory_ref().machine_reg();
+      mc.vmovaps(Register::Memory(distances, batch_offset),
+                 bc_to_reg.at(node.arguments.at(0)));
+      mc.vmovaps(Register::Memory(distances, upper_offset + batch_offset),
+                 bc_to_reg.at(node.arguments.at(1)));
+      break;
+    }
+
     case sdfjit::bytecode::Op::Assign_Float: {
+      if (batch > 0) {
+        // constants are the same for everyone
+        bc_to_reg[id] = batch_regs[0].at(id);
+        break;
+      }
       auto result = mc.vbroadcastss(Register::Imm(node.value));
       bc_to_reg[id] = result;
       break;
@@ -159,7 +254,16 @@ Machine_Code Machine_Code::from_bytecode(const sdfjit::bytecode::Bytecode &bc) {
     case sdfjit::bytecode::Op::Divide: {
       auto lhs = bc_to_reg.at(node.arguments.at(0));
       auto rhs = bc_to_reg.at(node.arguments.at(1));
-      auto result = mc.vdivps(lhs, rhs);
+      Register result;
+      const auto &divisor = bc.nodes[node.arguments.at(1)];
+      if (mc.target.fast_math &&
+          divisor.op == sdfjit::bytecode::Op::Assign_Float) {
+        // dividing by a constant, so we can get the reciprocal for free
+        result = mc.vmulps(
+            lhs, mc.vbroadcastss(Register::Imm(1.0f / divisor.value)));
+      } else {
+        result = mc.vdivps(lhs, rhs);
+      }
       bc_to_reg[id] = result;
       break;
     }
@@ -174,10 +278,12 @@ Machine_Code Machine_Code::from_bytecode(const sdfjit::bytecode::Bytecode &bc) {
     case sdfjit::bytecode::Op::Abs: {
       // there's a good breakdown of options in an answer here:
       // https://stackoverflow.com/questions/32408665/fastest-way-to-compute-absolute-value-using-sse
-      // We choose option 4, which is to shift left by one and then right by
-      // one. We might want to revisit this, but it seemed like a decent option
-      // given that our register allocator will probably not be extremely good,
-      // and this doesn't use an additional register.
+      // We choose option 4, which is to shift left by one and then right
+      // by one. We might want to revisit this, but it seemed like a decent
+      // option given that our register allocator will probably not be
+      // extremely good, and this doesn't use an additional register.
+      // (passes/isel.cpp turns this into an and with a constant mask later,
+      // which usually gets folded into a memory operand)
       auto src = bc_to_reg.at(node.arguments.at(0));
       auto result =
           mc.vpsrld(mc.vpslld(src, Register::Imm(1u)), Register::Imm(1u));
@@ -187,8 +293,8 @@ Machine_Code Machine_Code::from_bytecode(const sdfjit::bytecode::Bytecode &bc) {
 
     case sdfjit::bytecode::Op::Negate: {
       auto val = bc_to_reg.at(node.arguments.at(0));
-      auto result =
-          mc.vxorps(mc.vbroadcastss(Register::Imm(uint32_t(0x80000000))), val);
+      auto result = mc.vxorps(
+          mc.vbroadcastss(Register::Imm(uint32_t(0x80000000))), val);
       bc_to_reg[id] = result;
       break;
     }
@@ -223,6 +329,20 @@ Machine_Code Machine_Code::from_bytecode(const sdfjit::bytecode::Bytecode &bc) {
       break;
     }
 
+    case sdfjit::bytecode::Op::SinCos: {
+      auto x = bc_to_reg.at(node.arguments.at(0));
+      auto sin_cos = mc.sin_quadrants(x, {0, 1});
+      auto other_result = 1 - node.result_index;
+      bc_to_reg[id] = sin_cos.at(node.result_index);
+      extra_regs[id] = sin_cos.at(other_result);
+      break;
+    }
+
+    case sdfjit::bytecode::Op::Extract: {
+      bc_to_reg[id] = extra_regs.at(node.arguments.at(0));
+      break;
+    }
+
     case sdfjit::bytecode::Op::Mod: {
       auto x = bc_to_reg.at(node.arguments.at(0));
       auto m = bc_to_reg.at(node.arguments.at(1));
@@ -238,17 +358,112 @@ Machine_Code Machine_Code::from_bytecode(const sdfjit::bytecode::Bytecode &bc) {
       auto true_case = bc_to_reg.at(node.arguments.at(2));
       auto false_case = bc_to_reg.at(node.arguments.at(3));
 
-      auto mask =
-          mc.vcmpps(lhs, rhs, Register::Imm(select_type_to_vcmpps_imm(op)));
-      auto true_lanes = mc.vandps(mask, true_case);
-      auto false_lanes = mc.vandnps(mask, false_case);
-      auto result = mc.vorps(true_lanes, false_lanes);
+      Register result;
+      if (mc.target.isa == Isa::AVX512) {
+        // compare into an opmask register, and let that pick each lane out of
+        // the true or false case directly. The mask is consumed by the very
+        // next instruction, so we just pin it to k1 rather than teaching the
+        // register allocator about opmask registers (see
+        // FOREACH_MACHINE_REGISTER for what that means for everything else).
+        // Hoisting leaves both alone, since one sets and the other reads a
+        // machine register.
+        auto mask = Register::Machine(Machine_Register::k1);
+        mc.vcmpps(mask, lhs, rhs,
+                  Register::Imm(select_type_to_vcmpps_imm(op)));
+        result = mc.vblendmps(mask, false_case, true_case);
+      } else {
+        auto mask = mc.vcmpps(lhs, rhs,
+                              Register::Imm(select_type_to_vcmpps_imm(op)));
+        auto true_lanes = mc.vandps(mask, true_case);
+        auto false_lanes = mc.vandnps(mask, false_case);
+        result = mc.vorps(true_lanes, false_lanes);
+      }
 
       bc_to_reg[id] = result;
       break;
     }
     }
+  };
+
+  // anything that only depends on uniforms (and constants) comes out the same
+  // on every trip around the loop, so we work those out once up front and
+  // stash them on the stack. The loop loads them back from there, which
+  // usually gets folded into whatever uses them.
+  auto uniform_values = bc.uniform_values();
+  Node_Registers before_loop_regs{};
+  Node_Registers before_loop_extra_regs{};
+  Node_Registers uniform_slots{};
+  for (size_t id = 0; id < bc.nodes.size(); id++) {
+    const auto &node = bc.nodes[id];
+    bool is_uniforms_arg = node.op == sdfjit::bytecode::Op::Load_Arg &&
+                           node.arg_index == uniforms_arg_index;
+    if (!uniform_values[id] && node.op != sdfjit::bytecode::Op::Assign_Float &&
+        !is_uniforms_arg) {
+      continue;
+    }
+    // (constants we don't end up using out here get cleaned up later)
+    lower_node(id, 0, before_loop_regs, before_loop_extra_regs);
+
+    bool used_in_loop = false;
+    for (size_t user = id + 1; user < bc.nodes.size(); user++) {
+      used_in_loop |= !uniform_values[user] && bc.nodes[user].uses(id);
+    }
+    if (uniform_values[id] && used_in_loop) {
+      auto slot = Register::Memory(
+          Machine_Register::rsp, mc.stack_info.add_slot(target.vector_size()));
+      mc.vmovaps(slot, before_loop_regs.at(id));
+      uniform_slots[id] = slot;
+    }
+  }
+
+  if (normals) {
+    // normals_y = normals_x + count * sizeof(float), and normals_z is another
+    // count floats along from that
+    mc.mov(Register::Machine(normals_y),
+           get_argument_register(count_arg_index));
+    mc.add(Register::Machine(normals_y), Register::Machine(normals_y));
+    mc.add(Register::Machine(normals_y), Register::Machine(normals_y));
+    mc.mov(Register::Machine(normals_z), Register::Machine(normals_y));
+    mc.add(Register::Machine(normals_y), Register::Machine(normals_x));
+    mc.add(Register::Machine(normals_z), Register::Machine(normals_y));
+  }
+
+  // the whole kernel runs once per batch of lanes, until we've done `count`
+  // floats. The counter gets loaded in the prologue.
+  mc.label(Register::Imm(loop_label));
+
+  for (size_t id = 0; id < bc.nodes.size(); id++) {
+    // emit this node for every batch before moving on to the next one, so
+    // there's always some independent work nearby for the cpu to get on with.
+    for (size_t batch = 0; batch < target.interleave; batch++) {
+      if (uniform_values[id]) {
+        if (uniform_slots.count(id)) {
+          batch_regs[batch][id] = mc.vmovaps(uniform_slots.at(id));
+        }
+        continue;
+      }
+      lower_node(id, batch, batch_regs[batch], batch_extra_regs[batch]);
+    }
+  }
+
+  // move all of the buffers along to the next batch, and go around again if
+  // there's anything left
+  auto stride = target.vector_size() * target.interleave;
+  if (intervals) {
+    stride *= 2;
+  }
+  for (size_t arg_index : {0, 1, 2, 4, 5}) {
+    mc.add(Register::Machine(
+               get_argument_register(arg_index).memory_ref().machine_reg()),
+           Register::Imm(uint32_t(stride)));
   }
+  if (normals) {
+    mc.add(Register::Machine(normals_y), Register::Imm(uint32_t(stride)));
+    mc.add(Register::Machine(normals_z), Register::Imm(uint32_t(stride)));
+  }
+  mc.sub(Register::Machine(loop_counter),
+         Register::Imm(uint32_t(target.batch_size())));
+  mc.jg(Register::Imm(loop_label));
 
   return mc;
 }
@@ -262,25 +477,23 @@ void Machine_Code::resolve_immediates() {
       if (!reg.is_immediate())
         continue;
 
-      // add constant to the pool
-      size_t constant_offset = constants.add(uint32_t(reg.imm()));
-
-      // update the register to be a memory
-      // reference
-      // XXX: do we want to make an api to
-      // make this much cleaner?
-      //      if we find ourselves rewriting
-      //      registers a lot it might be
-      //      good...
-      reg.kind = Register::Kind::Memory;
-      reg.reg = get_argument_register(constant_pool_arg_index).reg;
-      reg.memory_ref().offset = constant_offset;
+      // add constant to the pool. Broadcasts only read one float, anything
+      // else had a constant folded into it and reads a whole vector.
+      size_t constant_offset =
+          instructions[i].op == Op::vbroadcastss
+              ? constants.add(uint32_t(reg.imm()))
+              : constants.add_vector(uint32_t(reg.imm()),
+                                     target.vector_size());
+
+      // the assembler puts the pool right after the code, and points
+      // rip-relative references into it
+      reg = Register::Memory(Machine_Register::rip, constant_offset);
     }
   }
 }
 
 void Machine_Code::allocate_registers() {
-  Linear_Scan_Register_Allocator lsra{};
+  auto lsra = Linear_Scan_Register_Allocator::for_target(target);
   lsra.allocate(*this);
 }
 
@@ -290,15 +503,18 @@ void Machine_Code::add_prologue_and_epilogue() {
   // prologue:
   // push rbp
   // mov rbp, rsp
+  // mov <loop_counter>, <count>
   // sub rsp, <stack_size>
-  // and rsp, 0xffffffffffffffe0
+  // and rsp, -<vector_size>
   insertions.before.push(0, Register::Machine(Machine_Register::rbp));
   insertions.before.mov(0, Register::Machine(Machine_Register::rbp),
                         Register::Machine(Machine_Register::rsp));
+  insertions.before.mov(0, Register::Machine(loop_counter),
+                        get_argument_register(count_arg_index));
   insertions.before.sub(0, Register::Machine(Machine_Register::rsp),
                         Register::Imm(stack_info.current_offset));
   insertions.before.and64(0, Register::Machine(Machine_Register::rsp),
-                          Register::Imm(0xffffffffffffffe0ull));
+                          Register::Imm(~uint64_t(target.vector_size() - 1)));
 
   // epilogue:
   // mov rsp, rbp
@@ -326,9 +542,14 @@ void Machine_Code::add_prologue_and_epilogue() {
 
 #define DEFINE_X86_UNARY_OP(name, ...)                                         \
   Register Machine_Code::name(const Register &val) {                           \
-    return add_instruction(Instruction{Op::name, {val}})                       \
-        .set_registers()                                                       \
-        .at(0);                                                                \
+    add_instruction(Instruction{Op::name, {val}});                             \
+    return val;                                                                \
+  }
+
+#define DEFINE_X86_BINARY_OP(name, ...)                                        \
+  Register Machine_Code::name(const Register &lhs, const Register &rhs) {      \
+    add_instruction(Instruction{Op::name, {lhs, rhs}});                        \
+    return lhs;                                                                \
   }
 
 #define DEFINE_BINARY_OP(name, ...)                                            \
@@ -356,6 +577,7 @@ void Machine_Code::add_prologue_and_epilogue() {
 
 FOREACH_UNARY_MACHINE_OP(DEFINE_UNARY_OP);
 FOREACH_X86_UNARY_MACHINE_OP(DEFINE_X86_UNARY_OP);
+FOREACH_X86_BINARY_MACHINE_OP(DEFINE_X86_BINARY_OP);
 FOREACH_BINARY_MACHINE_OP(DEFINE_BINARY_OP);
 FOREACH_TERNARY_MACHINE_OP(DEFINE_TERNARY_OP);
 
@@ -375,52 +597,78 @@ Register Machine_Code::mod(const Register &lhs, const Register &rhs) {
 }
 
 Register Machine_Code::cos(const Register &val) {
-  return sin(vaddps(val, vbroadcastss(Register::Imm(float(M_PI / 2)))));
+  return sin_quadrants(val, {1}).at(0);
 }
 
 Register Machine_Code::sin(const Register &val) {
-  /* we compute sin with Bhaskara I's formula, see
-   * https://en.wikipedia.org/wiki/Bhaskara_I%27s_sine_approximation_formula
-   * this isn't *super* accurate, but it's probably good enough for now,
-   * and it doesn't take very many instructions to compute
+  return sin_quadrants(val, {0}).at(0);
+}
+
+std::vector<Register>
+Machine_Code::sin_quadrants(const Register &val,
+                            const std::vector<uint32_t> &quadrants) {
+  /* the usual approach (cephes, sleef, etc. all do some version of this):
+   *
+   * k = round(x * 2/pi)
+   * r = x - k * pi/2
    *
-   * sin(x) = (16 * x * (pi - x)) / (5 * pi^2 - 4 * x * (pi - x))
+   * which puts r in [-pi/4, pi/4]. Then sin(x) is one of sin(r), cos(r),
+   * -sin(r) or -cos(r), depending on k mod 4, and both of those are nice
+   * polynomials on that range. pi/2 gets split into a few pieces with less
+   * bits each (Cody-Waite), so that k * pi/2 doesn't eat all of r's precision
+   * once x gets big.
    *
-   * This sine approximation is only accurate in [0, M_PI], so we need to modulo
-   * down to that range. However, since sine makes sense in [0, 2*M_PI], we
-   * actually want to bring it there, and then subtract M_PI to bring it into
-   * valid range, keep track of the sign bit and mask it off for our operation.
-   * Then we can flip the sign of the result if our sign is positive.
+   * Adding 1.5 * 2^23 rounds k to an integer for us, and leaves it sitting in
+   * the low bits of the mantissa, so we can get the quadrant with some shifts
+   * instead of converting it.
    */
-  auto pi = vbroadcastss(Register::Imm(float(M_PI)));
-  auto pi_times_two = vbroadcastss(Register::Imm(float(M_PI * 2)));
-
-  auto x = mod(val, pi_times_two);
-  x = vsubps(x, pi);
-  auto saved_sign =
-      vandps(x, vbroadcastss(Register::Imm(uint32_t(0x80000000))));
-  x = vandps(x, vbroadcastss(Register::Imm(uint32_t(0x7fffffff))));
-
-  auto five_time_pi_squared =
-      vbroadcastss(Register::Imm(float(5 * M_PI * M_PI)));
-  auto pi_minus_x = vsubps(pi, x);
-  auto four = vbroadcastss(Register::Imm(4.0f));
-  auto four_time_x_times_pi_minus_x = vmulps(four, vmulps(x, pi_minus_x));
-
-  auto numerator = vmulps(four, four_time_x_times_pi_minus_x);
-  auto denominator = vsubps(five_time_pi_squared, four_time_x_times_pi_minus_x);
-  auto unsigned_sine = vdivps(numerator, denominator);
-
-  // add back in the sign bit we saved off earlier:
-  auto result = vxorps(
-      unsigned_sine,
-      vxorps(saved_sign, vbroadcastss(Register::Imm(uint32_t(0x80000000)))));
+  const auto &coefficients = sin_cos_coefficients(target.precision);
 
-  return result;
+  auto constant = [&](float f) { return vbroadcastss(Register::Imm(f)); };
+
+  // k, rounded, plus 1.5 * 2^23
+  auto magic = constant(12582912.0f);
+  auto k_bits = vaddps(vmulps(val, constant(float(2 / M_PI))), magic);
+  auto k = vsubps(k_bits, magic);
+
+  auto r = val;
+  for (float part : coefficients.pi_over_two) {
+    r = vsubps(r, vmulps(k, constant(part)));
+  }
+  auto r2 = vmulps(r, r);
+
+  auto polynomial = [&](const std::vector<float> &c) {
+    auto result = constant(c.back());
+    for (size_t i = c.size() - 1; i-- > 0;) {
+      result = vaddps(vmulps(result, r2), constant(c[i]));
+    }
+    return result;
+  };
+  auto sin_r = vmulps(r, polynomial(coefficients.sin));
+  auto cos_r = polynomial(coefficients.cos);
+
+  std::vector<Register> results{};
+  for (auto quadrant : quadrants) {
+    // this can't carry out of the mantissa, so it's just shifting the quadrant
+    auto q_bits = k_bits;
+    if (quadrant != 0) {
+      q_bits = vaddps(k_bits, constant(float(quadrant)));
+    }
+
+    // odd quadrants want cos(r) (bit 0 of k, smeared over the whole lane)
+    auto odd = vpsrad(vpslld(q_bits, Register::Imm(31u)), Register::Imm(31u));
+    auto result = vorps(vandps(odd, cos_r), vandnps(odd, sin_r));
+
+    // and quadrants 2 and 3 are negated (bit 1 of k, moved to the sign bit)
+    auto sign = vandps(vpslld(q_bits, Register::Imm(30u)),
+                       vbroadcastss(Register::Imm(uint32_t(0x80000000))));
+    results.push_back(vxorps(result, sign));
+  }
+  return results;
 }
 
 std::ostream &operator<<(std::ostream &os, Machine_Register reg) {
-#define MACHINE_REGISTER_TOSTRING(register_name, register_number)              \
+#define MACHINE_REGISTER_TOSTRING(register_name, ...)                          \
   case Machine_Register::register_name:                                        \
     return os << #register_name;
   switch (reg) { FOREACH_MACHINE_REGISTER(MACHINE_REGISTER_TOSTRING); }
@@ -499,6 +747,10 @@ Register get_argument_register(size_t arg_index) {
   case 5:
     reg = Machine_Register::r9;
     break;
+  case 6:
+    // past the first 6 they're on the stack, above the return address and the
+    // rbp we push in the prologue
+    return Register::Memory(Machine_Register::rbp, 16);
   default:
     abort();
   }
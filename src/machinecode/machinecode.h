@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdlib>
 #include <iostream>
 #include <variant>
 #include <vector>
@@ -7,6 +8,7 @@
 #include "bytecode/bytecode.h"
 #include "constantpool.h"
 #include "stack.h"
+#include "target.h"
 #include "util/bits.h"
 
 namespace sdfjit::machinecode {
@@ -14,43 +16,100 @@ namespace sdfjit::machinecode {
 using Virtual_Register = size_t;
 
 // clang-format off
-// macro(register_name, register_number)
-// TODO: find register numbers in docs, for now they're all 0
-// XXX: we'll probably want to break this up by register family (normal, xmms, ymms, etc)
+// macro(register_name, register_number, register_family)
+// (rip is only ever a memory base, for reading the constant pool)
+//
+// The register allocator doesn't know about the opmask registers (k0-k7). The
+// only one we use is k1, which is reserved for AVX-512 Selects: the vcmpps
+// writes its mask straight into k1, and the vblendmps right after it reads it
+// back. Nothing may go between them that touches k1, so those two mustn't be
+// split up (by hoisting, scheduling, and so on), and anything else wanting an
+// opmask needs a register of its own, or allocator support for them.
 #define FOREACH_MACHINE_REGISTER(macro) \
-    macro(rax, 0) \
-    macro(rcx, 1) \
-    macro(rdx, 2) \
-    macro(rsp, 4) \
-    macro(rbp, 5) \
-    macro(rsi, 6) \
-    macro(rdi, 7) \
-    macro(r8, 8) \
-    macro(r9, 9) \
-    macro(xmm0, 0) \
-    macro(xmm1, 1) \
-    macro(xmm2, 2) \
-    macro(xmm3, 3) \
-    macro(xmm4, 4) \
-    macro(xmm5, 5) \
-    macro(xmm6, 6) \
-    macro(xmm7, 7) \
-    macro(xmm8, 8) \
-    macro(xmm9, 9) \
-    macro(xmm10, 10) \
-    macro(xmm11, 11) \
-    macro(xmm12, 12) \
-    macro(xmm13, 13) \
-    macro(xmm14, 14) \
-    macro(xmm15, 15) \
-    macro(ymm0, 0) \
-    macro(ymm1, 1) \
-    macro(ymm2, 2) \
-    macro(ymm3, 3) \
-    macro(ymm4, 4) \
-    macro(ymm5, 5) \
-    macro(ymm6, 6) \
-    macro(ymm7, 7)
+    macro(rax, 0, GPR) \
+    macro(rcx, 1, GPR) \
+    macro(rdx, 2, GPR) \
+    macro(rsp, 4, GPR) \
+    macro(rbp, 5, GPR) \
+    macro(rsi, 6, GPR) \
+    macro(rdi, 7, GPR) \
+    macro(r8, 8, GPR) \
+    macro(r9, 9, GPR) \
+    macro(r10, 10, GPR) \
+    macro(r11, 11, GPR) \
+    macro(rip, 5, GPR) \
+    macro(xmm0, 0, XMM) \
+    macro(xmm1, 1, XMM) \
+    macro(xmm2, 2, XMM) \
+    macro(xmm3, 3, XMM) \
+    macro(xmm4, 4, XMM) \
+    macro(xmm5, 5, XMM) \
+    macro(xmm6, 6, XMM) \
+    macro(xmm7, 7, XMM) \
+    macro(xmm8, 8, XMM) \
+    macro(xmm9, 9, XMM) \
+    macro(xmm10, 10, XMM) \
+    macro(xmm11, 11, XMM) \
+    macro(xmm12, 12, XMM) \
+    macro(xmm13, 13, XMM) \
+    macro(xmm14, 14, XMM) \
+    macro(xmm15, 15, XMM) \
+    macro(ymm0, 0, YMM) \
+    macro(ymm1, 1, YMM) \
+    macro(ymm2, 2, YMM) \
+    macro(ymm3, 3, YMM) \
+    macro(ymm4, 4, YMM) \
+    macro(ymm5, 5, YMM) \
+    macro(ymm6, 6, YMM) \
+    macro(ymm7, 7, YMM) \
+    macro(ymm8, 8, YMM) \
+    macro(ymm9, 9, YMM) \
+    macro(ymm10, 10, YMM) \
+    macro(ymm11, 11, YMM) \
+    macro(ymm12, 12, YMM) \
+    macro(ymm13, 13, YMM) \
+    macro(ymm14, 14, YMM) \
+    macro(ymm15, 15, YMM) \
+    macro(zmm0, 0, ZMM) \
+    macro(zmm1, 1, ZMM) \
+    macro(zmm2, 2, ZMM) \
+    macro(zmm3, 3, ZMM) \
+    macro(zmm4, 4, ZMM) \
+    macro(zmm5, 5, ZMM) \
+    macro(zmm6, 6, ZMM) \
+    macro(zmm7, 7, ZMM) \
+    macro(zmm8, 8, ZMM) \
+    macro(zmm9, 9, ZMM) \
+    macro(zmm10, 10, ZMM) \
+    macro(zmm11, 11, ZMM) \
+    macro(zmm12, 12, ZMM) \
+    macro(zmm13, 13, ZMM) \
+    macro(zmm14, 14, ZMM) \
+    macro(zmm15, 15, ZMM) \
+    macro(zmm16, 16, ZMM) \
+    macro(zmm17, 17, ZMM) \
+    macro(zmm18, 18, ZMM) \
+    macro(zmm19, 19, ZMM) \
+    macro(zmm20, 20, ZMM) \
+    macro(zmm21, 21, ZMM) \
+    macro(zmm22, 22, ZMM) \
+    macro(zmm23, 23, ZMM) \
+    macro(zmm24, 24, ZMM) \
+    macro(zmm25, 25, ZMM) \
+    macro(zmm26, 26, ZMM) \
+    macro(zmm27, 27, ZMM) \
+    macro(zmm28, 28, ZMM) \
+    macro(zmm29, 29, ZMM) \
+    macro(zmm30, 30, ZMM) \
+    macro(zmm31, 31, ZMM) \
+    macro(k0, 0, OPMASK) \
+    macro(k1, 1, OPMASK) \
+    macro(k2, 2, OPMASK) \
+    macro(k3, 3, OPMASK) \
+    macro(k4, 4, OPMASK) \
+    macro(k5, 5, OPMASK) \
+    macro(k6, 6, OPMASK) \
+    macro(k7, 7, OPMASK)
 
 // macro(op_name, num_args, set_reg_idxs, used_reg_idxs, takes_imm, takes_mem)
 // TODO: all the ops
@@ -78,8 +137,20 @@ using Virtual_Register = size_t;
 #define X86_NULLARY_MACHINE_OP_MACRO_WRAPPER(macro, name, takes_imm, takes_mem) \
     macro(name, 0, MC_INITIALIZER_LIST(), MC_INITIALIZER_LIST(), takes_imm, takes_mem)
 
+// the fma ops are modeled as result = (op2 * op3) +/- op1. The real
+// instructions accumulate into their destination, so the assembler gets op1
+// into the result register first (and the register allocator tries to make
+// that free).
+#define FOREACH_FMA_MACHINE_OP(macro) \
+    TERNARY_MACHINE_OP_MACRO_WRAPPER(macro, vfmadd231ps, false, true) \
+    TERNARY_MACHINE_OP_MACRO_WRAPPER(macro, vfmsub231ps, false, true) \
+    TERNARY_MACHINE_OP_MACRO_WRAPPER(macro, vfnmadd231ps, false, true) \
+
 #define FOREACH_TERNARY_MACHINE_OP(macro) \
     TERNARY_MACHINE_OP_MACRO_WRAPPER(macro, vcmpps, true, false) \
+    TERNARY_MACHINE_OP_MACRO_WRAPPER(macro, vblendmps, false, true) \
+    TERNARY_MACHINE_OP_MACRO_WRAPPER(macro, vblendvps, false, true) \
+    FOREACH_FMA_MACHINE_OP(macro) \
 
 #define FOREACH_BINARY_MACHINE_OP(macro) \
     BINARY_MACHINE_OP_MACRO_WRAPPER(macro, vaddps, false, true) \
@@ -92,6 +163,7 @@ using Virtual_Register = size_t;
     BINARY_MACHINE_OP_MACRO_WRAPPER(macro, vxorps, false, true) \
     BINARY_MACHINE_OP_MACRO_WRAPPER(macro, vpslld, true, false) \
     BINARY_MACHINE_OP_MACRO_WRAPPER(macro, vpsrld, true, false) \
+    BINARY_MACHINE_OP_MACRO_WRAPPER(macro, vpsrad, true, false) \
     BINARY_MACHINE_OP_MACRO_WRAPPER(macro, vroundps, true, false) \
     BINARY_MACHINE_OP_MACRO_WRAPPER(macro, vmaxps, false, true) \
     BINARY_MACHINE_OP_MACRO_WRAPPER(macro, vminps, false, true) \
@@ -102,8 +174,12 @@ using Virtual_Register = size_t;
     X86_BINARY_MACHINE_OP_MACRO_WRAPPER(macro, sub, true, false) \
     X86_BINARY_MACHINE_OP_MACRO_WRAPPER(macro, and64, true, false) \
 
+// label and jg take a label number as an immediate. label doesn't emit
+// anything, it just marks where a jump goes.
 #define FOREACH_X86_UNARY_IN_MACHINE_OP(macro) \
     X86_UNARY_IN_MACHINE_OP_MACRO_WRAPPER(macro, push, false, false) \
+    X86_UNARY_IN_MACHINE_OP_MACRO_WRAPPER(macro, label, true, false) \
+    X86_UNARY_IN_MACHINE_OP_MACRO_WRAPPER(macro, jg, true, false) \
 
 #define FOREACH_X86_UNARY_OUT_MACHINE_OP(macro) \
     X86_UNARY_OUT_MACHINE_OP_MACRO_WRAPPER(macro, pop, false, false) \
@@ -132,11 +208,34 @@ using Virtual_Register = size_t;
 
 // clang-format on
 
-#define MACHINE_REGISTER_ENUM(register_name, register_number) register_name,
+#define MACHINE_REGISTER_ENUM(register_name, ...) register_name,
 enum class Machine_Register { FOREACH_MACHINE_REGISTER(MACHINE_REGISTER_ENUM) };
 #undef MACHINE_REGISTER_ENUM
 
-uint64_t register_number(Machine_Register reg);
+enum class Register_Family { GPR, XMM, YMM, ZMM, OPMASK };
+
+// these are in here (rather than machinecode.cpp) so that the assembler, which
+// asks for them a few times per instruction, gets to inline them
+constexpr uint64_t register_number(Machine_Register reg) {
+#define MACHINE_REGISTER_NUMBER(register_name, register_number, ...)           \
+  case Machine_Register::register_name:                                        \
+    return register_number;
+
+  switch (reg) { FOREACH_MACHINE_REGISTER(MACHINE_REGISTER_NUMBER); }
+  abort();
+#undef MACHINE_REGISTER_NUMBER
+}
+
+constexpr Register_Family register_family(Machine_Register reg) {
+#define MACHINE_REGISTER_FAMILY(register_name, register_number,                \
+                                register_family)                               \
+  case Machine_Register::register_name:                                        \
+    return Register_Family::register_family;
+
+  switch (reg) { FOREACH_MACHINE_REGISTER(MACHINE_REGISTER_FAMILY); }
+  abort();
+#undef MACHINE_REGISTER_FAMILY
+}
 
 #define MACHINE_OP_ENUM(op_name, ...) op_name,
 enum class Op { FOREACH_MACHINE_OP(MACHINE_OP_ENUM) };
@@ -216,7 +315,9 @@ struct Register {
   static Register Imm(unsigned long long imm) {
     return {Kind::Immediate, Immediate_Value(uint64_t(imm))};
   }
-  static Register Imm(uint64_t imm) { return {Kind::Immediate, imm}; }
+  static Register Imm(uint64_t imm) {
+    return {Kind::Immediate, Immediate_Value(imm)};
+  }
   static Register Imm(uint32_t imm) {
     return {Kind::Immediate, Immediate_Value(imm)};
   }
@@ -277,6 +378,7 @@ struct Instruction {
   bool uses(const Register &reg) const;
   bool can_use_immediates() const;
   bool can_use_memory_ref() const;
+  bool is_fma() const;
 
   void replace_register(const Register &from, const Register &to) {
     for (size_t i = 0; i < registers.size(); i++) {
@@ -299,10 +401,18 @@ struct Machine_Code {
   Virtual_Register next_virtual_register{0};
   Constant_Pool constants{};
   Stack_Info stack_info{};
-
-  static constexpr size_t constant_pool_arg_index = 3;
-
-  static Machine_Code from_bytecode(const sdfjit::bytecode::Bytecode &bc);
+  Target target{};
+
+  // kernels loop over `count` floats from each buffer, one vector at a time
+  static constexpr size_t count_arg_index = 6;
+  // the uniforms are the only argument that isn't walked through a vector at
+  // a time, every lane reads the same ones
+  static constexpr size_t uniforms_arg_index = 3;
+  static constexpr Machine_Register loop_counter = Machine_Register::rax;
+  static constexpr uint32_t loop_label = 0;
+
+  static Machine_Code from_bytecode(const sdfjit::bytecode::Bytecode &bc,
+                                    const Target &target);
   void resolve_immediates();
 
   Instruction &add_instruction(const Instruction &insn) {
@@ -321,6 +431,8 @@ struct Machine_Code {
   Register name(const Register &src);                                          \
   Register name(const Register &result, const Register &src);
 #define X86_UNARY_DECL(name, ...) Register name(const Register &val);
+#define X86_BINARY_DECL(name, ...)                                             \
+  Register name(const Register &lhs, const Register &rhs);
 #define BINARY_DECL(name, ...)                                                 \
   Register name(const Register &lhs, const Register &rhs);                     \
   Register name(const Register &result, const Register &lhs,                   \
@@ -334,6 +446,7 @@ struct Machine_Code {
 
   FOREACH_UNARY_MACHINE_OP(UNARY_DECL);
   FOREACH_X86_UNARY_MACHINE_OP(X86_UNARY_DECL);
+  FOREACH_X86_BINARY_MACHINE_OP(X86_BINARY_DECL);
   FOREACH_BINARY_MACHINE_OP(BINARY_DECL);
   FOREACH_TERNARY_MACHINE_OP(TERNARY_DECL);
   FOREACH_X86_NULLARY_MACHINE_OP(X86_NULLARY_DECL);
@@ -341,6 +454,7 @@ struct Machine_Code {
 #undef X86_NULLARY_DECL
 #undef TERNARY_DECL
 #undef BINARY_DECL
+#undef X86_BINARY_DECL
 #undef X86_UNARY_DECL
 #undef UNARY_DECL
 
@@ -348,6 +462,10 @@ struct Machine_Code {
   Register mod(const Register &lhs, const Register &rhs);
   Register cos(const Register &val);
   Register sin(const Register &val);
+  // sin(val + quadrant * pi/2) for each of the quadrants (which is all sin
+  // and cos really are), sharing the range reduction between them
+  std::vector<Register> sin_quadrants(const Register &val,
+                                      const std::vector<uint32_t> &quadrants);
 };
 
 std::ostream &operator<<(std::ostream &os, const Machine_Register reg);
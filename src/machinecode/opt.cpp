@@ -1,12 +1,32 @@
 #include "opt.h"
 
+#include "passes/fmacontraction.h"
+#include "passes/isel.h"
+#include "passes/loopinvariants.h"
 #include "passes/movelimination.h"
+#include "passes/peephole.h"
 
 namespace sdfjit::machinecode {
 
+void early_optimize(Machine_Code &mc) {
+  passes::run_peephole_rules(mc, {
+                                     passes::select_blendv,
+                                     passes::abs_as_and,
+                                     passes::contract_fma,
+                                     passes::remove_dead_values,
+                                 });
+  passes::hoist_loop_invariants(mc);
+  // whatever constants didn't get a register can just be read from memory, and
+  // so can the inputs
+  passes::run_peephole_rules(mc, {
+                                     passes::fold_constant_operands,
+                                     passes::fold_input_loads,
+                                     passes::remove_dead_values,
+                                 });
+}
+
 void optimize(Machine_Code &mc) {
-  (void)mc;
-  passes::peephole_eliminate_movs(mc);
+  passes::run_peephole_rules(mc, {passes::eliminate_movs});
   // TODO: eliminate nops
 }
 
@@ -4,6 +4,9 @@
 
 namespace sdfjit::machinecode {
 
+// optimizations on virtual registers, run before register allocation
+void early_optimize(Machine_Code &mc);
+// optimizations run after register allocation
 void optimize(Machine_Code &mc);
 
 }
@@ -0,0 +1,47 @@
+#include "fmacontraction.h"
+
+namespace sdfjit::machinecode::passes {
+
+bool contract_fma(Peephole_Context &ctx, size_t index) {
+  auto &insn = ctx.mc.instructions[index];
+  if (!ctx.mc.target.has_fma() ||
+      (insn.op != Op::vaddps && insn.op != Op::vsubps)) {
+    return false;
+  }
+
+  // the vmulps computing reg, if it's only used once (by whoever's asking)
+  auto single_use_product = [&](const Register &reg) -> Instruction * {
+    auto *def = ctx.definition_of(reg);
+    if (!def || def->op != Op::vmulps || ctx.uses_of(reg) != 1) {
+      return nullptr;
+    }
+    return def;
+  };
+
+  auto result = insn.registers.at(0);
+  auto lhs = insn.registers.at(1);
+  auto rhs = insn.registers.at(2);
+
+  Instruction *product;
+  Op fused;
+  Register addend;
+  if ((product = single_use_product(lhs))) {
+    // (a * b) + c, (a * b) - c
+    fused = insn.op == Op::vaddps ? Op::vfmadd231ps : Op::vfmsub231ps;
+    addend = rhs;
+  } else if ((product = single_use_product(rhs))) {
+    // c + (a * b), c - (a * b)
+    fused = insn.op == Op::vaddps ? Op::vfmadd231ps : Op::vfnmadd231ps;
+    addend = lhs;
+  } else {
+    return false;
+  }
+
+  ctx.replace(index, Instruction{fused,
+                                 {result, addend, product->registers.at(1),
+                                  product->registers.at(2)}});
+  ctx.remove(ctx.index_of(*product));
+  return true;
+}
+
+} // namespace sdfjit::machinecode::passes
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "peephole.h"
+
+namespace sdfjit::machinecode::passes {
+
+// fuse vmulps + vaddps/vsubps pairs into fmas, when the product isn't used
+// anywhere else. Needs to run before register allocation.
+bool contract_fma(Peephole_Context &ctx, size_t index);
+
+} // namespace sdfjit::machinecode::passes
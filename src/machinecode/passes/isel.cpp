@@ -0,0 +1,187 @@
+#include "isel.h"
+
+#include <optional>
+#include <utility>
+
+namespace sdfjit::machinecode::passes {
+
+bool select_blendv(Peephole_Context &ctx, size_t index) {
+  auto &insn = ctx.mc.instructions[index];
+  if (ctx.mc.target.isa != Isa::AVX2 || insn.op != Op::vorps) {
+    return false;
+  }
+
+  auto *true_lanes = ctx.definition_of(insn.registers.at(1));
+  auto *false_lanes = ctx.definition_of(insn.registers.at(2));
+  if (!true_lanes || !false_lanes) {
+    return false;
+  }
+  if (true_lanes->op == Op::vandnps) {
+    std::swap(true_lanes, false_lanes);
+  }
+  if (true_lanes->op != Op::vandps || false_lanes->op != Op::vandnps ||
+      ctx.uses_of(true_lanes->registers.at(0)) != 1 ||
+      ctx.uses_of(false_lanes->registers.at(0)) != 1) {
+    return false;
+  }
+
+  // vblendvps only looks at the sign bit of each lane, so this is only the
+  // same thing when every lane of the mask is all ones or all zeros
+  auto mask = false_lanes->registers.at(1);
+  auto *mask_def = ctx.definition_of(mask);
+  if (!mask_def || !(true_lanes->registers.at(1) == mask)) {
+    return false;
+  }
+  if (mask_def->op == Op::vpsrad &&
+      uint32_t(mask_def->registers.at(2).imm()) == 31) {
+    // a sign bit smeared across the lane. The blend only needs the sign bit,
+    // so skip the smearing if nothing else wants it.
+    if (ctx.uses_of(mask) == 2) {
+      mask = mask_def->registers.at(1);
+    }
+  } else if (mask_def->op != Op::vcmpps) {
+    return false;
+  }
+
+  ctx.replace(index, Instruction{Op::vblendvps,
+                                 {insn.registers.at(0), mask,
+                                  false_lanes->registers.at(2),
+                                  true_lanes->registers.at(2)}});
+  ctx.remove(ctx.index_of(*true_lanes));
+  ctx.remove(ctx.index_of(*false_lanes));
+  return true;
+}
+
+bool abs_as_and(Peephole_Context &ctx, size_t index) {
+  auto &insn = ctx.mc.instructions[index];
+  if (insn.op != Op::vpsrld || uint32_t(insn.registers.at(2).imm()) != 1) {
+    return false;
+  }
+
+  auto *shl = ctx.definition_of(insn.registers.at(1));
+  if (!shl || shl->op != Op::vpslld ||
+      uint32_t(shl->registers.at(2).imm()) != 1 ||
+      ctx.uses_of(shl->registers.at(0)) != 1) {
+    return false;
+  }
+
+  // reuse the shifted value's register to hold the mask instead. It's a
+  // broadcast like any other constant, so it can get hoisted or folded.
+  auto mask = shl->registers.at(0);
+  auto src = shl->registers.at(1);
+  ctx.replace(ctx.index_of(*shl),
+              Instruction{Op::vbroadcastss,
+                          {mask, Register::Imm(0x7fffffffu)}});
+  ctx.replace(index,
+              Instruction{Op::vandps, {insn.registers.at(0), src, mask}});
+  return true;
+}
+
+// the immediate that reg is a broadcast of, if it's broadcast inside the loop
+static std::optional<Register> loop_constant(Peephole_Context &ctx,
+                                             const Register &reg) {
+  if (!reg.is_virtual() || !ctx.definitions.count(reg.virtual_reg())) {
+    return {};
+  }
+
+  auto def = ctx.definitions.at(reg.virtual_reg());
+  const auto &def_insn = ctx.mc.instructions[def];
+  if (def < ctx.loop_start || def_insn.op != Op::vbroadcastss ||
+      !def_insn.registers.at(1).is_immediate()) {
+    return {};
+  }
+  return def_insn.registers.at(1);
+}
+
+// the memory that reg was loaded from, if it's loaded inside the loop
+static std::optional<Register> loop_load(Peephole_Context &ctx,
+                                         const Register &reg) {
+  if (!reg.is_virtual() || !ctx.definitions.count(reg.virtual_reg())) {
+    return {};
+  }
+
+  auto def = ctx.definitions.at(reg.virtual_reg());
+  const auto &def_insn = ctx.mc.instructions[def];
+  if (def < ctx.loop_start || def_insn.op != Op::vmovaps ||
+      !def_insn.registers.at(1).is_memory()) {
+    return {};
+  }
+  return def_insn.registers.at(1);
+}
+
+// put whatever `operand` says one of the instruction's inputs can be replaced
+// with into its last operand, since that's the only one that can be a memory
+// reference
+static bool fold_into_last_operand(
+    Peephole_Context &ctx, size_t index,
+    std::optional<Register> (*operand)(Peephole_Context &, const Register &)) {
+  auto insn = ctx.mc.instructions[index];
+  if (!insn.can_use_memory_ref() || insn.registers.size() < 2) {
+    return false;
+  }
+
+  // get the value over to the last operand if we're allowed to (and if there
+  // isn't already something folded in there)
+  auto last = insn.registers.size() - 1;
+  if (!insn.registers.at(last).is_virtual()) {
+    return false;
+  }
+  if (!operand(ctx, insn.registers.at(last))) {
+    size_t other;
+    switch (insn.op) {
+    case Op::vaddps:
+    case Op::vmulps:
+    case Op::vandps:
+    case Op::vorps:
+    case Op::vxorps:
+      other = 1;
+      break;
+    case Op::vfmadd231ps:
+    case Op::vfmsub231ps:
+    case Op::vfnmadd231ps:
+      // the multiplicands
+      other = 2;
+      break;
+    default:
+      return false;
+    }
+
+    if (!operand(ctx, insn.registers.at(other))) {
+      return false;
+    }
+    std::swap(insn.registers.at(other), insn.registers.at(last));
+  }
+
+  insn.registers.at(last) = *operand(ctx, insn.registers.at(last));
+  ctx.replace(index, insn);
+  return true;
+}
+
+bool fold_constant_operands(Peephole_Context &ctx, size_t index) {
+  return fold_into_last_operand(ctx, index, loop_constant);
+}
+
+bool fold_input_loads(Peephole_Context &ctx, size_t index) {
+  return fold_into_last_operand(ctx, index, loop_load);
+}
+
+bool remove_dead_values(Peephole_Context &ctx, size_t index) {
+  auto &insn = ctx.mc.instructions[index];
+  auto set = insn.set_registers();
+  if (set.empty()) {
+    return false;
+  }
+
+  // anything writing to memory or machine registers has side effects we can't
+  // see from here
+  for (const auto &reg : set) {
+    if (!reg.is_virtual() || ctx.uses_of(reg) != 0) {
+      return false;
+    }
+  }
+
+  ctx.remove(index);
+  return true;
+}
+
+} // namespace sdfjit::machinecode::passes
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "peephole.h"
+
+namespace sdfjit::machinecode::passes {
+
+// instruction selection rules, these all run on virtual registers (so before
+// register allocation)
+
+// vandps + vandnps + vorps of a lane mask -> vblendvps (AVX2 only, the
+// SSE version insists on the mask being in xmm0, and AVX-512 already blends
+// with an opmask)
+bool select_blendv(Peephole_Context &ctx, size_t index);
+// the vpslld + vpsrld that Abs lowers to -> vandps with a constant mask
+bool abs_as_and(Peephole_Context &ctx, size_t index);
+// read broadcast constants straight out of the constant pool as a memory
+// operand, rather than broadcasting them into a register first. Constants that
+// got hoisted out of the loop are left alone, since they already have a
+// register.
+bool fold_constant_operands(Peephole_Context &ctx, size_t index);
+// same thing for the inputs: read them straight out of the argument buffers
+// wherever they're used. Nothing writes to those inside the loop, and a load
+// folded into an arithmetic op doesn't cost an extra uop, so this is a free
+// register (and a vmovaps) per input.
+bool fold_input_loads(Peephole_Context &ctx, size_t index);
+// get rid of anything whose result isn't used
+bool remove_dead_values(Peephole_Context &ctx, size_t index);
+
+} // namespace sdfjit::machinecode::passes
@@ -0,0 +1,230 @@
+#include "loopinvariants.h"
+
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "machinecode/registerallocator.h"
+
+namespace sdfjit::machinecode::passes {
+
+namespace {
+
+// what an instruction works out, regardless of where it puts it
+struct Computation {
+  Op op;
+  std::vector<Register> used;
+
+  bool operator==(const Computation &rhs) const {
+    return op == rhs.op && used == rhs.used;
+  }
+};
+
+struct Computation_Hash {
+  size_t operator()(const Computation &computation) const {
+    size_t hash = size_t(computation.op);
+    for (const auto &reg : computation.used) {
+      hash = hash * 31 + size_t(reg.kind);
+      switch (reg.kind) {
+      case Register::Kind::Virtual:
+        hash = hash * 31 + reg.virtual_reg();
+        break;
+      case Register::Kind::Machine:
+        hash = hash * 31 + size_t(reg.machine_reg());
+        break;
+      case Register::Kind::Memory: {
+        // (offsets off of virtual registers don't count, see
+        // Memory_Reference::operator==)
+        auto mem = reg.memory_ref();
+        hash = hash * 31 + (mem.is_virtual() ? mem.virtual_reg()
+                                             : size_t(mem.machine_reg()) +
+                                                   mem.offset * 31);
+        break;
+      }
+      case Register::Kind::Immediate:
+        hash = hash * 31 + size_t(uint64_t(reg.imm()));
+        break;
+      }
+    }
+    return hash;
+  }
+};
+
+} // namespace
+
+void hoist_loop_invariants(Machine_Code &mc) {
+  // find the loop
+  size_t loop_start = mc.instructions.size();
+  size_t loop_end = mc.instructions.size();
+  for (size_t i = 0; i < mc.instructions.size(); i++) {
+    const auto &insn = mc.instructions[i];
+    if (insn.op == Op::label &&
+        uint32_t(insn.registers.at(0).imm()) == Machine_Code::loop_label) {
+      loop_start = i;
+    } else if (insn.op == Op::jg &&
+               uint32_t(insn.registers.at(0).imm()) ==
+                   Machine_Code::loop_label) {
+      loop_end = i;
+    }
+  }
+  if (loop_start >= loop_end || loop_end == mc.instructions.size()) {
+    return;
+  }
+
+  // hoisted values are live across the whole loop, so each one permanently
+  // takes a register away from the loop body. Only hoist as many as we can
+  // without making the body spill more than it already does.
+  auto lsra = Linear_Scan_Register_Allocator::for_target(mc.target);
+  lsra.compute_live_intervals(mc);
+  auto pressure = lsra.live_intervals.max_live_between(loop_start, loop_end);
+  if (pressure >= lsra.machine_registers.size()) {
+    return;
+  }
+  size_t budget = lsra.machine_registers.size() - pressure;
+
+  // a value is invariant if it only depends on immediates (which end up in the
+  // constant pool), the stack, and other invariant values. Nothing's been
+  // spilled yet, so the only things on the stack are values worked out from
+  // the uniforms before the loop. Anything else touching memory reads from (or
+  // writes to) the buffers we're walking through.
+  std::unordered_set<Virtual_Register> invariant_values{};
+  std::vector<size_t> invariant_instructions{};
+  std::unordered_map<Virtual_Register, size_t> use_counts{};
+  for (size_t i = loop_start + 1; i < loop_end; i++) {
+    const auto &insn = mc.instructions[i];
+    for (const auto &reg : insn.used_registers()) {
+      if (reg.is_virtual()) {
+        use_counts[reg.virtual_reg()]++;
+      }
+    }
+
+    auto set = insn.set_registers();
+    if (set.size() != 1 || !set.at(0).is_virtual()) {
+      continue;
+    }
+
+    bool invariant = true;
+    for (const auto &reg : insn.used_registers()) {
+      if (reg.is_virtual()) {
+        invariant &= invariant_values.count(reg.virtual_reg()) > 0;
+      } else if (reg.is_memory() &&
+                 reg.memory_ref().machine_reg() == Machine_Register::rsp) {
+        continue;
+      } else if (!reg.is_immediate()) {
+        invariant = false;
+      }
+    }
+
+    if (invariant) {
+      invariant_values.insert(set.at(0).virtual_reg());
+      invariant_instructions.push_back(i);
+    }
+  }
+
+  // group up instructions computing the same thing, so we only hoist (and
+  // keep a register for) one copy
+  struct Candidate {
+    std::vector<size_t> instructions;
+    size_t uses;
+    // how many of the values it's worked out from haven't been hoisted yet
+    size_t waiting_on;
+    // the candidates using its value
+    std::vector<size_t> dependents;
+  };
+  std::vector<Candidate> candidates{};
+  std::unordered_map<Computation, size_t, Computation_Hash> computations{};
+  // which candidate each invariant value belongs to
+  std::unordered_map<Virtual_Register, size_t> computed_by{};
+  for (auto i : invariant_instructions) {
+    const auto &insn = mc.instructions[i];
+    auto value = insn.registers.at(0).virtual_reg();
+    auto uses = use_counts[value];
+
+    auto [existing, inserted] = computations.try_emplace(
+        Computation{insn.op, insn.used_registers()}, candidates.size());
+    if (inserted) {
+      candidates.push_back(Candidate{{i}, uses, 0, {}});
+    } else {
+      candidates[existing->second].instructions.push_back(i);
+      candidates[existing->second].uses += uses;
+    }
+    computed_by[value] = existing->second;
+  }
+
+  // everything a candidate depends on has to be out in front of the loop
+  // before it can go there too
+  for (size_t c = 0; c < candidates.size(); c++) {
+    const auto &insn = mc.instructions[candidates[c].instructions.at(0)];
+    for (const auto &reg : insn.used_registers()) {
+      if (reg.is_virtual()) {
+        candidates[computed_by.at(reg.virtual_reg())].dependents.push_back(c);
+        candidates[c].waiting_on++;
+      }
+    }
+  }
+
+  // of the ones that can go, most used first, with ties in program order
+  auto less_important = [&candidates](size_t a, size_t b) {
+    if (candidates[a].uses != candidates[b].uses) {
+      return candidates[a].uses < candidates[b].uses;
+    }
+    return a > b;
+  };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(less_important)>
+      ready{less_important};
+  for (size_t c = 0; c < candidates.size(); c++) {
+    if (candidates[c].waiting_on == 0) {
+      ready.push(c);
+    }
+  }
+
+  std::unordered_map<Virtual_Register, Register> duplicates{};
+  std::vector<Instruction> hoisted{};
+  while (budget > 0 && !ready.empty()) {
+    const auto &candidate = candidates[ready.top()];
+    ready.pop();
+
+    auto insn = mc.instructions[candidate.instructions.at(0)];
+    auto result = insn.registers.at(0);
+    for (auto i : candidate.instructions) {
+      auto duplicate = mc.instructions[i].registers.at(0);
+      mc.instructions[i].convert_to_nop();
+      if (!(duplicate == result)) {
+        duplicates[duplicate.virtual_reg()] = result;
+      }
+    }
+    hoisted.push_back(insn);
+    budget--;
+
+    for (auto dependent : candidate.dependents) {
+      if (--candidates[dependent].waiting_on == 0) {
+        ready.push(dependent);
+      }
+    }
+  }
+
+  // and everything that used one of the merged copies uses the one that's
+  // left instead
+  auto rename = [&duplicates](Instruction &insn) {
+    for (auto &reg : insn.registers) {
+      if (!reg.is_virtual()) {
+        continue;
+      }
+      auto renamed = duplicates.find(reg.virtual_reg());
+      if (renamed != duplicates.end()) {
+        reg = renamed->second;
+      }
+    }
+  };
+  for (auto &insn : hoisted) {
+    rename(insn);
+  }
+  for (size_t i = loop_start; i < mc.instructions.size(); i++) {
+    rename(mc.instructions[i]);
+  }
+
+  mc.instructions.insert(mc.instructions.begin() + loop_start, hoisted.begin(),
+                         hoisted.end());
+}
+
+} // namespace sdfjit::machinecode::passes
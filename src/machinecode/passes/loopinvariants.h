@@ -0,0 +1,13 @@
+#pragma once
+
+#include "machinecode/machinecode.h"
+
+namespace sdfjit::machinecode::passes {
+
+// move values that are the same on every iteration of the kernel loop (mostly
+// constant broadcasts) out in front of it, as long as we have registers to keep
+// them in. Identical ones get merged while we're at it. Needs to run before
+// register allocation.
+void hoist_loop_invariants(Machine_Code &mc);
+
+} // namespace sdfjit::machinecode::passes
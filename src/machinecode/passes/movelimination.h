@@ -1,9 +1,11 @@
 #pragma once
 
-#include "machinecode/machinecode.h"
+#include "peephole.h"
 
 namespace sdfjit::machinecode::passes {
 
-void peephole_eliminate_movs(Machine_Code &mc);
+// reloads of something we just spilled can come from the register it was
+// spilled from instead. Runs after register allocation.
+bool eliminate_movs(Peephole_Context &ctx, size_t index);
 
-}
+} // namespace sdfjit::machinecode::passes
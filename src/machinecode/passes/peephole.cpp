@@ -0,0 +1,118 @@
+#include "peephole.h"
+
+namespace sdfjit::machinecode::passes {
+
+void Peephole_Context::analyze() {
+  definitions.clear();
+  use_counts.clear();
+  loop_start = 0;
+
+  for (size_t i = 0; i < mc.instructions.size(); i++) {
+    const auto &insn = mc.instructions[i];
+    if (insn.op == Op::label &&
+        uint32_t(insn.registers.at(0).imm()) == Machine_Code::loop_label) {
+      loop_start = i;
+    }
+    for (const auto &reg : insn.set_registers()) {
+      if (reg.is_virtual()) {
+        definitions[reg.virtual_reg()] = i;
+      }
+    }
+    for (const auto &reg : insn.used_registers()) {
+      if (reg.is_virtual()) {
+        use_counts[reg.virtual_reg()]++;
+      }
+    }
+  }
+}
+
+Instruction *Peephole_Context::definition_of(const Register &reg) {
+  if (!reg.is_virtual()) {
+    return nullptr;
+  }
+  auto def = definitions.find(reg.virtual_reg());
+  if (def == definitions.end()) {
+    return nullptr;
+  }
+  return &mc.instructions[def->second];
+}
+
+size_t Peephole_Context::uses_of(const Register &reg) const {
+  if (!reg.is_virtual()) {
+    return 0;
+  }
+  auto uses = use_counts.find(reg.virtual_reg());
+  return uses == use_counts.end() ? 0 : uses->second;
+}
+
+void Peephole_Context::replace(size_t index, const Instruction &insn) {
+  auto &old = mc.instructions[index];
+  for (const auto &reg : old.set_registers()) {
+    auto def = reg.is_virtual() ? definitions.find(reg.virtual_reg())
+                                : definitions.end();
+    if (def != definitions.end() && def->second == index) {
+      definitions.erase(def);
+    }
+  }
+  for (const auto &reg : old.used_registers()) {
+    if (reg.is_virtual()) {
+      // one less use might be what some rule was waiting for (dead values,
+      // single use products, ...)
+      use_counts[reg.virtual_reg()]--;
+      if (auto def = definitions.find(reg.virtual_reg());
+          def != definitions.end()) {
+        revisit(def->second);
+      }
+    }
+  }
+
+  old = insn;
+  for (const auto &reg : old.set_registers()) {
+    if (reg.is_virtual()) {
+      definitions[reg.virtual_reg()] = index;
+    }
+  }
+  for (const auto &reg : old.used_registers()) {
+    if (reg.is_virtual()) {
+      use_counts[reg.virtual_reg()]++;
+    }
+  }
+  revisit(index);
+}
+
+void Peephole_Context::revisit(size_t index) {
+  if (!queued[index]) {
+    queued[index] = true;
+    worklist.push_back(index);
+  }
+}
+
+void run_peephole_rules(Machine_Code &mc,
+                        const std::vector<Peephole_Rule> &rules) {
+  Peephole_Context ctx{mc};
+  ctx.analyze();
+
+  // (backwards, so the first instruction gets popped first)
+  ctx.queued.assign(mc.instructions.size(), true);
+  ctx.worklist.reserve(mc.instructions.size());
+  for (size_t i = mc.instructions.size(); i-- > 0;) {
+    ctx.worklist.push_back(i);
+  }
+
+  while (!ctx.worklist.empty()) {
+    auto i = ctx.worklist.back();
+    ctx.worklist.pop_back();
+    ctx.queued[i] = false;
+
+    for (auto rule : rules) {
+      // whatever else the rule changed is back on the worklist already, so
+      // start over on this one and let the rest of the rules wait for that
+      if (rule(ctx, i)) {
+        ctx.revisit(i);
+        break;
+      }
+    }
+  }
+}
+
+} // namespace sdfjit::machinecode::passes
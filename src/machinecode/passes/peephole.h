@@ -0,0 +1,53 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include "machinecode/machinecode.h"
+
+namespace sdfjit::machinecode::passes {
+
+// what the rules get to look at: the code, plus where each virtual register is
+// set and how many times it's read. Only meaningful before register
+// allocation, afterwards there just aren't any virtual registers in here.
+struct Peephole_Context {
+  Machine_Code &mc;
+  std::unordered_map<Virtual_Register, size_t> definitions{};
+  std::unordered_map<Virtual_Register, size_t> use_counts{};
+  // index of the kernel loop's label (0 if there isn't one)
+  size_t loop_start{0};
+  // instructions that still need the rules run on them, last one first
+  std::vector<size_t> worklist{};
+  std::vector<bool> queued{};
+
+  void analyze();
+
+  // the instruction that sets reg, or nullptr if it isn't a virtual register
+  // set by a single instruction
+  Instruction *definition_of(const Register &reg);
+  size_t uses_of(const Register &reg) const;
+  size_t index_of(const Instruction &insn) const {
+    return size_t(&insn - mc.instructions.data());
+  }
+
+  // rules have to make their changes through these, which keep the
+  // definitions and use counts up to date and put whatever the change could
+  // have made a rule match on the worklist: the instruction itself, and the
+  // definitions of anything it stopped using
+  void replace(size_t index, const Instruction &insn);
+  void remove(size_t index) { replace(index, Instruction{Op::nop, {}}); }
+  void revisit(size_t index);
+};
+
+// a rule looks at the instruction at `index` (and whatever else it wants) and
+// rewrites things if it matches. Returns whether it changed anything.
+using Peephole_Rule = bool (*)(Peephole_Context &ctx, size_t index);
+
+// apply rules to every instruction, front to back, until none of them match
+// anymore. Instructions only get looked at again when something they depend
+// on changes, so this is linear in the size of the code (give or take how
+// many times the rules fire).
+void run_peephole_rules(Machine_Code &mc,
+                        const std::vector<Peephole_Rule> &rules);
+
+} // namespace sdfjit::machinecode::passes
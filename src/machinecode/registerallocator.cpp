@@ -1,5 +1,6 @@
 #include "registerallocator.h"
 
+#include <optional>
 #include <vector>
 
 #include "insertion_set.h"
@@ -7,6 +8,64 @@
 
 namespace sdfjit::machinecode {
 
+Linear_Scan_Register_Allocator
+Linear_Scan_Register_Allocator::for_target(const Target &target) {
+  Linear_Scan_Register_Allocator lsra{};
+  lsra.slot_size = target.vector_size();
+
+  switch (target.isa) {
+  case Isa::SSE41: {
+    lsra.machine_registers = {
+        Machine_Register::xmm0,  Machine_Register::xmm1,
+        Machine_Register::xmm2,  Machine_Register::xmm3,
+        Machine_Register::xmm4,  Machine_Register::xmm5,
+        Machine_Register::xmm6,  Machine_Register::xmm7,
+        Machine_Register::xmm8,  Machine_Register::xmm9,
+        Machine_Register::xmm10, Machine_Register::xmm11,
+        Machine_Register::xmm12,
+    };
+    lsra.temp_regs = {
+        Machine_Register::xmm13,
+        Machine_Register::xmm14,
+        Machine_Register::xmm15,
+    };
+    break;
+  }
+  case Isa::AVX2: {
+    // the defaults are already the ymm registers
+    break;
+  }
+  case Isa::AVX512: {
+    // EVEX gets us 32 registers
+    lsra.machine_registers = {
+        Machine_Register::zmm0,  Machine_Register::zmm1,
+        Machine_Register::zmm2,  Machine_Register::zmm3,
+        Machine_Register::zmm4,  Machine_Register::zmm5,
+        Machine_Register::zmm6,  Machine_Register::zmm7,
+        Machine_Register::zmm8,  Machine_Register::zmm9,
+        Machine_Register::zmm10, Machine_Register::zmm11,
+        Machine_Register::zmm12, Machine_Register::zmm13,
+        Machine_Register::zmm14, Machine_Register::zmm15,
+        Machine_Register::zmm16, Machine_Register::zmm17,
+        Machine_Register::zmm18, Machine_Register::zmm19,
+        Machine_Register::zmm20, Machine_Register::zmm21,
+        Machine_Register::zmm22, Machine_Register::zmm23,
+        Machine_Register::zmm24, Machine_Register::zmm25,
+        Machine_Register::zmm26, Machine_Register::zmm27,
+        Machine_Register::zmm28,
+    };
+    lsra.temp_regs = {
+        Machine_Register::zmm29,
+        Machine_Register::zmm30,
+        Machine_Register::zmm31,
+    };
+    break;
+  }
+  }
+
+  return lsra;
+}
+
 void Linear_Scan_Register_Allocator::allocate(Machine_Code &mc) {
   // machine regs that are available for allocation
   std::vector<Machine_Register> machine_regs_available(machine_registers);
@@ -21,8 +80,15 @@ void Linear_Scan_Register_Allocator::allocate(Machine_Code &mc) {
   std::vector<Virtual_Register> pending{};
   std::vector<Virtual_Register> in_use{};
   std::vector<Virtual_Register> dead{};
+  // registers whose machine register got handed over to another value at
+  // their death, so they shouldn't give it back
+  std::vector<Virtual_Register> donated{};
 
   compute_live_intervals(mc);
+  std::unordered_map<Virtual_Register, Live_Interval> intervals{};
+  for (const auto &interval : live_intervals) {
+    intervals[interval.reg.virtual_reg()] = interval;
+  }
 
   // I don't think this is textbook linear-scan, but it was a thing that made
   // sense to me. basically, we scan through the program, keeping 3 lists:
@@ -66,17 +132,60 @@ void Linear_Scan_Register_Allocator::allocate(Machine_Code &mc) {
     in_use.push_back(reg.virtual_reg());
   };
   auto add_to_dead = [&](Register reg) {
-    if (allocated_values.at(reg.virtual_reg()).is_machine()) {
+    bool was_donated = std::find(donated.begin(), donated.end(),
+                                 reg.virtual_reg()) != donated.end();
+    if (allocated_values.at(reg.virtual_reg()).is_machine() && !was_donated) {
       machine_regs_available.push_back(
           allocated_values.at(reg.virtual_reg()).machine_reg());
     }
     dead.push_back(reg.virtual_reg());
   };
   auto register_is_born_at = [&](Register reg, size_t time) -> bool {
-    return live_intervals.at(reg).first == time;
+    return intervals.at(reg.virtual_reg()).first == time;
   };
   auto register_dies_at = [&](Register reg, size_t time) -> bool {
-    return live_intervals.at(reg).last == time;
+    return intervals.at(reg.virtual_reg()).last == time;
+  };
+  // when we run out of registers, it's better to spill whatever is going to
+  // stay live the longest than whatever happens to be born last.
+  auto pick_spill_victim =
+      [&](Register reg, size_t time) -> std::optional<Virtual_Register> {
+    std::optional<Virtual_Register> victim{};
+    size_t victim_end = intervals.at(reg.virtual_reg()).last;
+    const auto &insn = mc.instructions[time];
+
+    for (auto candidate : in_use) {
+      const auto &alloc = allocated_values.find(candidate);
+      if (alloc == allocated_values.end() || !alloc->second.is_machine()) {
+        continue;
+      }
+      // don't pull the rug out from under the instruction we're working on
+      if (std::count(insn.registers.begin(), insn.registers.end(),
+                     Register::Virtual(candidate)) ||
+          std::count(insn.registers.begin(), insn.registers.end(),
+                     alloc->second)) {
+        continue;
+      }
+      // values that live across a loop's back edge have already been read
+      // out of their register earlier in the loop, and the next iteration
+      // will do that again, so they have to stay put for the whole loop
+      const auto &interval = intervals.at(candidate);
+      bool pinned = false;
+      for (const auto &[loop_start, loop_end] : loops) {
+        pinned |= interval.first < loop_start && interval.last >= loop_start &&
+                  loop_start < time && time <= loop_end;
+      }
+      if (pinned) {
+        continue;
+      }
+
+      if (interval.last > victim_end) {
+        victim = candidate;
+        victim_end = interval.last;
+      }
+    }
+
+    return victim;
   };
   auto materialize_register_at = [&](Register reg, size_t instruction_idx) {
     auto alloc_reg = allocated_values.at(reg.virtual_reg());
@@ -116,12 +225,25 @@ void Linear_Scan_Register_Allocator::allocate(Machine_Code &mc) {
       insn.replace_register(reg, temp_reg);
     }
   };
-  auto assign_slot = [&](Register reg) -> Register {
+  auto assign_slot = [&](Register reg, size_t time) -> Register {
+    if (allocated_values.count(reg.virtual_reg())) {
+      // already picked one for it (see the fma handling below)
+      return allocated_values.at(reg.virtual_reg());
+    }
+
     Register assigned;
     if (machine_regs_available.empty()) {
-      // XXX: dont' hardcode this size, grab it from mc
-      auto stack_slot = mc.stack_info.add_slot(256 / 8);
-      assigned = Register::Memory(Machine_Register::rsp, stack_slot);
+      auto stack_slot = mc.stack_info.add_slot(slot_size);
+      auto spilled = Register::Memory(Machine_Register::rsp, stack_slot);
+
+      if (auto victim = pick_spill_victim(reg, time)) {
+        // move the victim out to the stack, and take its register
+        assigned = allocated_values.at(*victim);
+        insertion_set.before.vmovaps(time, spilled, assigned);
+        allocated_values[*victim] = spilled;
+      } else {
+        assigned = spilled;
+      }
     } else {
       assigned = Register::Machine(machine_regs_available.back());
       machine_regs_available.pop_back();
@@ -134,6 +256,20 @@ void Linear_Scan_Register_Allocator::allocate(Machine_Code &mc) {
     const auto &insn = mc.instructions[i];
     temp_regs_available = temp_regs; // reset temp regs
 
+    // fmas accumulate into their destination, so if the addend dies here, put
+    // the result in the addend's register and save the assembler a move.
+    if (insn.is_fma()) {
+      const auto &result = insn.registers.at(0);
+      const auto &addend = insn.registers.at(1);
+      if (result.is_virtual() && addend.is_virtual() &&
+          register_is_born_at(result, i) && register_dies_at(addend, i) &&
+          allocated_values.at(addend.virtual_reg()).is_machine()) {
+        allocated_values[result.virtual_reg()] =
+            allocated_values.at(addend.virtual_reg());
+        donated.push_back(addend.virtual_reg());
+      }
+    }
+
     for (const auto &reg : insn.registers) {
       // we're only worried about virtual registers
       if (!reg.is_virtual())
@@ -143,7 +279,7 @@ void Linear_Scan_Register_Allocator::allocate(Machine_Code &mc) {
         // pending -> in_use
         remove_from_pending(reg);
         add_to_in_use(reg);
-        assign_slot(reg);
+        assign_slot(reg, i);
       } else if (register_dies_at(reg, i)) {
         // in_use -> dead
         remove_from_in_use(reg);
@@ -174,6 +310,30 @@ void Linear_Scan_Register_Allocator::compute_live_intervals(Machine_Code &mc) {
       }
     }
   }
+
+  // anything that's defined before a loop and used inside it has to survive
+  // until the jump back, since the next iteration will want it again
+  std::unordered_map<uint64_t, size_t> labels{};
+  for (size_t i = 0; i < mc.instructions.size(); i++) {
+    auto &insn = mc.instructions[i];
+    if (insn.op == Op::label) {
+      labels[uint64_t(insn.registers.at(0).imm())] = i;
+    } else if (insn.op == Op::jg) {
+      auto target = labels.find(uint64_t(insn.registers.at(0).imm()));
+      if (target == labels.end()) {
+        // forward jump, nothing to do
+        continue;
+      }
+
+      auto loop_start = target->second;
+      loops.push_back({loop_start, i});
+      for (auto &interval : live_intervals) {
+        if (interval.first < loop_start && interval.last >= loop_start) {
+          interval.last = std::max(interval.last, i);
+        }
+      }
+    }
+  }
 }
 
 } // namespace sdfjit::machinecode
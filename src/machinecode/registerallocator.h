@@ -1,7 +1,9 @@
 #pragma once
 
 #include <algorithm>
+#include <cstddef>
 #include <unordered_map>
+#include <vector>
 
 #include "machinecode.h"
 
@@ -17,34 +19,30 @@ struct Live_Interval {
 };
 
 struct Live_Interval_List {
+  // (only virtual registers get live intervals)
   std::vector<Live_Interval> intervals{};
+  // where each register's interval is in `intervals`
+  std::unordered_map<Virtual_Register, size_t> indexes{};
 
   Live_Interval &at(const Register &reg) {
-    for (Live_Interval &interval : intervals) {
-      if (interval.reg == reg) {
-        return interval;
-      }
+    auto index = indexes.find(reg.virtual_reg());
+    if (index == indexes.end()) {
+      abort();
     }
-    abort();
+    return intervals[index->second];
   }
 
   Live_Interval &operator[](const Register &reg) {
-    for (Live_Interval &interval : intervals) {
-      if (interval.reg == reg) {
-        return interval;
-      }
+    auto [index, inserted] =
+        indexes.try_emplace(reg.virtual_reg(), intervals.size());
+    if (inserted) {
+      intervals.push_back(Live_Interval{reg});
     }
-    intervals.push_back(Live_Interval{reg});
-    return intervals.back();
+    return intervals[index->second];
   }
 
   bool contains(const Register &reg) {
-    for (Live_Interval &interval : intervals) {
-      if (interval.reg == reg) {
-        return true;
-      }
-    }
-    return false;
+    return indexes.count(reg.virtual_reg()) > 0;
   }
 
   std::vector<Register> registers_live_at(size_t time) {
@@ -59,11 +57,42 @@ struct Live_Interval_List {
     return result;
   }
 
+  // the most registers that are live at the same time anywhere in
+  // [begin, end). Same as the biggest registers_live_at(), but in one sweep
+  // over where the intervals start and end.
+  size_t max_live_between(size_t begin, size_t end) const {
+    if (begin >= end) {
+      return 0;
+    }
+
+    // how many more (or fewer) registers are live at each point than just
+    // before it
+    std::vector<ptrdiff_t> changes(end - begin + 1);
+    for (const auto &interval : intervals) {
+      if (interval.last < begin || interval.first >= end) {
+        continue;
+      }
+      changes[std::max(interval.first, begin) - begin]++;
+      changes[std::min(interval.last + 1, end) - begin]--;
+    }
+
+    ptrdiff_t live = 0;
+    ptrdiff_t most = 0;
+    for (size_t i = 0; i < end - begin; i++) {
+      live += changes[i];
+      most = std::max(most, live);
+    }
+    return size_t(most);
+  }
+
   Live_Interval_List sorted_by_start_point() const {
     Live_Interval_List result{intervals};
     std::sort(
         result.intervals.begin(), result.intervals.end(),
         [](Live_Interval &a, Live_Interval &b) { return a.first < b.first; });
+    for (size_t i = 0; i < result.intervals.size(); i++) {
+      result.indexes[result.intervals[i].reg.virtual_reg()] = i;
+    }
     return result;
   }
 
@@ -73,23 +102,32 @@ struct Live_Interval_List {
 };
 
 struct Linear_Scan_Register_Allocator {
+  static Linear_Scan_Register_Allocator for_target(const Target &target);
+
   void allocate(Machine_Code &mc);
   void compute_live_intervals(Machine_Code &mc);
 
   Live_Interval_List live_intervals{};
+  // (label, jump back to it) for every loop in the program
+  std::vector<std::pair<size_t, size_t>> loops{};
 
+  // size of a stack slot for a spilled register
+  size_t slot_size{256 / 8};
   // registers we can use for anything
   std::vector<Machine_Register> machine_registers{
-      Machine_Register::ymm0, Machine_Register::ymm1, Machine_Register::ymm2,
-      Machine_Register::ymm3, Machine_Register::ymm4,
+      Machine_Register::ymm0,  Machine_Register::ymm1,  Machine_Register::ymm2,
+      Machine_Register::ymm3,  Machine_Register::ymm4,  Machine_Register::ymm5,
+      Machine_Register::ymm6,  Machine_Register::ymm7,  Machine_Register::ymm8,
+      Machine_Register::ymm9,  Machine_Register::ymm10, Machine_Register::ymm11,
+      Machine_Register::ymm12,
   };
   // reserved register for holding spilled values while being worked on
   // we need to reserve at least as many registers as the largest number of
   // parameters an instruction can take so we can load them all if needed
   std::vector<Machine_Register> temp_regs{
-      Machine_Register::ymm5,
-      Machine_Register::ymm6,
-      Machine_Register::ymm7,
+      Machine_Register::ymm13,
+      Machine_Register::ymm14,
+      Machine_Register::ymm15,
   };
 };
 
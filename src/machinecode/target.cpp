@@ -0,0 +1,196 @@
+#include "target.h"
+
+#include <cpuid.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace sdfjit::machinecode {
+
+std::ostream &operator<<(std::ostream &os, Isa isa) {
+#define TARGET_ISA_TOSTRING(isa_name, ...)                                     \
+  case Isa::isa_name:                                                          \
+    return os << #isa_name;
+  switch (isa) { FOREACH_TARGET_ISA(TARGET_ISA_TOSTRING); }
+  abort();
+#undef TARGET_ISA_TOSTRING
+}
+
+std::ostream &operator<<(std::ostream &os, Precision precision) {
+#define PRECISION_TOSTRING(precision_name)                                     \
+  case Precision::precision_name:                                              \
+    return os << #precision_name;
+  switch (precision) { FOREACH_PRECISION(PRECISION_TOSTRING); }
+  abort();
+#undef PRECISION_TOSTRING
+}
+
+const Sin_Cos_Coefficients &sin_cos_coefficients(Precision precision) {
+  // minimax fits on [-pi/4, pi/4] (relative error for sin, absolute for cos)
+  static const Sin_Cos_Coefficients fast{
+      {1.5703125f, 4.8382679e-4f},
+      {9.9959182823e-01f, -1.6153563982e-01f},
+      {9.9999004194e-01f, -4.9970818572e-01f, 4.0398594847e-02f},
+  };
+  static const Sin_Cos_Coefficients medium{
+      {1.5703125f, 4.8382679e-4f},
+      {9.9999849394e-01f, -1.6662382978e-01f, 8.1500651543e-03f},
+      {9.9999997244e-01f, -4.9999856722e-01f, 4.1655027739e-02f,
+       -1.3585916433e-03f},
+  };
+  static const Sin_Cos_Coefficients accurate{
+      {1.5703125f, 4.837512969970703125e-4f, 7.54978995489188216e-8f},
+      {1.0f, -1.6666650227e-01f, 8.3320165493e-03f, -1.9501830850e-04f},
+      {1.0f, -4.9999999615e-01f, 4.1666616681e-02f, -1.3886617728e-03f,
+       2.4379811077e-05f},
+  };
+
+  switch (precision) {
+  case Precision::Fast:
+    return fast;
+  case Precision::Medium:
+    return medium;
+  case Precision::Accurate:
+    return accurate;
+  }
+  abort();
+}
+
+size_t Target::lanes() const {
+#define TARGET_ISA_LANES(isa_name, lanes)                                      \
+  case Isa::isa_name:                                                          \
+    return lanes;
+  switch (isa) { FOREACH_TARGET_ISA(TARGET_ISA_LANES); }
+  abort();
+#undef TARGET_ISA_LANES
+}
+
+namespace {
+
+struct Cpu_Features {
+  bool sse41{false};
+  bool avx2{false};
+  bool fma{false};
+  bool avx512f{false};
+  // whether the OS saves the ymm / zmm + opmask state across context switches
+  bool os_ymm{false};
+  bool os_zmm{false};
+};
+
+Cpu_Features detect_cpu_features() {
+  Cpu_Features features{};
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return features;
+  }
+  features.sse41 = ecx & bit_SSE4_1;
+  features.fma = ecx & bit_FMA;
+
+  if (ecx & bit_OSXSAVE) {
+    // xgetbv(0) gives us XCR0, which says which register state the OS has
+    // enabled. We do this by hand so we don't need to build with -mxsave.
+    uint32_t xcr0_lo, xcr0_hi;
+    asm volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    // SSE + AVX state
+    features.os_ymm = (xcr0_lo & 0x06) == 0x06;
+    // opmask + upper half of zmm0-15 + zmm16-31 state
+    features.os_zmm = features.os_ymm && (xcr0_lo & 0xe0) == 0xe0;
+  }
+
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    features.avx2 = ebx & bit_AVX2;
+    features.avx512f = ebx & bit_AVX512F;
+  }
+
+  return features;
+}
+
+const Cpu_Features &cpu_features() {
+  static const Cpu_Features features = detect_cpu_features();
+  return features;
+}
+
+} // namespace
+
+bool Target::is_supported() const {
+  const auto &features = cpu_features();
+  switch (isa) {
+  case Isa::SSE41:
+    return features.sse41;
+  case Isa::AVX2:
+    // the raytracer (and our codegen) assume fma is around with avx2
+    return features.avx2 && features.fma && features.os_ymm;
+  case Isa::AVX512:
+    return features.avx512f && features.os_zmm;
+  }
+  abort();
+}
+
+Target Target::host() {
+  // pick the widest thing we can run
+  Target best{Isa::SSE41};
+#define PICK_WIDEST_TARGET(isa_name, ...)                                      \
+  if (Target{Isa::isa_name}.is_supported()) {                                  \
+    best = Target{Isa::isa_name};                                              \
+  }
+  FOREACH_TARGET_ISA(PICK_WIDEST_TARGET);
+#undef PICK_WIDEST_TARGET
+
+  if (!best.is_supported()) {
+    std::cerr << "sdfjit needs a cpu with at least SSE4.1" << std::endl;
+    abort();
+  }
+
+  // allow forcing a narrower target, mostly for testing the other backends
+  if (const char *forced = getenv("SDFJIT_ISA")) {
+    bool found = false;
+#define PICK_FORCED_TARGET(isa_name, ...)                                      \
+  if (strcmp(forced, #isa_name) == 0 &&                                        \
+      Target{Isa::isa_name}.is_supported()) {                                  \
+    best = Target{Isa::isa_name};                                              \
+    found = true;                                                              \
+  }
+    FOREACH_TARGET_ISA(PICK_FORCED_TARGET);
+#undef PICK_FORCED_TARGET
+
+    if (!found) {
+      std::cerr << "Ignoring unsupported SDFJIT_ISA=" << forced << std::endl;
+    }
+  }
+
+  if (const char *interleave = getenv("SDFJIT_INTERLEAVE")) {
+    auto n = strtoul(interleave, nullptr, 10);
+    if (1 <= n && n <= max_interleave) {
+      best.interleave = n;
+    } else {
+      std::cerr << "Ignoring SDFJIT_INTERLEAVE=" << interleave
+                << ", it needs to be between 1 and " << max_interleave
+                << std::endl;
+    }
+  }
+
+  if (const char *precision = getenv("SDFJIT_PRECISION")) {
+    bool found = false;
+#define PICK_PRECISION(precision_name)                                         \
+  if (strcmp(precision, #precision_name) == 0) {                               \
+    best.precision = Precision::precision_name;                                \
+    found = true;                                                              \
+  }
+    FOREACH_PRECISION(PICK_PRECISION);
+#undef PICK_PRECISION
+
+    if (!found) {
+      std::cerr << "Ignoring unknown SDFJIT_PRECISION=" << precision
+                << std::endl;
+    }
+  }
+
+  if (const char *fast_math = getenv("SDFJIT_FAST_MATH")) {
+    best.fast_math = strcmp(fast_math, "1") == 0;
+  }
+
+  return best;
+}
+
+} // namespace sdfjit::machinecode
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+namespace sdfjit::machinecode {
+
+// clang-format off
+// macro(isa_name, lanes)
+#define FOREACH_TARGET_ISA(macro) \
+    macro(SSE41, 4) \
+    macro(AVX2, 8) \
+    macro(AVX512, 16)
+
+// how hard transcendental functions (sin, cos) try to get the right answer.
+// macro(precision_name)
+#define FOREACH_PRECISION(macro) \
+    macro(Fast) \
+    macro(Medium) \
+    macro(Accurate)
+// clang-format on
+
+#define TARGET_ISA_ENUM(isa_name, ...) isa_name,
+enum class Isa { FOREACH_TARGET_ISA(TARGET_ISA_ENUM) };
+#undef TARGET_ISA_ENUM
+std::ostream &operator<<(std::ostream &os, Isa isa);
+
+#define PRECISION_ENUM(precision_name) precision_name,
+enum class Precision { FOREACH_PRECISION(PRECISION_ENUM) };
+#undef PRECISION_ENUM
+std::ostream &operator<<(std::ostream &os, Precision precision);
+
+// what sin and cos get worked out with at each Precision: r = x - k * pi/2
+// (k rounded), then a polynomial in r for each (see
+// Machine_Code::sin_quadrants). The interpreter uses the same ones, so that it
+// gets the same answers as the kernels.
+struct Sin_Cos_Coefficients {
+  // pi/2, split up
+  std::vector<float> pi_over_two;
+  // sin(r) = r * (s0 + s1 r^2 + s2 r^4 + ...)
+  std::vector<float> sin;
+  // cos(r) = c0 + c1 r^2 + c2 r^4 + ...
+  std::vector<float> cos;
+};
+const Sin_Cos_Coefficients &sin_cos_coefficients(Precision precision);
+
+// The instruction set we're generating kernels for. Lowering, register
+// allocation, the assembler and the raytracer's lane stride all key off of
+// this.
+struct Target {
+  static constexpr size_t max_interleave = 4;
+
+  Isa isa{Isa::AVX2};
+  // how many independent vectors each trip around the kernel loop evaluates.
+  // Their instructions get interleaved, so the cpu has something else to do
+  // while it waits on a long sqrt/div chain from one of them.
+  size_t interleave{1};
+  // Fast is good to about 3e-4, Medium to about 1e-6, and Accurate to about
+  // an ulp (for arguments that aren't enormous)
+  Precision precision{Precision::Medium};
+  // turn divides by a constant into a multiply by its reciprocal, which can be
+  // an ulp off the correctly rounded quotient. Everything else (including
+  // sqrt, and the divide inside mod) always uses the exact instructions: the
+  // approximate vrcpps/vrsqrtps versions plus a newton step didn't make whole
+  // kernels any faster.
+  bool fast_math{false};
+
+  // number of floats in one vector register
+  size_t lanes() const;
+  // number of floats the kernel processes per trip around its loop
+  size_t batch_size() const { return lanes() * interleave; }
+  // size (in bytes) of one vector register
+  size_t vector_size() const { return lanes() * sizeof(float); }
+
+  // whether we can emit fused multiply-adds
+  bool has_fma() const { return isa != Isa::SSE41; }
+
+  // whether the cpu we're running on can execute kernels for this target
+  bool is_supported() const;
+
+  // the widest target the cpu we're running on supports. This can be lowered
+  // (but not raised) by setting SDFJIT_ISA to the name of an Isa, and
+  // SDFJIT_INTERLEAVE picks the interleave factor. SDFJIT_PRECISION can be set
+  // to the name of a Precision, and SDFJIT_FAST_MATH=1 turns on fast_math.
+  static Target host();
+};
+
+} // namespace sdfjit::machinecode
@@ -1,23 +1,33 @@
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <vector>
 
 #include "ast/ast.h"
 #include "ast/opt.h"
 #include "bytecode/bytecode.h"
 #include "bytecode/opt.h"
+#include "machinecode/aot.h"
 #include "machinecode/assembler.h"
 #include "machinecode/executor.h"
+#include "machinecode/executorcache.h"
 #include "machinecode/machinecode.h"
 #include "machinecode/opt.h"
 #include "profiling/frame_counter.h"
 #include "profiling/perf_map_writer.h"
+#include "raytracer/backgroundcompiler.h"
 #include "raytracer/raytracer.h"
+#include "staticscene/staticscene.h"
 #include "util/hexdump.h"
 
-sdfjit::ast::Ast ast_at(size_t t) {
+// the boxes spin, by setting these uniforms each frame (see set_time)
+sdfjit::ast::Ast animated_scene() {
   sdfjit::ast::Ast ast{};
   auto pos = ast.pos3(sdfjit::ast::IN_X, sdfjit::ast::IN_Y,
                       sdfjit::ast::IN_Z); // x, y, z input parameters.
@@ -25,13 +35,17 @@ sdfjit::ast::Ast ast_at(size_t t) {
   pos = ast.translate(pos, 0.0f, 0.0f, -200.0f);
 
   auto merged =
-      ast.add(ast.box(ast.rotate(pos, 0.0f, t / 20.0f, 0.0f), 10.0f, 20.0f,
-                      30.0f, 2.0f),
+      ast.add(ast.box(ast.rotate(pos, ast.pos3(ast.float32(0.0f),
+                                               ast.uniform("box_spin_y"),
+                                               ast.float32(0.0f))),
+                      10.0f, 20.0f, 30.0f, 2.0f),
               ast.sphere(ast.translate(pos, 30.0f, 30.0f, 30.0f), 6.0f, 1.0f));
 
   merged = ast.add(
       merged, ast.box(ast.rotate(ast.translate(pos, -60.0f, -60.0f, -60.0f),
-                                 t / 10.0f, t / 30.0f, 0.0f),
+                                 ast.pos3(ast.uniform("cube_spin_x"),
+                                          ast.uniform("cube_spin_y"),
+                                          ast.float32(0.0f))),
                       20.0f, 20.0f, 20.0f, 3.0f));
 
   auto floor = ast.plane(ast.translate(pos, 0.0f, -200.0f, 0.0f),
@@ -42,7 +56,281 @@ sdfjit::ast::Ast ast_at(size_t t) {
   return ast;
 }
 
+// the same scene, built at compile time. The uniforms are in the order the
+// Ast ends up with them (see static_uniforms).
+namespace animated_static_scene {
+using namespace sdfjit::staticscene;
+
+constexpr size_t box_spin_y = 0;
+constexpr size_t cube_spin_y = 1;
+constexpr size_t cube_spin_x = 2;
+
+constexpr auto pos = translate(pos3(IN_X, IN_Y, IN_Z), 0.0f, 0.0f, -200.0f);
+constexpr auto scene = add(
+    add(add(box(rotate(pos, pos3(0.0f, uniform(box_spin_y), 0.0f)), 10.0f,
+                20.0f, 30.0f, 2.0f),
+            sphere(translate(pos, 30.0f, 30.0f, 30.0f), 6.0f, 1.0f)),
+        box(rotate(translate(pos, -60.0f, -60.0f, -60.0f),
+                   pos3(uniform(cube_spin_x), uniform(cube_spin_y), 0.0f)),
+            20.0f, 20.0f, 20.0f, 3.0f)),
+    plane(translate(pos, 0.0f, -200.0f, 0.0f), pos3(0.0f, 1.0f, 0.0f), 4.0f));
+} // namespace animated_static_scene
+
+void set_time(sdfjit::raytracer::Raytracer &rt, size_t t) {
+  rt.set_uniform("box_spin_y", t / 20.0f);
+  rt.set_uniform("cube_spin_x", t / 10.0f);
+  rt.set_uniform("cube_spin_y", t / 30.0f);
+}
+
+// lots of distinct primitives, so there's plenty of machine code to assemble
+sdfjit::ast::Ast big_scene(size_t primitives) {
+  sdfjit::ast::Ast ast{};
+  auto pos = ast.pos3(sdfjit::ast::IN_X, sdfjit::ast::IN_Y, sdfjit::ast::IN_Z);
+
+  auto merged = ast.plane(pos, ast.pos3(0.0f, 1.0f, 0.0f), 4.0f);
+  for (size_t i = 0; i < primitives; i++) {
+    auto offset = float(i);
+    auto moved = ast.translate(pos, offset, -offset, 2.0f * offset);
+    auto primitive =
+        i % 2 ? ast.sphere(moved, 1.0f + offset, 1.0f)
+              : ast.box(ast.rotate(moved, offset, 0.5f * offset, 0.0f),
+                        offset, 2.0f, 3.0f, 2.0f);
+    merged = ast.add(merged, primitive);
+  }
+
+  return ast;
+}
+
+// times every stage of compiling a scene, from the ast down to a kernel in the
+// code heap, and then the assembler on its own
+void benchmark_assembler() {
+  using Clock = std::chrono::steady_clock;
+  auto seconds_since = [](Clock::time_point begin) {
+    return std::chrono::duration<double>(Clock::now() - begin).count();
+  };
+
+  for (size_t primitives : {10, 100, 1000}) {
+    auto ast = big_scene(primitives);
+    sdfjit::ast::opt::optimize(ast);
+
+    std::vector<std::pair<const char *, double>> stages{};
+    auto stage = [&](const char *name, auto &&run) {
+      auto begin = Clock::now();
+      run();
+      stages.push_back({name, seconds_since(begin)});
+    };
+
+    sdfjit::bytecode::Bytecode bc{};
+    stage("bytecode", [&] {
+      bc = sdfjit::bytecode::Bytecode::from_ast(ast);
+      sdfjit::bytecode::optimize(bc);
+    });
+    sdfjit::machinecode::Machine_Code mc{};
+    stage("from_bytecode", [&] {
+      mc = sdfjit::machinecode::Machine_Code::from_bytecode(
+          bc, sdfjit::machinecode::Target::host());
+    });
+    stage("early_optimize",
+          [&] { sdfjit::machinecode::early_optimize(mc); });
+    stage("resolve_immediates", [&] { mc.resolve_immediates(); });
+    stage("allocate_registers", [&] { mc.allocate_registers(); });
+    stage("prologue and epilogue", [&] { mc.add_prologue_and_epilogue(); });
+    stage("optimize", [&] { sdfjit::machinecode::optimize(mc); });
+    sdfjit::machinecode::Executor exec{};
+    exec.mc = mc;
+    stage("create", [&] { exec.create(); });
+
+    double compile_time = 0;
+    for (const auto &[name, time] : stages) {
+      compile_time += time;
+    }
+    std::cout << primitives << " primitives, " << ast.nodes.size()
+              << " ast nodes, " << bc.nodes.size() << " bytecode nodes, "
+              << mc.instructions.size() << " instructions (compiled in "
+              << compile_time * 1e3 << " ms):" << std::endl;
+    for (const auto &[name, time] : stages) {
+      std::cout << "  " << name << ": " << time * 1e3 << " ms" << std::endl;
+    }
+
+    for (bool record_offsets : {true, false}) {
+      // keep going until we've got a decent amount of time to divide up
+      size_t iterations = 0;
+      size_t bytes = 0;
+      auto begin = Clock::now();
+      do {
+        sdfjit::machinecode::Assembler assembler{mc};
+        assembler.record_offsets = record_offsets;
+        assembler.assemble();
+        bytes = assembler.buffer.size();
+        iterations++;
+      } while (seconds_since(begin) < 0.5);
+      auto per_iteration = seconds_since(begin) / iterations;
+
+      std::cout << "  assembler " << (record_offsets ? "with" : "without")
+                << " offsets: " << per_iteration * 1e6 << " us, "
+                << per_iteration * 1e9 / mc.instructions.size()
+                << " ns/instruction, " << bytes / per_iteration / 1e6
+                << " MB/s" << std::endl;
+    }
+  }
+}
+
+// the static version of the animation's scene against the compiled one. The
+// static one is only as wide as this file is compiled for (see staticscene.h).
+void benchmark_static_scene() {
+  using Clock = std::chrono::steady_clock;
+  namespace scene = animated_static_scene;
+
+  auto ast = animated_scene();
+  sdfjit::ast::opt::optimize(ast);
+  auto rt = sdfjit::raytracer::Raytracer::from_ast(ast);
+  set_time(rt, 17);
+  float static_uniforms[3];
+  static_uniforms[scene::box_spin_y] =
+      rt.uniforms.at(ast.uniform_index("box_spin_y"));
+  static_uniforms[scene::cube_spin_y] =
+      rt.uniforms.at(ast.uniform_index("cube_spin_y"));
+  static_uniforms[scene::cube_spin_x] =
+      rt.uniforms.at(ast.uniform_index("cube_spin_x"));
+
+  // the kernels want their arrays aligned to a vector
+  size_t count = 1 << 16;
+  using Buffer = std::unique_ptr<float[], decltype(&free)>;
+  auto make_buffer = [&]() {
+    return Buffer((float *)aligned_alloc(64, count * sizeof(float)), &free);
+  };
+  auto xs = make_buffer(), ys = make_buffer(), zs = make_buffer();
+  for (size_t i = 0; i < count; i++) {
+    xs[i] = float(i % 64) * 10.0f - 320.0f;
+    ys[i] = float(i / 64 % 32) * 10.0f - 160.0f;
+    zs[i] = float(i / 2048) * -10.0f;
+  }
+
+  auto time = [&](auto &&evaluate) {
+    size_t iterations = 0;
+    auto begin = Clock::now();
+    do {
+      evaluate();
+      iterations++;
+    } while (Clock::now() - begin < std::chrono::milliseconds(500));
+    return std::chrono::duration<double>(Clock::now() - begin).count() /
+           iterations / count * 1e9;
+  };
+
+  auto jit_distances = make_buffer(), jit_materials = make_buffer();
+  auto jit_time = time([&] {
+    rt.evaluate(xs.get(), ys.get(), zs.get(), jit_distances.get(),
+                jit_materials.get(), count);
+  });
+  auto static_distances = make_buffer(), static_materials = make_buffer();
+  auto static_time = time([&] {
+    sdfjit::staticscene::kernel<scene::scene>(
+        xs.get(), ys.get(), zs.get(), static_uniforms, static_distances.get(),
+        static_materials.get(), count);
+  });
+
+  float max_difference = 0;
+  size_t materials_differ = 0;
+  for (size_t i = 0; i < count; i++) {
+    max_difference = std::max(
+        max_difference, std::fabs(jit_distances[i] - static_distances[i]));
+    materials_differ += !sdfjit::util::floats_equal(jit_materials[i],
+                                                    static_materials[i]);
+  }
+
+  std::cout << "jit (" << rt.exec->mc.target.isa << "): " << jit_time
+            << " ns/point" << std::endl;
+  std::cout << "static (" << sdfjit::staticscene::lanes
+            << " lanes): " << static_time << " ns/point" << std::endl;
+  std::cout << "distances differ by up to " << max_difference << ", "
+            << materials_differ << " materials differ" << std::endl;
+}
+
+// everything from_bytecode onwards, for the kernels that don't go through a
+// Raytracer
+sdfjit::machinecode::Machine_Code
+compile_kernel(const sdfjit::bytecode::Bytecode &bc) {
+  auto mc = sdfjit::machinecode::Machine_Code::from_bytecode(
+      bc, sdfjit::machinecode::Target::host());
+  sdfjit::machinecode::early_optimize(mc);
+  mc.resolve_immediates();
+  mc.allocate_registers();
+  mc.add_prologue_and_epilogue();
+  sdfjit::machinecode::optimize(mc);
+  return mc;
+}
+
+// splits the space in front of the camera up into boxes, and asks the
+// interval version of the animation's scene which of them the surface could
+// be in. The rest could be skipped over when tracing.
+void benchmark_intervals() {
+  using Clock = std::chrono::steady_clock;
+
+  auto ast = animated_scene();
+  sdfjit::ast::opt::optimize(ast);
+  auto rt = sdfjit::raytracer::Raytracer::from_ast(ast);
+  set_time(rt, 17);
+
+  auto bc = sdfjit::bytecode::Bytecode::from_ast(
+      ast, sdfjit::bytecode::Outputs::Distance_Interval);
+  sdfjit::bytecode::optimize(bc);
+  sdfjit::machinecode::Executor exec{};
+  exec.mc = compile_kernel(bc);
+  exec.create();
+
+  // 32 x 24 x 32 boxes, 20 units on a side, which is a multiple of every
+  // target's lanes()
+  static constexpr float size = 20.0f;
+  static constexpr size_t width = 32, height = 24, depth = 32;
+  const size_t count = width * height * depth;
+  const size_t lanes = exec.lanes();
+  using Buffer = std::unique_ptr<float[], decltype(&free)>;
+  auto make_buffer = [&]() {
+    return Buffer((float *)aligned_alloc(64, 2 * count * sizeof(float)),
+                  &free);
+  };
+  auto xs = make_buffer(), ys = make_buffer(), zs = make_buffer();
+  auto distances = make_buffer();
+  // (see Executor::call_intervals)
+  auto lower = [&](size_t box) {
+    return box / lanes * 2 * lanes + box % lanes;
+  };
+  for (size_t box = 0; box < count; box++) {
+    auto x = float(box % width) * size - width * size / 2;
+    auto y = float(box / width % height) * size - height * size / 2;
+    auto z = float(box / width / height) * -size;
+    xs[lower(box)] = x;
+    xs[lower(box) + lanes] = x + size;
+    ys[lower(box)] = y;
+    ys[lower(box) + lanes] = y + size;
+    zs[lower(box)] = z - size;
+    zs[lower(box) + lanes] = z;
+  }
+
+  size_t iterations = 0;
+  auto begin = Clock::now();
+  do {
+    exec.call_intervals(xs.get(), ys.get(), zs.get(), distances.get(), count,
+                        rt.uniforms.data());
+    iterations++;
+  } while (Clock::now() - begin < std::chrono::milliseconds(500));
+  auto time = std::chrono::duration<double>(Clock::now() - begin).count() /
+              iterations / count * 1e9;
+
+  size_t empty = 0;
+  for (size_t box = 0; box < count; box++) {
+    empty += distances[lower(box)] > 0;
+  }
+  std::cout << "intervals (" << exec.mc.target.isa << "): " << time
+            << " ns/box, " << empty << " of " << count
+            << " boxes can't have any surface in them" << std::endl;
+}
+
 void dump_all_parts(sdfjit::ast::Ast &ast) {
+  std::cout << "Target: " << sdfjit::machinecode::Target::host().isa << " ("
+            << sdfjit::machinecode::Target::host().precision << " precision)"
+            << std::endl;
+  std::cout << "=====================" << std::endl;
   std::cout << "AST (sexpr):" << std::endl;
   ast.dump_sexpr(std::cout);
   std::cout << "=====================" << std::endl;
@@ -62,7 +350,13 @@ void dump_all_parts(sdfjit::ast::Ast &ast) {
 
   std::cout << "Machine Code (imms inline, before register alloc):"
             << std::endl;
-  auto mc = sdfjit::machinecode::Machine_Code::from_bytecode(bc);
+  auto mc = sdfjit::machinecode::Machine_Code::from_bytecode(
+      bc, sdfjit::machinecode::Target::host());
+  std::cout << mc;
+  std::cout << "=====================" << std::endl;
+
+  std::cout << "Machine Code (early optimizations applied):" << std::endl;
+  sdfjit::machinecode::early_optimize(mc);
   std::cout << mc;
   std::cout << "=====================" << std::endl;
 
@@ -121,13 +415,26 @@ void render_animation() {
   mkdir("jits", 0777);
 
   Frame_Counter fps{};
-  for (size_t t = 0; t < 300; t++) {
-    auto ast = ast_at(t);
-    sdfjit::ast::opt::optimize(ast);
 
-    auto rt = sdfjit::raytracer::Raytracer::from_ast(ast);
-    sdfjit::profiling::add_perf_map_region(rt.exec,
-                                           "frame" + std::to_string(t));
+  // only the uniforms change from frame to frame, so one kernel does for all
+  // of them
+  auto ast = animated_scene();
+  sdfjit::ast::opt::optimize(ast);
+  auto rt = sdfjit::raytracer::Raytracer::from_ast(ast);
+  // (there's no kernel if SDFJIT_INTERPRET is set)
+  if (rt.exec) {
+    sdfjit::profiling::add_perf_map_region(*rt.exec, "animation");
+    sdfjit::profiling::add_perf_map_region(*rt.material_exec,
+                                           "animation materials");
+    sdfjit::profiling::add_perf_map_region(*rt.prepare_normals().exec,
+                                           "animation normals");
+    std::fstream out("jits/jit.txt", std::fstream::out);
+    out << rt.exec->mc;
+    out.close();
+  }
+
+  for (size_t t = 0; t < 300; t++) {
+    set_time(rt, t);
     rt.trace_image(0, 0, 0, 0, 0, 0, width, height, screen);
 
     {
@@ -145,27 +452,130 @@ void render_animation() {
       out.close();
     }
 
-    {
-      std::fstream out("jits/jit" + std::to_string(t) + ".txt",
-                       std::fstream::out);
-      out << rt.exec.mc;
-      out.close();
+    std::cout << "done with frame " << t << std::endl;
+    fps.tick_frame();
+  }
+  fps.stop();
+  const auto &executors = sdfjit::machinecode::Executor_Cache::global();
+  std::cout << "kernel cache: " << executors.hits << " hits, "
+            << executors.misses << " misses" << std::endl;
+  std::cout << "done rendering at " << fps.fps() << " fps" << std::endl;
+}
+
+// the animated scene with some more spheres in it, as if someone's been
+// adding them one at a time
+sdfjit::ast::Ast edited_scene(size_t spheres) {
+  auto ast = animated_scene();
+  auto merged = ast.root_node_id();
+  for (size_t i = 0; i < spheres; i++) {
+    // (the root has to stay the last node, so this can't go before the loop)
+    auto pos =
+        ast.pos3(sdfjit::ast::IN_X, sdfjit::ast::IN_Y, sdfjit::ast::IN_Z);
+    auto moved = ast.translate(pos, -90.0f + 20.0f * i, 60.0f, -200.0f);
+    merged = ast.add(merged, ast.sphere(moved, 8.0f, 1.0f));
+  }
+  return ast;
+}
+
+// keep rendering while the scene gets edited every few frames. The edits get
+// compiled off to the side, so no frame should have to wait for one.
+void live_preview() {
+  using Clock = std::chrono::steady_clock;
+  size_t width = 320;
+  size_t height = 240;
+  uint32_t *screen = (uint32_t *)malloc(width * height * sizeof(uint32_t));
+
+  sdfjit::raytracer::Background_Compiler compiler{};
+  // there's nothing to show until the first one is done
+  compiler.submit(edited_scene(0));
+  compiler.wait_until_idle();
+
+  Frame_Counter fps{};
+  double slowest_frame = 0;
+  size_t kernels_used = 0;
+  std::shared_ptr<const sdfjit::raytracer::Raytracer> last{};
+  for (size_t t = 0; t < 100; t++) {
+    if (t % 10 == 9) {
+      compiler.submit(edited_scene(t / 10 + 1));
     }
 
-    std::cout << "done with frame " << t << std::endl;
+    auto begin = Clock::now();
+    auto current = compiler.raytracer();
+    if (current != last) {
+      kernels_used++;
+      last = current;
+    }
+    // our own copy, so we can set the uniforms
+    auto rt = *current;
+    set_time(rt, t);
+    rt.trace_image(0, 0, 0, 0, 0, 0, width, height, screen);
+    slowest_frame = std::max(
+        slowest_frame,
+        std::chrono::duration<double>(Clock::now() - begin).count());
     fps.tick_frame();
   }
   fps.stop();
+
+  std::cout << "rendered with " << kernels_used << " kernels, slowest frame "
+            << slowest_frame * 1e3 << " ms" << std::endl;
   std::cout << "done rendering at " << fps.fps() << " fps" << std::endl;
+  free(screen);
+}
+
+// compiles the animation's scene and writes it out to be linked in somewhere
+// else: an object file if `path` ends in .o, and assembly source otherwise
+void export_kernel(const std::string &path, const std::string &symbol) {
+  auto ast = animated_scene();
+  sdfjit::ast::opt::optimize(ast);
+  auto bc = sdfjit::bytecode::Bytecode::from_ast(ast);
+  sdfjit::bytecode::optimize(bc);
+  auto mc = compile_kernel(bc);
+
+  std::ofstream out(path, std::ios::binary);
+  bool is_object = path.size() > 2 && path.substr(path.size() - 2) == ".o";
+  if (is_object) {
+    sdfjit::machinecode::write_object(mc, symbol, out);
+  } else {
+    sdfjit::machinecode::write_assembly(mc, symbol, out);
+  }
+
+  // whoever calls it needs to know which uniform goes where
+  std::cout << "wrote " << symbol << " to " << path << ", uniforms:";
+  for (const auto &name : ast.uniform_names) {
+    std::cout << " " << name;
+  }
+  std::cout << std::endl;
 }
 
-int main() {
-  auto ast = ast_at(0);
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "bench-assembler") == 0) {
+    benchmark_assembler();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "bench-static") == 0) {
+    benchmark_static_scene();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "bench-intervals") == 0) {
+    benchmark_intervals();
+    return 0;
+  }
+  if (argc > 2 && strcmp(argv[1], "export") == 0) {
+    export_kernel(argv[2], argc > 3 ? argv[3] : "sdfjit_kernel");
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "live") == 0) {
+    live_preview();
+    return 0;
+  }
+
+  auto ast = animated_scene();
   sdfjit::ast::opt::optimize(ast);
 
   dump_all_parts(ast);
 
   auto rt = sdfjit::raytracer::Raytracer::from_ast(ast);
+  set_time(rt, 0);
 
   auto width = 320;
   auto height = 240;
@@ -5,7 +5,8 @@
 
 namespace sdfjit::profiling {
 
-void add_perf_map_region(machinecode::Executor &exec, std::string_view name) {
+void add_perf_map_region(const machinecode::Executor &exec,
+                         std::string_view name) {
   std::fstream out("/tmp/perf-" + std::to_string(getpid()) + ".map",
                    std::ios_base::app | std::ios_base::out);
   out << std::hex << exec.code << ' ' << exec.code_length << ' ' << name
@@ -6,6 +6,7 @@
 
 namespace sdfjit::profiling {
 
-void add_perf_map_region(machinecode::Executor &exec, std::string_view name);
+void add_perf_map_region(const machinecode::Executor &exec,
+                         std::string_view name);
 
 }
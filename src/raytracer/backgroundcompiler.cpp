@@ -0,0 +1,81 @@
+#include "backgroundcompiler.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "ast/opt.h"
+
+namespace sdfjit::raytracer {
+
+Background_Compiler::~Background_Compiler() {
+  {
+    std::lock_guard<std::mutex> guard{lock};
+    stopping = true;
+  }
+  wake.notify_all();
+  worker.join();
+}
+
+void Background_Compiler::submit(ast::Ast ast) {
+  {
+    std::lock_guard<std::mutex> guard{lock};
+    pending = std::move(ast);
+  }
+  wake.notify_all();
+}
+
+void Background_Compiler::wait_until_idle() {
+  std::unique_lock<std::mutex> guard{lock};
+  wake.wait(guard, [this] { return !pending && !compiling; });
+}
+
+void Background_Compiler::run() {
+  std::unique_lock<std::mutex> guard{lock};
+  while (true) {
+    wake.wait(guard, [this] { return pending || stopping; });
+    if (stopping) {
+      return;
+    }
+
+    auto ast = std::move(*pending);
+    pending.reset();
+    compiling = true;
+
+    // the whole point is that nobody waits on this
+    guard.unlock();
+    ast::opt::optimize(ast);
+    // (every frame wants normals, so they're made before anything gets swapped
+    // in, rather than left for the first frame to make)
+    if (auto cached = Raytracer::from_cache(ast)) {
+      // we've seen it before, so there's nothing to wait for
+      std::atomic_store(&current, std::make_shared<const Raytracer>(*cached));
+    } else {
+      // the interpreter can start on the scene right away, so show that until
+      // the kernel's ready, if that's going to be a while
+      auto expected_seconds = seconds_per_node * double(ast.nodes.size());
+      if (Interpreter::is_supported() &&
+          (seconds_per_node <= 0 || expected_seconds > interpreter_threshold)) {
+        auto interpreted = std::make_shared<const Raytracer>(
+            Raytracer::interpreted_from_ast(ast));
+        interpreted->prepare_normals();
+        std::atomic_store(&current, std::move(interpreted));
+      }
+
+      auto begin = std::chrono::steady_clock::now();
+      auto compiled =
+          std::make_shared<const Raytracer>(Raytracer::from_ast(ast));
+      compiled->prepare_normals();
+      seconds_per_node = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - begin)
+                             .count() /
+                         double(std::max<size_t>(ast.nodes.size(), 1));
+      std::atomic_store(&current, std::move(compiled));
+    }
+    guard.lock();
+
+    compiling = false;
+    wake.notify_all();
+  }
+}
+
+} // namespace sdfjit::raytracer
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "ast/ast.h"
+#include "raytracer/raytracer.h"
+
+namespace sdfjit::raytracer {
+
+// compiles scenes on a thread of its own, so that whoever is rendering can
+// keep going with the last one that finished in the meantime.
+//
+// The current Raytracer is swapped in atomically, and renderers take their
+// own reference to it for as long as they're using it (a frame, say). A
+// kernel that's been replaced goes away once the last frame using it is
+// done, and not before.
+struct Background_Compiler {
+  // only ever touched through std::atomic_load and std::atomic_store
+  std::shared_ptr<const Raytracer> current{};
+
+  std::mutex lock{};
+  std::condition_variable wake{};
+  // the newest scene we've been given that we haven't started on yet. Edits
+  // that come in faster than we can compile them replace each other, since
+  // only the latest one is worth having.
+  std::optional<ast::Ast> pending{};
+  bool compiling{false};
+  bool stopping{false};
+  std::thread worker{};
+
+  // compiles we expect to take less time than this don't get the interpreter
+  // put up in the meantime. The last scene keeps being shown until they're
+  // done, and frames with the interpreter are several times slower than with
+  // kernels, so it's only worth it when the wait would be a long one.
+  static constexpr double interpreter_threshold = 0.2;
+  // how long the last compile took per ast node (in seconds), to guess how
+  // long the next one will be. 0 if we haven't compiled anything yet.
+  double seconds_per_node{0};
+
+  Background_Compiler() : worker([this] { run(); }) {}
+  ~Background_Compiler();
+
+  // compile `ast` and swap it in once it's ready
+  void submit(ast::Ast ast);
+  // the newest scene that's finished compiling, or nullptr if none have yet
+  std::shared_ptr<const Raytracer> raytracer() const {
+    return std::atomic_load(&current);
+  }
+  // block until everything that's been submitted is swapped in
+  void wait_until_idle();
+
+  void run();
+};
+
+} // namespace sdfjit::raytracer
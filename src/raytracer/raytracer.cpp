@@ -1,5 +1,6 @@
 #include "raytracer.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
@@ -11,71 +12,233 @@
 
 #include "bytecode/bytecode.h"
 #include "bytecode/opt.h"
+#include "machinecode/executorcache.h"
+#include "machinecode/kernelcache.h"
 #include "machinecode/opt.h"
 #include "util/macros.h"
 
 namespace sdfjit::raytracer {
 
-Raytracer Raytracer::from_ast(sdfjit::ast::Ast &ast) {
-  auto bc = bytecode::Bytecode::from_ast(ast);
+namespace {
+
+using bytecode::Outputs;
+
+// one of the scene's kernels, if it's been compiled before. The same scene is
+// often compiled over and over (an animation that loops, or one that doesn't
+// change), so it might still be in the Executor_Cache, or else in the
+// Kernel_Cache.
+std::shared_ptr<const Executor>
+find_compiled(const std::vector<uint8_t> &key,
+              const machinecode::Target &target) {
+  auto &executors = machinecode::Executor_Cache::global();
+  if (auto exec = executors.find(key)) {
+    return exec;
+  }
+
+  auto exec = std::make_shared<Executor>();
+  exec->mc.target = target;
+  if (!machinecode::Kernel_Cache::global().load(key, *exec)) {
+    return nullptr;
+  }
+  executors.insert(key, exec);
+  return exec;
+}
+
+// compiles one of the scene's kernels, or finds it if it's been compiled
+// before (see find_compiled), before doing any of the work
+std::shared_ptr<const Executor> compile(sdfjit::ast::Ast &ast,
+                                        Outputs outputs) {
+  auto target = machinecode::Target::host();
+  auto key = machinecode::Kernel_Cache::key_for(ast, outputs, target);
+  if (auto exec = find_compiled(key, target)) {
+    return exec;
+  }
+
+  auto bc = bytecode::Bytecode::from_ast(ast, outputs);
   bytecode::optimize(bc);
-  auto mc = machinecode::Machine_Code::from_bytecode(bc);
+  auto mc = machinecode::Machine_Code::from_bytecode(bc, target);
+  machinecode::early_optimize(mc);
   mc.resolve_immediates();
   mc.allocate_registers();
   mc.add_prologue_and_epilogue();
   machinecode::optimize(mc);
-  Raytracer rt{{std::move(mc)}};
-  rt.exec.create();
-  return rt;
+  auto exec = std::make_shared<Executor>();
+  exec->mc = std::move(mc);
+  exec->create();
+  machinecode::Kernel_Cache::global().store(key, *exec);
+
+  machinecode::Executor_Cache::global().insert(key, exec);
+  return exec;
 }
 
-bool Raytracer::one_round(size_t count, float *__restrict xs,
-                          float *__restrict ys, float *__restrict zs,
-                          float *__restrict dxs, float *__restrict dys,
-                          float *__restrict dzs, float *__restrict distances,
-                          float *__restrict materials) const {
-  // get distances
-  for (size_t offset = 0; offset < count; offset += 8) {
-    exec.call(&xs[offset], &ys[offset], &zs[offset], &distances[offset],
-              &materials[offset]);
+// whether SDFJIT_INTERPRET=1 says to use the interpreter instead of kernels
+bool interpreting_instead() {
+  const char *interpret = getenv("SDFJIT_INTERPRET");
+  return interpret && strcmp(interpret, "1") == 0 &&
+         Interpreter::is_supported();
+}
+
+std::shared_ptr<const Interpreter> interpret(sdfjit::ast::Ast &ast,
+                                             Outputs outputs) {
+  // the interpreter is for scenes that can't wait, so this only does the
+  // passes that are cheap
+  auto bc = bytecode::Bytecode::from_ast(ast, outputs);
+  bytecode::optimize_quickly(bc);
+  return std::make_shared<const Interpreter>(Interpreter::from_bytecode(
+      bc, machinecode::Target::host().precision));
+}
+
+} // namespace
+
+Raytracer Raytracer::from_ast(sdfjit::ast::Ast &ast) {
+  if (interpreting_instead()) {
+    return interpreted_from_ast(ast);
   }
 
-  // update positions:
+  return Raytracer{compile(ast, Outputs::Distance),
+                   compile(ast, Outputs::Material),
+                   nullptr,
+                   nullptr,
+                   std::make_shared<Normal_Kernels>(ast, false),
+                   std::vector<float>(ast.uniform_names.size()),
+                   ast.uniform_names};
+}
+
+std::optional<Raytracer> Raytracer::from_cache(sdfjit::ast::Ast &ast) {
+  if (interpreting_instead()) {
+    return std::nullopt;
+  }
+
+  auto target = machinecode::Target::host();
+  std::shared_ptr<const Executor> kernels[3];
+  Outputs outputs[3] = {Outputs::Distance, Outputs::Material, Outputs::Normal};
+  for (size_t i = 0; i < 3; i++) {
+    auto key = machinecode::Kernel_Cache::key_for(ast, outputs[i], target);
+    kernels[i] = find_compiled(key, target);
+    if (!kernels[i]) {
+      return std::nullopt;
+    }
+  }
+
+  auto normal_kernels = std::make_shared<Normal_Kernels>(ast, false);
+  std::call_once(normal_kernels->made,
+                 [&] { normal_kernels->exec = kernels[2]; });
+  return Raytracer{kernels[0],
+                   kernels[1],
+                   nullptr,
+                   nullptr,
+                   normal_kernels,
+                   std::vector<float>(ast.uniform_names.size()),
+                   ast.uniform_names};
+}
+
+Raytracer Raytracer::interpreted_from_ast(sdfjit::ast::Ast &ast) {
+  return Raytracer{nullptr,
+                   nullptr,
+                   interpret(ast, Outputs::Distance),
+                   interpret(ast, Outputs::Material),
+                   std::make_shared<Normal_Kernels>(ast, true),
+                   std::vector<float>(ast.uniform_names.size()),
+                   ast.uniform_names};
+}
+
+const Raytracer::Normal_Kernels &Raytracer::prepare_normals() const {
+  auto &kernels = *normal_kernels;
+  std::call_once(kernels.made, [&kernels] {
+    if (kernels.interpret) {
+      kernels.interp = interpret(kernels.ast, Outputs::Normal);
+    } else {
+      kernels.exec = compile(kernels.ast, Outputs::Normal);
+    }
+  });
+  return kernels;
+}
+
+void Raytracer::set_uniform(std::string_view name, float value) {
+  auto found = std::find(uniform_names.begin(), uniform_names.end(), name);
+  if (found != uniform_names.end()) {
+    uniforms.at(size_t(found - uniform_names.begin())) = value;
+  }
+}
+
+namespace {
+
+// The advance_rays_* functions move each ray that is still live (hasn't hit
+// anything, and hasn't escaped) forward along its direction by its distance to
+// the scene. They return whether any ray moved. There's one per target so they
+// can run as wide as the kernel does, and they're each compiled for their own
+// instruction set since we don't know which one we'll be using until runtime.
+
+TARGET_ISA("sse4.1")
+void advance_sse41(float *__restrict ps, const float *__restrict dps,
+                   __m128 dist, __m128 op_mask, size_t off) {
+  const auto p = _mm_load_ps(&ps[off]);
+  const auto dp = _mm_load_ps(&dps[off]);
+  // no fma here, so this rounds a tiny bit differently than the wider targets
+  const auto new_p = _mm_add_ps(_mm_mul_ps(dist, dp), p);
+  _mm_store_ps(&ps[off], _mm_blendv_ps(p, new_p, op_mask));
+}
 
+TARGET_ISA("sse4.1")
+bool advance_rays_sse41(size_t count, float *__restrict xs,
+                        float *__restrict ys, float *__restrict zs,
+                        const float *__restrict dxs,
+                        const float *__restrict dys,
+                        const float *__restrict dzs,
+                        const float *__restrict distances) {
   bool not_done = false;
 
-#if 0
-  // unvectorized:
-  for (size_t offset = 0; offset < count; offset++) {
-    if (0 < distances[offset] && distances[offset] < MAX_DIST) {
+  // upper/lower bounds on all lanes:
+  auto lower_bound = _mm_setzero_ps();
+  auto upper_bound = _mm_set1_ps(Raytracer::MAX_DIST);
+  auto epsilon = _mm_set1_ps(0.1f);
+
+  for (size_t offset = 0; offset < count; offset += 4) {
+    auto dist = _mm_load_ps(&distances[offset]);
+
+    auto low_mask = _mm_cmplt_ps(lower_bound, dist);
+    auto high_mask = _mm_cmplt_ps(dist, upper_bound);
+    auto op_mask = _mm_and_ps(low_mask, high_mask);
+
+    if (UNLIKELY(_mm_movemask_ps(op_mask))) {
       not_done = true;
-      float dist = distances[offset] + .1f;
-      xs[offset] += dxs[offset] * dist;
-      ys[offset] += dys[offset] * dist;
-      zs[offset] += dzs[offset] * dist;
+    } else {
+      continue;
     }
+
+    dist = _mm_add_ps(dist, epsilon);
+
+    advance_sse41(xs, dxs, dist, op_mask, offset);
+    advance_sse41(ys, dys, dist, op_mask, offset);
+    advance_sse41(zs, dzs, dist, op_mask, offset);
   }
 
-#else
+  return not_done;
+}
+
+TARGET_ISA("avx2,fma")
+void advance_avx2(float *__restrict ps, const float *__restrict dps,
+                  __m256 dist, __m256 op_mask, size_t off) {
+  const auto p = _mm256_load_ps(&ps[off]);
+  const auto dp = _mm256_load_ps(&dps[off]);
+  const auto retained_p = _mm256_andnot_ps(op_mask, p);
+  const auto new_p = _mm256_and_ps(op_mask, _mm256_fmadd_ps(dist, dp, p));
+  const auto result_p = _mm256_or_ps(new_p, retained_p);
+  _mm256_store_ps(&ps[off], result_p);
+}
+
+TARGET_ISA("avx2,fma")
+bool advance_rays_avx2(size_t count, float *__restrict xs, float *__restrict ys,
+                       float *__restrict zs, const float *__restrict dxs,
+                       const float *__restrict dys, const float *__restrict dzs,
+                       const float *__restrict distances) {
+  bool not_done = false;
 
-  // vectorized:
-  // this whole thing would be much easier if we could use the AVX512
-  // writemasked operations, but this project is all AVX256 for now
   // upper/lower bounds on all lanes:
   auto lower_bound = _mm256_setzero_ps();
-  auto upper_bound = _mm256_set1_ps(MAX_DIST);
+  auto upper_bound = _mm256_set1_ps(Raytracer::MAX_DIST);
   auto epsilon = _mm256_set1_ps(0.1f);
 
-  auto advance = [](float *__restrict ps, float *__restrict dps, __m256 dist,
-                    __m256 op_mask, size_t off) {
-    const auto p = _mm256_load_ps(&ps[off]);
-    const auto dp = _mm256_load_ps(&dps[off]);
-    const auto retained_p = _mm256_andnot_ps(op_mask, p);
-    const auto new_p = _mm256_and_ps(op_mask, _mm256_fmadd_ps(dist, dp, p));
-    const auto result_p = _mm256_or_ps(new_p, retained_p);
-    _mm256_store_ps(&ps[off], result_p);
-  };
-
   for (size_t offset = 0; offset < count; offset += 8) {
     auto dist = _mm256_load_ps(&distances[offset]);
 
@@ -94,9 +257,197 @@ bool Raytracer::one_round(size_t count, float *__restrict xs,
 
     dist = _mm256_add_ps(dist, epsilon);
 
-    advance(xs, dxs, dist, op_mask, offset);
-    advance(ys, dys, dist, op_mask, offset);
-    advance(zs, dzs, dist, op_mask, offset);
+    advance_avx2(xs, dxs, dist, op_mask, offset);
+    advance_avx2(ys, dys, dist, op_mask, offset);
+    advance_avx2(zs, dzs, dist, op_mask, offset);
+  }
+
+  return not_done;
+}
+
+// with writemasks we don't need to blend the old positions back in, lanes
+// that are masked off just keep p.
+TARGET_ISA("avx512f")
+void advance_avx512(float *__restrict ps, const float *__restrict dps,
+                    __m512 dist, __mmask16 op_mask, size_t off) {
+  const auto p = _mm512_load_ps(&ps[off]);
+  const auto dp = _mm512_load_ps(&dps[off]);
+  _mm512_store_ps(&ps[off], _mm512_mask3_fmadd_ps(dist, dp, p, op_mask));
+}
+
+TARGET_ISA("avx512f")
+bool advance_rays_avx512(size_t count, float *__restrict xs,
+                         float *__restrict ys, float *__restrict zs,
+                         const float *__restrict dxs,
+                         const float *__restrict dys,
+                         const float *__restrict dzs,
+                         const float *__restrict distances) {
+  bool not_done = false;
+
+  // upper/lower bounds on all lanes:
+  auto lower_bound = _mm512_setzero_ps();
+  auto upper_bound = _mm512_set1_ps(Raytracer::MAX_DIST);
+  auto epsilon = _mm512_set1_ps(0.1f);
+
+  for (size_t offset = 0; offset < count; offset += 16) {
+    auto dist = _mm512_load_ps(&distances[offset]);
+
+    auto low_mask = _mm512_cmp_ps_mask(lower_bound, dist, _CMP_LT_OS);
+    auto op_mask =
+        _mm512_mask_cmp_ps_mask(low_mask, dist, upper_bound, _CMP_LT_OS);
+
+    if (UNLIKELY(op_mask)) {
+      not_done = true;
+    } else {
+      continue;
+    }
+
+    dist = _mm512_add_ps(dist, epsilon);
+
+    advance_avx512(xs, dxs, dist, op_mask, offset);
+    advance_avx512(ys, dys, dist, op_mask, offset);
+    advance_avx512(zs, dzs, dist, op_mask, offset);
+  }
+
+  return not_done;
+}
+
+} // namespace
+
+void Raytracer::evaluate_distances(float *xs, float *ys, float *zs,
+                                   float *distances, size_t count) const {
+  // (the distance kernels never touch their materials)
+  if (exec) {
+    exec->call(xs, ys, zs, distances, nullptr, count, uniforms.data());
+  } else {
+    interp->call(xs, ys, zs, distances, nullptr, count, uniforms.data());
+  }
+}
+
+void Raytracer::evaluate_materials(float *xs, float *ys, float *zs,
+                                   float *materials, size_t count) const {
+  if (material_exec) {
+    material_exec->call(xs, ys, zs, nullptr, materials, count,
+                        uniforms.data());
+  } else {
+    material_interp->call(xs, ys, zs, nullptr, materials, count,
+                          uniforms.data());
+  }
+}
+
+void Raytracer::evaluate(float *xs, float *ys, float *zs, float *distances,
+                         float *materials, size_t count) const {
+  evaluate_distances(xs, ys, zs, distances, count);
+  evaluate_materials(xs, ys, zs, materials, count);
+}
+
+void Raytracer::evaluate_normals(float *xs, float *ys, float *zs,
+                                 float *distances, float *normals,
+                                 size_t count) const {
+  const auto &kernels = prepare_normals();
+  if (kernels.exec) {
+    kernels.exec->call_normals(xs, ys, zs, distances, normals, count,
+                               uniforms.data());
+  } else {
+    kernels.interp->call_normals(xs, ys, zs, distances, normals, count,
+                                 uniforms.data());
+  }
+}
+
+void Raytracer::hit_materials(size_t count, const float *xs, const float *ys,
+                              const float *zs, const float *distances,
+                              float *materials) const {
+  std::vector<uint32_t> hits{};
+  for (size_t i = 0; i < count; i++) {
+    materials[i] = 0;
+    if (distances[i] <= 0) {
+      hits.push_back(uint32_t(i));
+    }
+  }
+  if (hits.empty()) {
+    return;
+  }
+
+  // pack the hits together, padded out to a whole number of vectors with
+  // copies of the last one
+  const auto lanes = this->lanes();
+  const auto packed_count = (hits.size() + lanes - 1) / lanes * lanes;
+  using Buffer = std::unique_ptr<float[], decltype(&free)>;
+  auto make_buffer = [&]() {
+    return Buffer(
+        (float *)aligned_alloc(512 / 8, packed_count * sizeof(float)), &free);
+  };
+  auto hit_xs = make_buffer();
+  auto hit_ys = make_buffer();
+  auto hit_zs = make_buffer();
+  auto hit_materials = make_buffer();
+  for (size_t i = 0; i < packed_count; i++) {
+    auto hit = hits[std::min(i, hits.size() - 1)];
+    hit_xs[i] = xs[hit];
+    hit_ys[i] = ys[hit];
+    hit_zs[i] = zs[hit];
+  }
+
+  evaluate_materials(hit_xs.get(), hit_ys.get(), hit_zs.get(),
+                     hit_materials.get(), packed_count);
+
+  for (size_t i = 0; i < hits.size(); i++) {
+    materials[hits[i]] = hit_materials[i];
+  }
+}
+
+size_t Raytracer::lanes() const {
+  return exec ? exec->lanes() : interp->lanes();
+}
+
+machinecode::Isa Raytracer::isa() const {
+  // the interpreter's tiles are a whole number of AVX2 vectors
+  return exec ? exec->mc.target.isa : machinecode::Isa::AVX2;
+}
+
+bool Raytracer::one_round(size_t count, float *__restrict xs,
+                          float *__restrict ys, float *__restrict zs,
+                          float *__restrict dxs, float *__restrict dys,
+                          float *__restrict dzs,
+                          float *__restrict distances) const {
+  // get distances
+  evaluate_distances(xs, ys, zs, distances, count);
+
+  // update positions:
+
+  bool not_done = false;
+
+#if 0
+  // unvectorized:
+  for (size_t offset = 0; offset < count; offset++) {
+    if (0 < distances[offset] && distances[offset] < MAX_DIST) {
+      not_done = true;
+      float dist = distances[offset] + .1f;
+      xs[offset] += dxs[offset] * dist;
+      ys[offset] += dys[offset] * dist;
+      zs[offset] += dzs[offset] * dist;
+    }
+  }
+
+#else
+
+  // vectorized, at the same width as the kernel (or interpreter):
+  switch (isa()) {
+  case machinecode::Isa::SSE41: {
+    not_done =
+        advance_rays_sse41(count, xs, ys, zs, dxs, dys, dzs, distances);
+    break;
+  }
+  case machinecode::Isa::AVX2: {
+    not_done =
+        advance_rays_avx2(count, xs, ys, zs, dxs, dys, dzs, distances);
+    break;
+  }
+  case machinecode::Isa::AVX512: {
+    not_done =
+        advance_rays_avx512(count, xs, ys, zs, dxs, dys, dzs, distances);
+    break;
+  }
   }
 
 #endif
@@ -114,12 +465,11 @@ struct Trace_Thread_Arg {
   float *dys;
   float *dzs;
   float *distances;
-  float *materials;
 };
 
 void *trace_thread(Trace_Thread_Arg *arg) {
   while (arg->rt->one_round(arg->count, arg->xs, arg->ys, arg->zs, arg->dxs,
-                            arg->dys, arg->dzs, arg->distances, arg->materials))
+                            arg->dys, arg->dzs, arg->distances))
     ;
   return NULL;
 }
@@ -129,13 +479,18 @@ void Raytracer::trace_image(float px, float py, float pz, float hx, float hy,
                             uint32_t *screen) const {
   // our raytracing setup right now is that we send out a ray for each pixel.
   // our screen is 3-component _RGB (top byte of the pixel is always empty)
-  const auto count = width * height;
-  const auto alignment = 256 / 8;
+  // the kernel works on a full vector of lanes at a time, so round our buffers
+  // up to a whole number of those. The extra rays at the end are never drawn.
+  const auto lanes = this->lanes();
+  const auto pixel_count = width * height;
+  const auto count = (pixel_count + lanes - 1) / lanes * lanes;
+  const auto alignment = 512 / 8;
   const auto num_threads = std::thread::hardware_concurrency() * 128;
 
-  auto make_buffer = [&](size_t size) -> std::unique_ptr<float[]> {
+  using Buffer = std::unique_ptr<float[], decltype(&free)>;
+  auto make_buffer = [&](size_t size) -> Buffer {
     auto alloc = (float *)aligned_alloc(alignment, size * sizeof(float));
-    return std::unique_ptr<float[]>(alloc);
+    return Buffer(alloc, &free);
   };
 
   auto make_count_buffer = [&]() { return make_buffer(count); };
@@ -155,24 +510,13 @@ void Raytracer::trace_image(float px, float py, float pz, float hx, float hy,
   auto dxs = make_count_buffer();
   auto dys = make_count_buffer();
   auto dzs = make_count_buffer();
-  // buffers for doing normal estimation, we need to compute 2 positions on
-  // either side of the original position in each axis to estimate the normal
-  auto normal_estimation_low_xs = make_count_buffer();
-  auto normal_estimation_high_xs = make_count_buffer();
-  auto normal_estimation_low_ys = make_count_buffer();
-  auto normal_estimation_high_ys = make_count_buffer();
-  auto normal_estimation_low_zs = make_count_buffer();
-  auto normal_estimation_high_zs = make_count_buffer();
-  std::unique_ptr<float[]> normal_estimation_distances[] = {
-      make_count_buffer(), make_count_buffer(), make_count_buffer(),
-      make_count_buffer(), make_count_buffer(), make_count_buffer(),
-  };
-  auto normal_estimation_xs = make_count_buffer();
-  auto normal_estimation_ys = make_count_buffer();
-  auto normal_estimation_zs = make_count_buffer();
-  // we don't need materials for normal estimation, but we still need a buffer
-  // for them to go in that we won't use.
-  auto throwaway_materials = make_count_buffer();
+  // surface normals, all the x's, then the y's, then the z's (see
+  // evaluate_normals)
+  auto normals = make_buffer(3 * count);
+  auto normal_xs = normals.get();
+  auto normal_ys = normals.get() + count;
+  auto normal_zs = normals.get() + 2 * count;
+  auto normal_distances = make_count_buffer();
 
   auto color_for_material = [&](float material) {
     uint8_t r = 0;
@@ -231,25 +575,33 @@ void Raytracer::trace_image(float px, float py, float pz, float hx, float hy,
     }
   }
 
+  // padding rays just look straight ahead from the camera
+  for (size_t offset = pixel_count; offset < count; offset++) {
+    dxs[offset] = 0;
+    dys[offset] = 0;
+    dzs[offset] = -1;
+    xs[offset] = px;
+    ys[offset] = py;
+    zs[offset] = pz;
+  }
+
   // pass 1: find geometry collisions
   std::vector<Trace_Thread_Arg> thread_args{};
   std::vector<pthread_t> threads{};
 
   // we need to avoid reallocating since we're passing pointers into this vector
   thread_args.reserve(num_threads);
-  auto run_length = count / num_threads;
-  for (size_t i = 0; i < num_threads; i++) {
-    auto offset = i * run_length;
-    auto length = run_length;
-
-    auto amount_to_align = offset % alignment;
-    offset -= amount_to_align;
-    length += amount_to_align;
+  // each thread gets a whole number of kernel calls worth of rays, so that no
+  // two threads ever touch the same vector
+  auto run_length = ((count + num_threads - 1) / num_threads + lanes - 1) /
+                    lanes * lanes;
+  for (size_t offset = 0; offset < count; offset += run_length) {
+    auto length = std::min(run_length, count - offset);
 
     thread_args.push_back(Trace_Thread_Arg{
         this, length, xs.get() + offset, ys.get() + offset, zs.get() + offset,
         dxs.get() + offset, dys.get() + offset, dzs.get() + offset,
-        distances.get() + offset, materials.get() + offset});
+        distances.get() + offset});
 
     pthread_t thread;
     pthread_create(&thread, NULL, (void *(*)(void *))trace_thread,
@@ -261,79 +613,40 @@ void Raytracer::trace_image(float px, float py, float pz, float hx, float hy,
     pthread_join(thread, NULL);
   }
 
-  // pass 2: calculate normals:
-  // normal_x = sdf(translate_x(pos, eps)) - sdf(translate_x(pos, -eps)),
-  // normal_y = sdf(translate_y(pos, eps)) - sdf(translate_y(pos, -eps)),
-  // normal_z = sdf(translate_z(pos, eps)) - sdf(translate_z(pos, -eps)),
-  static constexpr float normal_epsilon = .00001;
-  for (size_t i = 0; i < count; i++) {
-    normal_estimation_low_xs[i] = xs[i] - normal_epsilon;
-    normal_estimation_high_xs[i] = xs[i] + normal_epsilon;
-    normal_estimation_low_ys[i] = ys[i] - normal_epsilon;
-    normal_estimation_high_ys[i] = ys[i] + normal_epsilon;
-    normal_estimation_low_zs[i] = zs[i] - normal_epsilon;
-    normal_estimation_high_zs[i] = zs[i] + normal_epsilon;
-  }
-  auto normal_sdf = [&count, &throwaway_materials,
-                     this](float *normal_xs, float *normal_ys, float *normal_zs,
-                           float *normal_distances) {
-    // TODO: thread this out like above for performance
-    for (size_t offset = 0; offset < count; offset += 8) {
-      exec.call(&normal_xs[offset], &normal_ys[offset], &normal_zs[offset],
-                &normal_distances[offset], &throwaway_materials[offset]);
-    }
-  };
-
-  // ok, finally compute our normals
-  normal_sdf(normal_estimation_low_xs.get(), ys.get(), zs.get(),
-             normal_estimation_distances[0].get());
-  normal_sdf(normal_estimation_high_xs.get(), ys.get(), zs.get(),
-             normal_estimation_distances[1].get());
-  normal_sdf(xs.get(), normal_estimation_low_ys.get(), zs.get(),
-             normal_estimation_distances[2].get());
-  normal_sdf(xs.get(), normal_estimation_high_ys.get(), zs.get(),
-             normal_estimation_distances[3].get());
-  normal_sdf(xs.get(), ys.get(), normal_estimation_low_zs.get(),
-             normal_estimation_distances[4].get());
-  normal_sdf(xs.get(), ys.get(), normal_estimation_high_zs.get(),
-             normal_estimation_distances[5].get());
+  // marching only needs distances, so now find out what the rays hit (before
+  // they get moved for the reflection)
+  hit_materials(count, xs.get(), ys.get(), zs.get(), distances.get(),
+                materials.get());
 
-  for (size_t i = 0; i < count; i++) {
-    normal_estimation_xs[i] =
-        normal_estimation_high_xs[i] - normal_estimation_low_xs[i];
-    normal_estimation_ys[i] =
-        normal_estimation_high_ys[i] - normal_estimation_low_ys[i];
-    normal_estimation_zs[i] =
-        normal_estimation_high_zs[i] - normal_estimation_low_zs[i];
-  }
-
-  // normalize our vectors
-  for (size_t i = 0; i < count; i++) {
-    auto length = sqrtf(normal_estimation_xs[i] * normal_estimation_xs[i] +
-                        normal_estimation_ys[i] * normal_estimation_ys[i] +
-                        normal_estimation_zs[i] * normal_estimation_zs[i]);
-    normal_estimation_xs[i] /= length;
-    normal_estimation_ys[i] /= length;
-    normal_estimation_zs[i] /= length;
-  }
+  // pass 2: calculate normals. The normal kernel differentiates the sdf, so
+  // this is one evaluation rather than the six it'd take to estimate them.
+  // TODO: thread this out like above for performance
+  evaluate_normals(xs.get(), ys.get(), zs.get(), normal_distances.get(),
+                   normals.get(), count);
 
   // before we can start moving things towards their reflection, we need to move
   // the rays a bit past the "skin" of their current object. That way, they
   // don't decide that they're reflected immediately against themselves.
   for (size_t i = 0; i < count; i++) {
     auto distance = distances[i] + 1.0f;
-    xs[i] += normal_estimation_xs[i] * distance;
-    ys[i] += normal_estimation_ys[i] * distance;
-    zs[i] += normal_estimation_zs[i] * distance;
+    xs[i] += normal_xs[i] * distance;
+    ys[i] += normal_ys[i] * distance;
+    zs[i] += normal_zs[i] * distance;
   }
 
-  // now we can actually send those rays out to find the reflected surface
+  // now we can actually send those rays out to find the reflected surface.
+  // Some of them bounce off parallel to something (like along the floor), and
+  // never get any further from it, so they'd go on forever. Give up on those
+  // after a while, and count them as misses.
   // TODO: thread this out like above for performance
-  while (one_round(count, xs.get(), ys.get(), zs.get(),
-                   normal_estimation_xs.get(), normal_estimation_ys.get(),
-                   normal_estimation_zs.get(), reflected_distances.get(),
-                   reflected_materials.get()))
-    ;
+  for (size_t round = 0; round < MAX_ROUNDS; round++) {
+    if (!one_round(count, xs.get(), ys.get(), zs.get(), normal_xs, normal_ys,
+                   normal_zs, reflected_distances.get())) {
+      break;
+    }
+  }
+  hit_materials(count, xs.get(), ys.get(), zs.get(), reflected_distances.get(),
+                reflected_materials.get());
 
   auto combine_reflection = [](auto primary_color, auto reflected_color) {
 #if 0
@@ -1,21 +1,101 @@
 #pragma once
 
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
 #include "ast/ast.h"
+#include "interpreter/interpreter.h"
 #include "machinecode/executor.h"
 
 namespace sdfjit::raytracer {
 
+using interpreter::Interpreter;
 using machinecode::Executor;
 
 struct Raytracer {
-  Executor exec;
+  // the normal kernel (or interpreter), which isn't made until something
+  // first asks for normals. Differentiating the sdf makes it the biggest of
+  // the three by far, and plenty of users never want normals. Copies of a
+  // Raytracer share it.
+  struct Normal_Kernels {
+    ast::Ast ast;
+    bool interpret;
+    std::once_flag made{};
+    std::shared_ptr<const Executor> exec{};
+    std::shared_ptr<const Interpreter> interp{};
+
+    Normal_Kernels(const ast::Ast &scene, bool interpreted)
+        : ast(scene), interpret(interpreted) {}
+  };
+
+  // the scene's sdf, compiled a few ways: exec only works out distances
+  // (which is all that marching rays needs), material_exec only works out
+  // materials, for the rays that hit something, and normal_kernels works out
+  // the surface normals by differentiating the sdf. They're all shared with
+  // the Executor_Cache, and any other Raytracers for the same scene.
+  std::shared_ptr<const Executor> exec;
+  std::shared_ptr<const Executor> material_exec;
+  // used instead of the kernels when the scene hasn't been compiled
+  std::shared_ptr<const Interpreter> interp;
+  std::shared_ptr<const Interpreter> material_interp;
+  std::shared_ptr<Normal_Kernels> normal_kernels;
+  // what the scene's uniforms are set to, indexed by ast::Node::uniform_index
+  std::vector<float> uniforms{};
+  // the names they were made with, from ast::Ast::uniform_names
+  std::vector<std::string> uniform_names{};
   static constexpr size_t MAX_DIST = 10000;
+  // how long reflected rays get to find something
+  static constexpr size_t MAX_ROUNDS = 64;
 
+  // compiles the scene, unless SDFJIT_INTERPRET=1 is set, in which case this
+  // is the same as interpreted_from_ast
   static Raytracer from_ast(sdfjit::ast::Ast &ast);
+  // the compiled scene, if all of its kernels have been compiled before
+  // (they're in the Executor_Cache or the Kernel_Cache), without compiling
+  // anything. Never anything with SDFJIT_INTERPRET=1.
+  static std::optional<Raytracer> from_cache(sdfjit::ast::Ast &ast);
+  // traces the scene with the interpreter, so it's ready right away but
+  // slower. The cpu has to support the interpreter (Interpreter::is_supported).
+  static Raytracer interpreted_from_ast(sdfjit::ast::Ast &ast);
+
+  // does nothing if the scene doesn't have a uniform called `name`, so that
+  // whoever's setting them doesn't have to keep track of which version of an
+  // edited scene they've got
+  void set_uniform(std::string_view name, float value);
+
+  // run the scene's sdf, with whichever kernels or interpreters we've got.
+  // evaluate fills in both distances and materials.
+  void evaluate_distances(float *xs, float *ys, float *zs, float *distances,
+                          size_t count) const;
+  void evaluate_materials(float *xs, float *ys, float *zs, float *materials,
+                          size_t count) const;
+  void evaluate(float *xs, float *ys, float *zs, float *distances,
+                float *materials, size_t count) const;
+  // fills in distances, and the (unit length) surface normal at each point.
+  // normals holds 3 * count floats, laid out like for Executor::call_normals.
+  void evaluate_normals(float *xs, float *ys, float *zs, float *distances,
+                        float *normals, size_t count) const;
+  // makes the normal kernel (or interpreter) if it hasn't been made yet.
+  // evaluate_normals does this itself, but this gets it done somewhere nobody
+  // is waiting on it.
+  const Normal_Kernels &prepare_normals() const;
+  // fills in materials for just the points that hit something (distance <= 0),
+  // and 0 for the rest. The hits are packed together first, so the material
+  // sdf only runs on them.
+  void hit_materials(size_t count, const float *xs, const float *ys,
+                     const float *zs, const float *distances,
+                     float *materials) const;
+  // how many points evaluate works on at a time
+  size_t lanes() const;
+  // what to move the rays forward with
+  machinecode::Isa isa() const;
 
   bool one_round(size_t count, float *xs, float *ys, float *zs, float *dxs,
-                 float *dys, float *dzs, float *distances,
-                 float *materials) const;
+                 float *dys, float *dzs, float *distances) const;
 
   void trace_image(float x, float y, float z, float hx, float hy, float hz,
                    size_t width, size_t height, uint32_t *screen) const;
@@ -0,0 +1,482 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <type_traits>
+
+// scenes that are known when sdfjit is built, written with the same builders
+// as ast::Ast, but as types instead of nodes, so the whole scene inlines into
+// one function that the C++ compiler optimizes like any other. There's no
+// compiling at runtime at all, and it makes a good baseline for the JIT.
+//
+//   static constexpr auto scene = staticscene::add(
+//       staticscene::sphere(staticscene::pos3(IN_X, IN_Y, IN_Z), 6.0f, 1.0f),
+//       ...);
+//   Executor::Function_Type *kernel = staticscene::kernel<scene>;
+//
+// Scenes evaluate the same way the bytecode they'd make does (the same
+// formulas, in the same order), but the C++ compiler is free to contract and
+// reorder things differently from the JIT, so don't expect the last bit to
+// match. There's no scale, since the compiler doesn't do that either.
+//
+// Everything works as wide as the file including this is compiled for: 16
+// lanes with AVX-512, 8 with AVX, and 4 otherwise. It's header only, so
+// compile static scenes with whatever -march the machine they run on has.
+
+namespace sdfjit::staticscene {
+
+#if defined(__AVX512F__)
+inline constexpr size_t lanes = 16;
+#elif defined(__AVX__)
+inline constexpr size_t lanes = 8;
+#else
+inline constexpr size_t lanes = 4;
+#endif
+
+using Vec = float __attribute__((vector_size(lanes * sizeof(float))));
+using Mask = int32_t __attribute__((vector_size(lanes * sizeof(float))));
+
+// the operations on values, which might be a float that's the same for every
+// point (a constant, or a uniform), or a Vec that isn't. Mixing them gives a
+// Vec, the same way the vector extensions do.
+
+template <typename A, typename B> using Common = decltype(A{} + B{});
+
+template <typename T> T widen(float value) { return T{} + value; }
+template <typename T> T widen(Vec value) { return value; }
+
+inline float sqrt_lanes(float value) { return std::sqrt(value); }
+inline Vec sqrt_lanes(Vec value) {
+  // std::sqrt would have to set errno for negative numbers, which keeps the
+  // compiler from vectorizing it
+#if defined(__AVX512F__)
+  // (_mm512_sqrt_ps trips -Wmaybe-uninitialized on its own undefined source)
+  return _mm512_mask_sqrt_ps(value, __mmask16(-1), value);
+#elif defined(__AVX__)
+  return _mm256_sqrt_ps(value);
+#else
+  return _mm_sqrt_ps(value);
+#endif
+}
+
+inline float abs_lanes(float value) { return std::fabs(value); }
+inline Vec abs_lanes(Vec value) {
+  return reinterpret_cast<Vec>(reinterpret_cast<Mask>(value) & 0x7fffffff);
+}
+
+inline float sin_lanes(float value) { return std::sin(value); }
+inline Vec sin_lanes(Vec value) {
+  for (size_t lane = 0; lane < lanes; lane++) {
+    value[lane] = std::sin(value[lane]);
+  }
+  return value;
+}
+
+inline float cos_lanes(float value) { return std::cos(value); }
+inline Vec cos_lanes(Vec value) {
+  for (size_t lane = 0; lane < lanes; lane++) {
+    value[lane] = std::cos(value[lane]);
+  }
+  return value;
+}
+
+template <typename A, typename B> Common<A, B> min_lanes(A a, B b) {
+  auto lhs = widen<Common<A, B>>(a);
+  auto rhs = widen<Common<A, B>>(b);
+  return lhs < rhs ? lhs : rhs;
+}
+
+template <typename A, typename B> Common<A, B> max_lanes(A a, B b) {
+  auto lhs = widen<Common<A, B>>(a);
+  auto rhs = widen<Common<A, B>>(b);
+  return lhs > rhs ? lhs : rhs;
+}
+
+// `a < b ? if_true : if_false`
+template <typename A, typename B, typename T, typename F>
+Common<Common<A, B>, Common<T, F>> select_lt(A a, B b, T if_true,
+                                             F if_false) {
+  using Result = Common<Common<A, B>, Common<T, F>>;
+  return widen<Result>(a) < widen<Result>(b) ? widen<Result>(if_true)
+                                             : widen<Result>(if_false);
+}
+
+// `!(a > b) ? if_true : if_false`, which is what the kernels do for
+// Select_Type::GT (see machinecode::select_type_to_vcmpps_imm)
+template <typename A, typename B, typename T, typename F>
+Common<Common<A, B>, Common<T, F>> select_gt(A a, B b, T if_true,
+                                             F if_false) {
+  using Result = Common<Common<A, B>, Common<T, F>>;
+  return widen<Result>(a) > widen<Result>(b) ? widen<Result>(if_false)
+                                             : widen<Result>(if_true);
+}
+
+// what nodes are evaluated at
+struct Point {
+  Vec x;
+  Vec y;
+  Vec z;
+};
+
+// what positions evaluate to
+template <typename X, typename Y, typename Z> struct Position {
+  X x;
+  Y y;
+  Z z;
+};
+template <typename X, typename Y, typename Z>
+Position(X, Y, Z) -> Position<X, Y, Z>;
+
+// and what objects do
+template <typename D, typename M> struct Object {
+  D distance;
+  M material;
+};
+
+// Every node has:
+//   bind(uniforms), which returns the node with the uniforms filled in (and
+//     anything that only depends on them worked out), once per call
+//   eval(point), on a bound node, for every vector of points
+
+/* Values */
+
+struct Float32 {
+  float value;
+
+  constexpr Float32 bind(const float *) const { return *this; }
+  constexpr float eval(const Point &) const { return value; }
+};
+
+// a float that's read from the uniforms passed to the kernel, indexed the same
+// way as ast::Node::uniform_index (there are no names here)
+struct Uniform {
+  size_t index;
+
+  Float32 bind(const float *uniforms) const { return {uniforms[index]}; }
+};
+
+// one of the point's coordinates (0, 1, 2 for x, y, z)
+template <size_t axis> struct Input {
+  constexpr Input bind(const float *) const { return *this; }
+  Vec eval(const Point &point) const {
+    if constexpr (axis == 0) {
+      return point.x;
+    } else if constexpr (axis == 1) {
+      return point.y;
+    } else {
+      return point.z;
+    }
+  }
+};
+
+inline constexpr Input<0> IN_X{};
+inline constexpr Input<1> IN_Y{};
+inline constexpr Input<2> IN_Z{};
+
+template <typename X, typename Y, typename Z> struct Pos3 {
+  X x;
+  Y y;
+  Z z;
+
+  auto bind(const float *uniforms) const {
+    return Pos3<decltype(x.bind(uniforms)), decltype(y.bind(uniforms)),
+                decltype(z.bind(uniforms))>{
+        x.bind(uniforms), y.bind(uniforms), z.bind(uniforms)};
+  }
+  auto eval(const Point &point) const {
+    return Position{x.eval(point), y.eval(point), z.eval(point)};
+  }
+};
+
+/* Primitives */
+
+template <typename P, typename R, typename M> struct Sphere {
+  P position;
+  R radius;
+  M material;
+
+  auto bind(const float *uniforms) const {
+    return Sphere<decltype(position.bind(uniforms)),
+                  decltype(radius.bind(uniforms)),
+                  decltype(material.bind(uniforms))>{
+        position.bind(uniforms), radius.bind(uniforms),
+        material.bind(uniforms)};
+  }
+  auto eval(const Point &point) const {
+    // length(p) - s
+    auto p = position.eval(point);
+    auto length = sqrt_lanes(p.x * p.x + (p.y * p.y + p.z * p.z));
+    auto distance = length - radius.eval(point);
+    return Object<decltype(distance), decltype(material.eval(point))>{
+        distance, material.eval(point)};
+  }
+};
+
+template <typename P, typename X, typename Y, typename Z, typename M>
+struct Box {
+  P position;
+  X wx;
+  Y wy;
+  Z wz;
+  M material;
+
+  auto bind(const float *uniforms) const {
+    return Box<decltype(position.bind(uniforms)), decltype(wx.bind(uniforms)),
+               decltype(wy.bind(uniforms)), decltype(wz.bind(uniforms)),
+               decltype(material.bind(uniforms))>{
+        position.bind(uniforms), wx.bind(uniforms), wy.bind(uniforms),
+        wz.bind(uniforms), material.bind(uniforms)};
+  }
+  auto eval(const Point &point) const {
+    // d = abs(p) - b
+    // length(max(d, 0.0)) + min(max(d.x, max(d.y, d.z)), 0.0)
+    auto p = position.eval(point);
+    auto d_x = abs_lanes(p.x) - wx.eval(point);
+    auto d_y = abs_lanes(p.y) - wy.eval(point);
+    auto d_z = abs_lanes(p.z) - wz.eval(point);
+    auto squared = [](auto d) {
+      auto d_max = max_lanes(d, 0.0f);
+      return d_max * d_max;
+    };
+    auto length = sqrt_lanes(squared(d_x) + (squared(d_y) + squared(d_z)));
+    auto distance =
+        length + min_lanes(max_lanes(d_x, max_lanes(d_y, d_z)), 0.0f);
+    return Object<decltype(distance), decltype(material.eval(point))>{
+        distance, material.eval(point)};
+  }
+};
+
+template <typename P, typename N, typename M> struct Plane {
+  P position;
+  N normal;
+  M material;
+
+  auto bind(const float *uniforms) const {
+    return Plane<decltype(position.bind(uniforms)),
+                 decltype(normal.bind(uniforms)),
+                 decltype(material.bind(uniforms))>{
+        position.bind(uniforms), normal.bind(uniforms),
+        material.bind(uniforms)};
+  }
+  auto eval(const Point &point) const {
+    auto p = position.eval(point);
+    auto n = normal.eval(point);
+    auto distance = (p.x * n.x + p.y * n.y) + p.z * n.z;
+    return Object<decltype(distance), decltype(material.eval(point))>{
+        distance, material.eval(point)};
+  }
+};
+
+/* Composition operators */
+
+// which of the two objects a composition takes the material from is decided
+// by `Select`, which gets both distances
+#define STATICSCENE_COMPOSITION(name, distance_expr, material_expr)            \
+  template <typename L, typename R> struct name {                              \
+    L lhs;                                                                     \
+    R rhs;                                                                     \
+                                                                               \
+    auto bind(const float *uniforms) const {                                   \
+      return name<decltype(lhs.bind(uniforms)),                                \
+                  decltype(rhs.bind(uniforms))>{lhs.bind(uniforms),            \
+                                                rhs.bind(uniforms)};           \
+    }                                                                          \
+    auto eval(const Point &point) const {                                      \
+      auto l = lhs.eval(point);                                                \
+      auto r = rhs.eval(point);                                                \
+      auto distance = distance_expr;                                           \
+      auto material = material_expr;                                           \
+      return Object<decltype(distance), decltype(material)>{distance,          \
+                                                            material};         \
+    }                                                                          \
+  };
+
+// min(d1, d2)
+STATICSCENE_COMPOSITION(Add, min_lanes(l.distance, r.distance),
+                        select_lt(l.distance, r.distance, l.material,
+                                  r.material))
+// max(-d1, d2)
+STATICSCENE_COMPOSITION(Subtract, max_lanes(-l.distance, r.distance),
+                        select_gt(-l.distance, r.distance, l.material,
+                                  r.material))
+// max(d1, d2)
+STATICSCENE_COMPOSITION(Intersect, max_lanes(l.distance, r.distance),
+                        select_gt(l.distance, r.distance, l.material,
+                                  r.material))
+
+#undef STATICSCENE_COMPOSITION
+
+/* Movement operators */
+
+// rotates about x, then y, then z, like Bytecode::from_ast does
+template <typename Position_Type, typename S, typename C>
+auto rotate_position(Position_Type p, S sin_x, C cos_x, S sin_y, C cos_y,
+                     S sin_z, C cos_z) {
+  auto y1 = p.y * cos_x - p.z * sin_x;
+  auto z1 = p.y * sin_x + p.z * cos_x;
+  auto x2 = p.x * cos_y + z1 * sin_y;
+  auto z2 = p.x * -sin_y + z1 * cos_y;
+  auto x3 = x2 * cos_z - y1 * sin_z;
+  auto y3 = x2 * sin_z + y1 * cos_z;
+  return Position{x3, y3, z2};
+}
+
+// a rotation that's the same for every point, with its sines and cosines
+// already worked out
+template <typename P> struct Fixed_Rotate {
+  P position;
+  float sin_x, cos_x, sin_y, cos_y, sin_z, cos_z;
+
+  auto eval(const Point &point) const {
+    return rotate_position(position.eval(point), sin_x, cos_x, sin_y, cos_y,
+                           sin_z, cos_z);
+  }
+};
+
+template <typename P, typename R> struct Rotate {
+  P position;
+  R rotation;
+
+  auto bind(const float *uniforms) const {
+    auto bound_position = position.bind(uniforms);
+    auto bound_rotation = rotation.bind(uniforms);
+    using Bound_Rotation = decltype(bound_rotation);
+    if constexpr (std::is_same_v<Bound_Rotation,
+                                 Pos3<Float32, Float32, Float32>>) {
+      auto x = bound_rotation.x.value;
+      auto y = bound_rotation.y.value;
+      auto z = bound_rotation.z.value;
+      return Fixed_Rotate<decltype(bound_position)>{
+          bound_position, std::sin(x), std::cos(x), std::sin(y),
+          std::cos(y),    std::sin(z), std::cos(z)};
+    } else {
+      return Rotate<decltype(bound_position), Bound_Rotation>{bound_position,
+                                                              bound_rotation};
+    }
+  }
+  auto eval(const Point &point) const {
+    auto r = rotation.eval(point);
+    return rotate_position(position.eval(point), sin_lanes(r.x),
+                           cos_lanes(r.x), sin_lanes(r.y), cos_lanes(r.y),
+                           sin_lanes(r.z), cos_lanes(r.z));
+  }
+};
+
+template <typename P, typename D> struct Translate {
+  P position;
+  D delta;
+
+  auto bind(const float *uniforms) const {
+    return Translate<decltype(position.bind(uniforms)),
+                     decltype(delta.bind(uniforms))>{position.bind(uniforms),
+                                                     delta.bind(uniforms)};
+  }
+  auto eval(const Point &point) const {
+    auto p = position.eval(point);
+    auto d = delta.eval(point);
+    return Position{p.x - d.x, p.y - d.y, p.z - d.z};
+  }
+};
+
+/* Builders, the same as ast::Ast's */
+
+constexpr Float32 as_node(float value) { return Float32{value}; }
+template <typename T> constexpr T as_node(T node) { return node; }
+template <typename T> using Node_For = decltype(as_node(std::declval<T>()));
+
+constexpr Float32 float32(float value) { return Float32{value}; }
+constexpr Uniform uniform(size_t index) { return Uniform{index}; }
+
+template <typename X, typename Y, typename Z>
+constexpr auto pos3(X x, Y y, Z z) {
+  return Pos3<Node_For<X>, Node_For<Y>, Node_For<Z>>{as_node(x), as_node(y),
+                                                     as_node(z)};
+}
+
+template <typename P, typename R, typename M>
+constexpr auto sphere(P position, R radius, M material) {
+  return Sphere<P, Node_For<R>, Node_For<M>>{position, as_node(radius),
+                                             as_node(material)};
+}
+
+template <typename P, typename X, typename Y, typename Z, typename M>
+constexpr auto box(P position, X wx, Y wy, Z wz, M material) {
+  return Box<P, Node_For<X>, Node_For<Y>, Node_For<Z>, Node_For<M>>{
+      position, as_node(wx), as_node(wy), as_node(wz), as_node(material)};
+}
+
+template <typename P, typename N, typename M>
+constexpr auto plane(P position, N normal, M material) {
+  return Plane<P, N, Node_For<M>>{position, normal, as_node(material)};
+}
+
+template <typename L, typename R> constexpr auto add(L lhs, R rhs) {
+  return Add<L, R>{lhs, rhs};
+}
+
+template <typename L, typename R> constexpr auto subtract(L lhs, R rhs) {
+  return Subtract<L, R>{lhs, rhs};
+}
+
+template <typename L, typename R> constexpr auto intersect(L lhs, R rhs) {
+  return Intersect<L, R>{lhs, rhs};
+}
+
+template <typename P, typename R>
+constexpr auto rotate(P position, R rotation) {
+  return Rotate<P, R>{position, rotation};
+}
+
+template <typename P, typename X, typename Y, typename Z>
+constexpr auto rotate(P position, X rx, Y ry, Z rz) {
+  return rotate(position, pos3(rx, ry, rz));
+}
+
+template <typename P, typename D>
+constexpr auto translate(P position, D translation) {
+  return Translate<P, D>{position, translation};
+}
+
+template <typename P, typename X, typename Y, typename Z>
+constexpr auto translate(P position, X dx, Y dy, Z dz) {
+  return translate(position, pos3(dx, dy, dz));
+}
+
+/* Running them */
+
+// evaluates `scene` for `count` points, the same as a compiled kernel would.
+// count has to be a multiple of `lanes`, but nothing needs to be aligned.
+template <typename Scene>
+void evaluate(const Scene &scene, void *xs, void *ys, void *zs,
+              const void *uniforms, void *distances, void *materials,
+              size_t count) {
+  auto load = [](void *base, size_t offset) {
+    Vec value;
+    memcpy(&value, static_cast<float *>(base) + offset, sizeof(value));
+    return value;
+  };
+  auto store = [](void *base, size_t offset, Vec value) {
+    memcpy(static_cast<float *>(base) + offset, &value, sizeof(value));
+  };
+
+  auto bound = scene.bind(static_cast<const float *>(uniforms));
+  for (size_t offset = 0; offset < count; offset += lanes) {
+    Point point{load(xs, offset), load(ys, offset), load(zs, offset)};
+    auto result = bound.eval(point);
+    store(distances, offset, widen<Vec>(result.distance));
+    store(materials, offset, widen<Vec>(result.material));
+  }
+}
+
+// a plain function with Executor::Function_Type's signature, for a scene
+// that's a constexpr variable
+template <const auto &scene>
+void kernel(void *xs, void *ys, void *zs, const void *uniforms,
+            void *distances, void *materials, size_t count) {
+  evaluate(scene, xs, ys, zs, uniforms, distances, materials, count);
+}
+
+} // namespace sdfjit::staticscene
@@ -5,7 +5,7 @@
 namespace sdfjit::util {
 
 bool floats_equal(const float a, const float b) {
-  return fabs(a - b) < 0.00001f;
+  return fabs(a - b) < float_tolerance;
 }
 
 } // namespace sdfjit::util
@@ -2,6 +2,9 @@
 
 namespace sdfjit::util {
 
+// how far apart floats_equal lets two floats be
+constexpr float float_tolerance = 0.00001f;
+
 bool floats_equal(const float a, const float b);
 
 } // namespace sdfjit::util
@@ -2,3 +2,7 @@
 
 #define LIKELY(x) __builtin_expect(!!(x), 1)
 #define UNLIKELY(x) __builtin_expect(!!(x), 0)
+
+// compile a function for a wider instruction set than the rest of the binary.
+// Only call these after checking the cpu supports it (see machinecode::Target)
+#define TARGET_ISA(isa) __attribute__((target(isa)))